@@ -3,25 +3,114 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h> 
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
 
+// the vector instructions used are part of the base instruction set of x86-64 and AArch64
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SHIM_NEON
+#endif
+
+#ifdef SHIM_BENCH
+#include <sys/wait.h>
+
+// the benchmark counts the allocations made by the editor, workers included
+static unsigned long bench_allocs;
+static unsigned long bench_frames; // frames drawn
+static unsigned long long bench_bytes; // bytes of the frames drawn
+
+static void* benchMalloc(size_t size) {
+  __sync_fetch_and_add(&bench_allocs, 1);
+  return malloc(size);
+}
+
+static void* benchRealloc(void* p, size_t size) {
+  __sync_fetch_and_add(&bench_allocs, 1);
+  return realloc(p, size);
+}
+
+static void* benchCalloc(size_t n, size_t size) {
+  __sync_fetch_and_add(&bench_allocs, 1);
+  return calloc(n, size);
+}
+
+#define malloc(size) benchMalloc(size)
+#define realloc(p, size) benchRealloc(p, size)
+#define calloc(n, size) benchCalloc(n, size)
+#endif
+
 #define SHIM_VERSION "0.0.1"
 #define SHIM_TAB_STOP 8 // tabulation length
-#define SHIM_QUIT_TIMES 3 // how many times Ctrl-Q must be pressed to exit
+#define SHIM_QUIT_TIMES 3 // how many times Ctrl-Q or Ctrl-W must be pressed to drop unsaved changes
+#define SHIM_ROW_LEAF_MAX 64 // how many rows each leaf of the row tree holds
+#define SHIM_ROW_NODE_MAX 32 // how many children each inner node of the row tree holds
+#define SHIM_HL_IDLE_MS 5 // how long to highlight in the background before checking for input
+#define SHIM_BRACKET_MS 5 // how long to look for the pair of a bracket before checking for input
+#define SHIM_SCREEN_GAP 8 // unchanged cells that are cheaper to skip over than to draw again
+#define SHIM_SEARCH_KEY_MS 10 // how long to count matches after each key of the search prompt
+#define SHIM_WORKERS 2 // threads that run the background jobs
+#define SHIM_JOB_MIN_ROWS 65536 // fewer stale rows than this are highlighted on the main thread
+#define SHIM_SEARCH_CHUNK 65536 // rows counted by each search job
+#define SHIM_SEARCH_RUN (1 << 20) // bytes of rows that follow each other in memory scanned at once
+#define SHIM_REGEX_MAX 1024 // longest search pattern that is compiled
+#define SHIM_REGEX_CACHE (1 << 20) // bytes of DFA states a search pattern may keep, they are built again past that
+#define SHIM_ESC_MS 100 // how long to wait for the rest of an escape sequence
+#define SHIM_LONG_LINE (1<<16) // rows at least this long are rendered and highlighted a chunk at a time
+#define SHIM_LINE_CHUNK 4096 // characters between the lexer states saved along a long row
+#define SHIM_PASTE_BURST 128 // bytes of text read at once past which they're a paste, without the paste markers
+#define SHIM_PASTE_MS 1000 // a paste that sends nothing for this long is over, even without its end
+#define SHIM_STATUS_MS 5000 // how long a status message is shown
+#define SHIM_FRAME_MS 16 // frames are drawn at most this often, except the one after a typed character
+#define SHIM_FRAME_STALE_MS 100 // input that keeps coming doesn't keep the screen from being drawn longer than this
+#define SHIM_SAVE_IOV 1024 // buffers written by each writev while saving
+#define SHIM_SAVE_FSYNC 1 // flush a saved file to the disk before it replaces the old one
+#define SHIM_SLAB_SIZE (256 << 10) // bytes allocated at once for the small blocks of row memory
+#define SHIM_UNDO_MAX (64 << 20) // bytes the undo journal may use, the oldest steps are dropped past that
+#define SHIM_FOLLOW_READ (1 << 20) // bytes of a followed file appended at most before checking for input
+#define SHIM_FOLLOW_MS 20 // the rows appended to a followed file are drawn at most this often
+#define SHIM_BUFFER_CACHE (64 << 20) // bytes of row memory past which the other buffers drop their render and hl
+#define SHIM_CACHE_MIN (1 << 20) // files at least this big keep their line index in the cache directory
+#define SHIM_CACHE_SAMPLES 64 // blocks of a file hashed to tell if it's the one the line index was made for
+#define SHIM_LOAD_FIRST (1 << 20) // bytes of a file split into rows before the first frame, a worker splits the rest
+#define SHIM_LOAD_CHUNK (8 << 20) // bytes of a file split into rows by each load job
+#define SHIM_COLD_MIN (32 << 20) // bytes of row memory past which the rows far from the screen are compressed
+#define SHIM_COLD_ROWS 16384 // rows above and below the screen that are never compressed
+#define SHIM_COLD_MS 1000 // how often the cold rows are looked for
+#define SHIM_COLD_BUDGET_MS 5 // how long each look may compress rows for
+#define SHIM_SAFE_SIZE (256LL << 20) // files at least this big open in safe mode, 0 for never
+#define SHIM_SAFE_ROWS (1 << 22) // so do files with at least this many lines
+#define SHIM_SAFE_LINE (1 << 20) // and files with a line at least this long
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+enum editorTimer {
+  TIMER_STATUS, // the status message expires
+  TIMER_FOLLOW, // rows were appended to a followed file
+  TIMER_COLD,   // rows far from the screen are compressed
+  TIMER_COUNT
+};
+
 enum editorKey {
   BACKSPACE = 127,
   ARROW_LEFT  = 1000,
@@ -33,6 +122,7 @@ enum editorKey {
   END_KEY,
   PAGE_UP,
   PAGE_DOWN,
+  PASTE_START, // the terminal sends the text of a bracketed paste after this key
 };
 
 enum editorHighlight {
@@ -48,10 +138,21 @@ enum editorHighlight {
   HL_ERROR, // to highlight syntax error
 };
 
+#define STYLE_INVERSE 32 // screen cell style for inverted colors, after all the highlight types
+#define STYLE_COUNT (STYLE_INVERSE + 1)
+
 // highlight flags
 #define HL_HIGHLIGHT_NUMBERS (1<<0) 
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 #define HL_HIGHLIGHT_SPECIAL (1<<2)
+#define HL_COMMENT_AFTER_SPACE (1<<3) // a single-line comment only starts a line or follows a space
+
+// row flags
+#define ROW_MAPPED (1<<0) // chars point into the file mapping, the row doesn't own them
+#define ROW_HL_STALE (1<<1) // the row was highlighted starting from an outdated comment state
+#define ROW_LONG (1<<2) // the row has lexer states saved along it in E.long_lines, its render and
+                        // hl only have the chunks on the screen
+#define ROW_PACKED (1<<3) // chars are compressed in the packed block of the leaf, they're NULL
 
 // for syntax highlight style
 #define RED(x)((x & 0xff0000) >> 16)
@@ -60,6 +161,64 @@ enum editorHighlight {
 #define IS_BOLD(x)(x & (1 << 24))
 #define IS_ITALIC(x)(x & (1 << 25))
 
+// lookup table for the keywords of a syntax, built when the syntax is selected
+// it's an open addressing hash table, so matching a word doesn't depend on how many keywords exist
+typedef struct keywordTable {
+  struct keywordSlot {
+    const char* word; // NULL for an empty slot
+    int len;
+    int hl; // highlight type of the keyword
+  }* slots;
+  unsigned int mask; // number of slots - 1, the number of slots is a power of two
+  // for each first character, bit n is set if a keyword of length n starts with it,
+  // bit 31 for the longer ones, so most words are told apart without being hashed
+  unsigned int lens[256];
+} KEYWORD_TABLE;
+
+// lexer modes, the states of the table that drives editorLexRun
+enum lexMode {
+  LEX_CODE = 0, // after a separator, where a keyword or a number can start
+  LEX_WORD, // inside a word, or right after a token
+  LEX_STRING2, // inside a "string"
+  LEX_STRING1, // inside a 'string'
+  LEX_COMMENT, // inside a multi-line comment
+  LEX_SPECIAL_GAP, // on a special line like a preprocessor directive, between its words
+  LEX_SPECIAL_RUN, // on a special line, inside a word
+  LEX_SPECIAL_COMMENT, // inside a multi-line comment that started on a special line
+  LEX_MODES
+};
+
+// the mode saved along a long row after the start of a single-line comment, which goes on to the
+// end of the row, the lexer never runs in it
+#define LEX_REST_COMMENT LEX_MODES
+
+// a table entry for a character that the lexer has to look at more closely,
+// the other entries are the next mode << 8 | the highlight of the character
+#define LEX_SLOW 0xffff
+
+// character classes
+#define CC_SEP (1<<0) // ends a word
+#define CC_SPACE (1<<1)
+
+// what a character may start where a token can start, with the flags of the syntax applied
+#define LEX_ACT_SCS (1<<0) // a single-line comment
+#define LEX_ACT_MCS (1<<1) // a multi-line comment
+#define LEX_ACT_SPECIAL (1<<2) // a special line
+#define LEX_ACT_STRING (1<<3)
+#define LEX_ACT_NUMBER (1<<4)
+#define LEX_ACT_KEYWORD (1<<5)
+
+typedef struct syntaxTables {
+  KEYWORD_TABLE keywords;
+  KEYWORD_TABLE specials;
+  // lengths of the comment delimiters
+  int scs_len, mcs_len, mce_len;
+  unsigned char cls[256]; // class of each character
+  unsigned char act[256]; // LEX_ACT_* flags of each character
+  int plain_words; // no character inside a word may start a token, so a word can be skipped whole
+  unsigned short next[LEX_MODES][256]; // what each character does in each mode
+} SYNTAX_TABLES;
+
 typedef struct editorSyntax {
   char* filetype;
   char** filematch;
@@ -72,19 +231,180 @@ typedef struct editorSyntax {
   char* multiline_comment_start;
   char* multiline_comment_end;
   int flags;
+  char* separators; // punctuation that ends a word besides spaces and brackets, or NULL for the default
+  SYNTAX_TABLES* tables; // compiled from the fields above when the syntax is first selected
 } editorSyntax;
 
+struct rowLeaf;
+
 typedef struct editor_row {
-  int idx;
+  struct rowLeaf* leaf; // leaf of the row tree that stores this row
   int size;
   int rsize;
   char* chars;
-  char* render; // actual characters to drawn on the screen for that row of text
+  int chars_cap;  // bytes of the block that holds chars, 0 if they are in the file mapping
+  int render_cap; // bytes of the block that holds the tab table, hl and render
+  char* render; // actual characters to drawn on the screen for that row of text, chars if it has no tabs
   unsigned char* hl; // highlight config
   int hl_open_comment;
+  int flags;
+  unsigned int gen; // E.snap_gen when the characters were allocated
+  int ntabs;        // tabs in chars, when the row is rendered
 } E_ROW;
 
+// how the depth of each pair of brackets, () [] and {}, changes over some rows:
+// the net change and the lowest depth reached, relative to the depth at the start
+typedef struct bracketSum {
+  int net[3];
+  int min[3];
+} BRACKET_SUM;
+
+// the rows of the file are kept in a B+tree, every node counts the rows and bytes below it,
+// so finding, inserting or deleting a row, or the row at a byte offset, only touches one root-to-leaf path
+typedef struct rowNode {
+  struct rowNode* parent;
+  int is_leaf;
+  int count; // number of children of an inner node, or number of rows of a leaf
+  int nrows; // number of rows stored in the whole subtree
+  long long bytes; // characters of the rows of the subtree, plus the newline after each one
+  BRACKET_SUM br; // brackets of the whole subtree, outside of strings and comments
+  int br_valid;   // if br is up to date, then it's also up to date in all the subtree
+} ROW_NODE;
+
+typedef struct rowInner {
+  ROW_NODE node;
+  ROW_NODE* child[SHIM_ROW_NODE_MAX];
+} ROW_INNER;
+
+typedef struct rowLeaf {
+  ROW_NODE node;
+  char* packed;    // compressed characters of the rows with the ROW_PACKED flag, one after the other
+  int packed_len;  // bytes of packed
+  int packed_raw;  // bytes of the characters once uncompressed
+  unsigned int packed_gen; // E.snap_gen when packed was allocated
+  E_ROW rows[SHIM_ROW_LEAF_MAX];
+} ROW_LEAF;
+
+// append buffer, a dynamic string for screen description
+typedef struct abuf {
+  char* b;
+  int len;
+  int cap; // allocated size of b
+} A_BUF;
+
+#define A_BUF_INIT {NULL, 0, 0} 
+
+// where the lexer is in a line, between two tokens
+typedef struct lexState {
+  int mode; // enum lexMode
+} LEX_STATE;
+
+// lexer state saved at some position of a long row, highlighting can start again from there
+typedef struct lineChunk {
+  int start;
+  int rx; // render index of start
+  int state; // packed by lexStatePack
+  int tabs; // tabs up to the start of the next chunk
+} LINE_CHUNK;
+
+// the chunks of a long row, found through the block of its hl
+typedef struct longLine {
+  unsigned char* hl;
+  LINE_CHUNK* chunks; // in order of start
+  int nchunks, cap;
+  int lexed; // the chunks below this one have a known state and start where the lexer stopped
+  int first, last; // the chunks in the render and the hl of the row, none when first > last
+} LONG_LINE;
+
+// a frame of the screen as a grid of cells, each one has a character and a style
+typedef struct screenGrid {
+  char* chars;
+  unsigned char* styles; // an editorHighlight value or STYLE_INVERSE
+} SCREEN_GRID;
+
+// a row that contains matches of the search query
+typedef struct searchRow {
+  int row;          // index of the row
+  int count;        // matches on the row
+  long long before; // matches on the rows above it
+} SEARCH_ROW;
+
+// matches of the search query, counted from the top of the file a slice at a time
+typedef struct editorSearch {
+  char* query; // query the matches are counted for, NULL when not searching
+  int qlen;
+  struct regex* re;  // the query compiled, NULL if it's empty or wrong
+  const char* error; // what's wrong with the query
+  SEARCH_ROW* rows; // rows that contain matches, in file order
+  int nrows, cap;
+  int scanned;       // rows above this one have been counted
+  long long total;   // matches on the counted rows
+  long long current; // position of the match under the cursor, 0 if not known yet
+  unsigned long gen; // changes with the query, to tell the results of old jobs apart
+  int jobs;          // search jobs running
+  unsigned long job_gen; // gen of the last job started
+} E_SEARCH;
+
+// changes kept in the undo journal, each one is undone by the change next to it
+enum editorUndoType {
+  UNDO_INSERT_CHARS, // characters inserted in a row
+  UNDO_DELETE_CHARS, // characters deleted from a row
+  UNDO_INSERT_ROW,   // a row inserted
+  UNDO_DELETE_ROW    // a row deleted
+};
+
+// what the changes of an undo step come from, runs of typing or erasing make a single step
+enum editorUndoKind {
+  UNDO_EDIT,
+  UNDO_TYPING,
+  UNDO_ERASING
+};
+
+// a change in the undo journal, followed by the characters it inserted or deleted
+typedef struct undoRecord {
+  int size;           // bytes of the record and its characters
+  int prev;           // size of the record before it, 0 for the first one
+  unsigned char type; // an editorUndoType value
+  unsigned char step; // if the change starts an undo step
+  int y, x, len;      // row and column of the characters, and how many there are
+  int cy, cx;         // for the first change of a step, the cursor before the step
+  int ay, ax;         // and after it
+} UNDO_RECORD;
+
+// the changes made to the rows, as records laid out one after the other in a single arena
+typedef struct editorUndo {
+  char* buf;
+  long len, cap;
+  long pos;    // the records from here on were undone and can be redone
+  long last;   // offset of the record just before pos, or -1
+  long head;   // offset of the first record of the step being recorded, or -1
+  long saved;  // pos when the file was saved, or -1 once undo and redo can't get back there
+  int kind;    // an editorUndoKind value, what the step being recorded comes from
+  int paused;  // changes aren't recorded while they are undone, redone or loaded from a file
+  int lost;    // the step being recorded didn't fit, so it isn't recorded
+} E_UNDO;
+
+// the file being followed, new lines written at its end are appended to the rows as in tail -f
+typedef struct editorFollow {
+  int fd;          // the file, -1 when not following
+  int notify;      // inotify instance that tells when the file changes
+  off_t offset;    // bytes of the file already in the rows, set by editorOpen
+  int open_line;   // the last row didn't end with a newline, the next bytes continue it
+  int pending;     // the file may have bytes that weren't read yet
+  char* buf;
+} E_FOLLOW;
+
+// the part of a mapped file that is still being split into rows, by a job on a worker
+typedef struct editorLoad {
+  size_t offset;       // bytes of the mapping already in the rows
+  int longest;         // longest row loaded so far
+  struct loadJob* job; // the job splitting the next chunk, NULL once the whole file is loaded
+  struct timespec start;
+} E_LOAD;
+
+// the state of the current buffer, along with what all the buffers share, see editorBufferShare
 struct editorConfig {
+  int id;             // tells the buffer apart from the others, jobs find their buffer with it
   int curr_x, curr_y; // cursor's position coordinates within the file
   int render_x;       // index into the row render field
   int rowoff;         // row offset for scrolling control
@@ -93,17 +413,191 @@ struct editorConfig {
   int screencols;     // screen width
   int numrows;        // number of rows in the source file
   int row_num_offset;
-  E_ROW* row;
+  ROW_NODE* rowtree;  // root of the tree that stores the rows of the file
+  ROW_LEAF* rowcache; // last leaf looked up, makes sequential row access O(1)
+  int rowcache_base;  // index of the first row stored in rowcache
+  char* map;          // read-only mapping of the file, for rows loaded lazily
+  size_t mapsize;
+  struct timespec map_mtime; // modification time of the file when it was mapped
+  int safe;           // editorSafeReason flags, why the buffer is in safe mode
+  int hl_stale;       // number of rows that must be highlighted again
+  int hl_stale_from;  // no row above this one is stale
+  int match_pending;  // the pair of the bracket under the cursor is looked for while idle
   int dirty;          // tell if a text buffer has been modified
   char* filename;
   char statusmsg[80];
   time_t statusmsg_time; // timestamp when set the status message
+  int prompting;      // a prompt is waiting for a key, its message doesn't expire
   struct editorSyntax* syntax; // current editorSyntax config
+  struct editorSyntax* syntaxes; // loaded from syntax definition files, tried before HLDB
+  int nsyntaxes;
+  E_SEARCH search;    // state of the incremental search
+  E_UNDO undo;        // changes that can be undone and redone
+  E_FOLLOW follow;    // lines appended to the file while it's open
+  E_LOAD load;        // rows of the file that aren't there yet
+  int cold_next;      // row where the next look for leaves to compress starts
+  unsigned long edits; // counts the changes to the rows
+  int edit_low;       // lowest row changed since the last highlight job started
+  struct snapshot* snap; // last snapshot taken, while the rows haven't changed since
+  int snapshots;      // snapshots not released yet
+  unsigned int snap_gen; // incremented when a snapshot is taken
+  unsigned int shared_gen; // characters allocated up to this gen may be read by a snapshot
+  struct buriedChars* graveyard; // characters to free once there are no snapshots left
+  int graveyard_len, graveyard_cap;
+  LONG_LINE* long_lines; // lexer states of the rows with the ROW_LONG flag
+  int nlong_lines, long_lines_cap;
+  int hl_jobs;        // highlight jobs running
+  int save_jobs;      // save jobs running
+  SCREEN_GRID front;  // what the terminal is showing
+  SCREEN_GRID back;   // frame being drawn
+  int gridrows, gridcols;
+  int front_valid;    // if the front grid matches the terminal
+  int front_rowoff, front_coloff; // offsets the front grid was drawn with
+  A_BUF frame;        // output of the last frame, its memory is reused by the next one
+  char sgr[STYLE_COUNT][48]; // escape sequence that selects each cell style
+  int sgr_len[STYLE_COUNT];
   struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+// a buffer that isn't the current one
+typedef struct editorBuffer {
+  struct editorConfig state; // E as it was when another buffer became the current one
+  unsigned long last_used;   // when it stopped being the current one
+  int cached;                // if its rows may still have their render and hl
+  int cold;                  // if its rows were compressed since it stopped being the current one
+} E_BUFFER;
+
+// the open buffers, the current one lives in E and its slot in the list is out of date
+struct editorBuffers {
+  E_BUFFER* list;
+  int len, cap;
+  int current;        // index of the buffer in E
+  int next_id;
+  unsigned long clock; // counts the switches between buffers
+};
+
+struct editorBuffers B;
+
+// a copy of the row list at some point in time, for the jobs that read the file on a worker thread
+// the characters themselves aren't copied, rows copy them before modifying them instead,
+// and compressed rows are read from the block of their leaf
+typedef struct snapRow {
+  const char* chars; // NULL for a compressed row
+  int size;
+  int mapped; // chars point into the file mapping
+  int block;  // block that holds the compressed row, -1 for none
+  int offset; // of the row in the block once uncompressed
+} SNAP_ROW;
+
+// the compressed characters of a leaf, as a snapshot reads them
+typedef struct snapBlock {
+  const char* packed;
+  int len; // bytes of packed
+  int raw; // bytes once uncompressed
+} SNAP_BLOCK;
+
+typedef struct snapshot {
+  SNAP_ROW* rows;
+  int nrows;
+  SNAP_BLOCK* blocks;
+  int nblocks;
+  int refs;            // jobs using the snapshot, plus one while it's cached in E.snap
+  unsigned long edits; // value of E.edits when it was taken
+} SNAPSHOT;
+
+// a job runs on a worker thread, then its result is collected on the main thread
+// the structures of specific jobs start with an EDITOR_JOB
+typedef struct editorJob {
+  void (*run)(struct editorJob* job);  // called on a worker thread
+  void (*done)(struct editorJob* job); // called on the main thread once run returned, frees the job
+  SNAPSHOT* snap;
+  int buffer; // id of the buffer it was submitted from, done is called with that buffer in E
+  struct editorJob* next;
+} EDITOR_JOB;
+
+// the worker threads and their queues, shared by everything that runs in the background
+struct editorWorkers {
+  pthread_t threads[SHIM_WORKERS];
+  pthread_mutex_t lock;   // protects the two lists below
+  pthread_cond_t ready;   // signaled when a job is queued
+  EDITOR_JOB *queue, *queue_tail; // jobs waiting for a worker
+  EDITOR_JOB *finished, *finished_tail; // jobs waiting for their done callback
+  int pipe[2];  // a byte is written to it for every finished job, to wake up the main thread
+  int running;  // jobs submitted and not collected yet, only used by the main thread
+};
+
+struct editorWorkers W;
+
+// the event loop waits for input, resizes, timers and finished jobs all at once
+struct editorLoop {
+  char input[4096]; // bytes read from the terminal that haven't been turned into keys yet
+  int inlen, inpos;
+  int wake[2];      // self-pipe, the SIGWINCH handler writes to it
+  struct {
+    double when;    // time to fire at on the monotonic clock in ms, 0 if the timer isn't set
+    void (*fire)();
+  } timers[TIMER_COUNT];
+  int redraw;       // the screen must be drawn again, see editorScheduleFrame
+  int urgent;       // the frame shows a typed character, it doesn't wait for SHIM_FRAME_MS
+  double last_frame; // when the last frame was drawn
+};
+
+struct editorLoop L;
+
+// the memory of the rows is allocated in blocks of a few sizes, carved from large slabs
+// and reused once freed, without a header in front of each block
+// the rows keep the size of their blocks, and grow in place while their characters fit
+#define ROW_MEM_CLASSES 15
+#define ROW_MEM_SMALL 2048 // bigger blocks come from malloc
+
+struct rowMemory {
+  void* free[ROW_MEM_CLASSES]; // freed blocks of each size, linked through their first bytes
+  char* slab;                  // unused part of the last slab
+  size_t slab_left;
+  unsigned char class_of[ROW_MEM_SMALL / 8 + 1]; // size class of each multiple of 8 bytes
+  long long slab_bytes;  // allocated in slabs
+  long long free_bytes;  // in the free lists
+  long long big_bytes;   // in blocks from malloc
+};
+
+struct rowMemory M;
+
+// the rows far from the screen have their characters compressed a leaf at a time, and their
+// render and hl dropped, they are uncompressed when a row of the leaf is looked up again
+struct coldStorage {
+  long long raw_bytes;    // characters of the packed leaves, uncompressed
+  long long packed_bytes; // what they take compressed
+  unsigned long lookups;  // leaves looked up with editorRowAt, rows of the same leaf in a row count once
+  unsigned long unpacks;  // of them, the ones that had to be uncompressed
+  ROW_LEAF* last;         // leaf of the last lookup
+  const char* view_block; // block uncompressed in view by rowTreeChars
+  char* view;
+  int view_cap;
+};
+
+struct coldStorage C;
+
+static const int row_mem_sizes[ROW_MEM_CLASSES] = {
+  16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, ROW_MEM_SMALL
+};
+
+// characters of a row that a snapshot may still be reading
+typedef struct buriedChars {
+  char* chars;
+  int cap; // -1 for the compressed block of a leaf, from malloc
+} BURIED_CHARS;
+
+// reads the rows of a snapshot on a worker thread, the compressed ones are uncompressed
+// into a copy of its own, a block at a time
+typedef struct snapReader {
+  SNAPSHOT* snap;
+  int block; // block uncompressed in buf, -1 for none
+  char* buf;
+  int cap;
+} SNAP_READER;
+
 char* C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
 char* C_HL_keywords[] = {
   "switch", "if", "do", "while", "for", "break", "continue", "return", "else", "goto", // statements
@@ -127,7 +621,9 @@ editorSyntax HLDB[] = { // highlight database
     C_HL_specials,   // special tokens
     '#', // '\\', '\n',  // C preprocessor as special highlight
     "//", "/*", "*/", // syntax for comments
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_SPECIAL // flags
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_SPECIAL, // flags
+    NULL, // default separators
+    NULL // compiled tables
   },
 };
 
@@ -135,23 +631,43 @@ editorSyntax HLDB[] = { // highlight database
 
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
+void editorScroll();
+void editorHandleResize();
+void editorUpdateRow(E_ROW* row);
+void editorFollowEvents();
+void editorFollowRead();
+void editorMatchRestore();
+int editorMatchClosingCallback();
+void bracketEditBegin(E_ROW* row);
+void bracketEditEnd(E_ROW* row);
+void editorHighlightPending(int upto, double budget_ms);
+int editorSearchPending();
+void editorSearchCount(double budget_ms);
+void editorSearchUpdateCurrent();
+void editorSearchStartJob();
+int editorJobsFinish();
+int editorBufferFind(int id);
+void editorBufferEnter(int at);
+void editorBufferInit();
+int editorHighlightStartJob();
+void editorSnapshotRelease(struct snapshot* snap);
+void editorBuryChars(char* chars, int cap);
+void rowLeafUnpack(ROW_LEAF* leaf);
+void rowLeafDropPacked(ROW_LEAF* leaf);
 char* editorPrompt(char* prompt, void (*callback)(char*, int));
 
-// append buffer, a dynamic string for screen description
-typedef struct abuf {
-  char* b;
-  int len;
-} A_BUF;
-
-#define A_BUF_INIT {NULL, 0} 
-
 void abAppend(A_BUF* ab, const char* s, int len) {
-  char* new = realloc(ab->b, ab->len + len);
-  if(!new) return;
-
+  if(ab->len + len > ab->cap) {
+    // grow geometrically, so appending is amortized O(1)
+    int cap = ab->cap ? ab->cap : 1024;
+    while(cap < ab->len + len) cap *= 2;
+    char* new = realloc(ab->b, cap);
+    if(!new) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
   // "append" s to the string buffer 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
@@ -166,7 +682,8 @@ void die(const char* s) {
 }
 
 void disableRawMode() {
-  // clear the screen and reposition the cursor
+  // turn off bracketed paste, clear the screen and reposition the cursor
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[1;1H", 6);
 
@@ -202,41 +719,277 @@ void enableRawMode() {
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // local flags
 
   // control characters flags
+  // read() returns right away even without input, the event loop polls before reading
   raw.c_cc[VMIN] = 0; // sets minimum number of bytes of input needed before read() can return
-  raw.c_cc[VTIME] = 1; // sets the maximum ammount of time to wait before read() returns, in a tenths of a second
+  raw.c_cc[VTIME] = 0; // sets the maximum ammount of time to wait before read() returns, in a tenths of a second
 
   if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+  // ask the terminal to bracket pasted text with "\x1b[200~" and "\x1b[201~",
+  // so that it can be told apart from typed keys
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey(int fd) {
-  int nread;
-  char c;
+int editorInputPending(int fd) {
+  // check if there is input to read without blocking
+  if(L.inpos < L.inlen) return 1;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+double editorNowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+#ifdef SHIM_PROBES
+// timing probes around the stages of the editor, built by make probes
+// Ctrl-P shows what the last frame cost in the message bar, and with SHIM_TRACE=file in the
+// environment every stage is written to the file as a trace event that chrome://tracing reads
+enum editorProbe {
+  PROBE_KEY,       // handling a key
+  PROBE_FRAME,     // drawing a frame, with the stages below in it
+  PROBE_HIGHLIGHT, // highlighting rows
+  PROBE_DRAW,      // putting the rows in the back grid
+  PROBE_WRITE,     // writing the frame to the terminal
+  PROBE_SEARCH,    // looking for and counting matches
+  PROBE_COUNT
+};
+
+static const char* probe_names[PROBE_COUNT] = {"key", "frame", "highlight", "draw", "write", "search"};
+
+struct editorProbes {
+  double start[PROBE_COUNT]; // when the outermost running probe started
+  int depth[PROBE_COUNT];    // a stage may run inside itself, only the outermost one counts
+  double ms[PROBE_COUNT];    // time spent since the last frame was drawn
+  double last_ms[PROBE_COUNT]; // and up to the last frame
+  long rows, last_rows;      // rows highlighted
+  long bytes, last_bytes;    // bytes written
+  int overlay;               // if the message bar shows the numbers of the last frame
+  FILE* trace;
+  double epoch;
+};
+
+struct editorProbes P;
+
+void probeTraceEnd() {
+  fprintf(P.trace, "\n]\n");
+  fclose(P.trace);
+}
+
+void probeInit() {
+  memset(&P, 0, sizeof(P));
+  P.epoch = editorNowMs();
+  const char* path = getenv("SHIM_TRACE");
+  if(!path) return;
+  P.trace = fopen(path, "w");
+  if(!P.trace) die("SHIM_TRACE");
+  fprintf(P.trace, "[\n");
+  atexit(probeTraceEnd);
+}
+
+void probeBegin(int id) {
+  if(P.depth[id]++ == 0) P.start[id] = editorNowMs();
+}
+
+void probeEnd(int id) {
+  if(--P.depth[id] > 0) return;
+  double now = editorNowMs();
+  P.ms[id] += now - P.start[id];
+  if(P.trace) {
+    // complete events in microseconds, the first one isn't preceded by a comma
+    static int events = 0;
+    fprintf(P.trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":1,\"tid\":1}",
+      events++ ? ",\n" : "", probe_names[id], (P.start[id] - P.epoch) * 1e3, (now - P.start[id]) * 1e3);
+  }
+  if(id == PROBE_FRAME) {
+    // the numbers shown are the ones of a whole frame
+    memcpy(P.last_ms, P.ms, sizeof(P.ms));
+    memset(P.ms, 0, sizeof(P.ms));
+    P.last_rows = P.rows;
+    P.last_bytes = P.bytes;
+    P.rows = P.bytes = 0;
+  }
+}
+
+#define PROBE_BEGIN(id) probeBegin(id)
+#define PROBE_END(id) probeEnd(id)
+#define PROBE_ROWS(n) (P.rows += (n))
+#define PROBE_BYTES(n) (P.bytes += (n))
+#else
+#define PROBE_BEGIN(id)
+#define PROBE_END(id)
+#define PROBE_ROWS(n)
+#define PROBE_BYTES(n)
+#endif
+
+void editorTimerSet(int id, double ms, void (*fire)()) {
+  // call fire from the event loop in ms milliseconds
+  L.timers[id].when = editorNowMs() + ms;
+  L.timers[id].fire = fire;
+}
+
+double editorRunTimers() {
+  // fire the timers that are due, returns the ms until the next one or -1 if none is set
+  double now = editorNowMs(), next = -1;
+  for(int id = 0; id < TIMER_COUNT; id++) {
+    if(L.timers[id].when == 0) continue;
+    if(L.timers[id].when <= now) {
+      L.timers[id].when = 0;
+      L.timers[id].fire();
+      now = editorNowMs();
+      if(L.timers[id].when == 0) continue; // unless it set itself again
+    }
+    if(next < 0 || L.timers[id].when - now < next) {
+      next = L.timers[id].when > now ? L.timers[id].when - now : 0;
+    }
+  }
+  return next;
+}
+
+void editorLoopInit() {
+  if(pipe(L.wake) == -1) die("pipe");
+  fcntl(L.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(L.wake[1], F_SETFL, O_NONBLOCK);
+  L.inlen = L.inpos = 0;
+  for(int id = 0; id < TIMER_COUNT; id++) L.timers[id].when = 0;
+  L.redraw = L.urgent = 0;
+  L.last_frame = 0;
+}
+
+void editorScheduleFrame(int urgent) {
+  // the screen has to be drawn again, the event loop draws it once the input that came in
+  // has been handled, so a burst of keys takes one frame rather than one per key
+  L.redraw = 1;
+  L.urgent |= urgent;
+}
+
+void editorScheduleRedraw() {
+  // for the timers, whose callbacks take no argument
+  editorScheduleFrame(0);
+}
+
+int editorFrameWait(int fd) {
+  // draw the frame that was asked for if it's due, returns how many ms until it is, or -1
+  // frames are drawn SHIM_FRAME_MS apart so that the terminal isn't sent more than it can show,
+  // but the one right after a typed character is drawn as soon as there's no more input
+  if(!L.redraw) return -1;
+  double since = editorNowMs() - L.last_frame;
+  int pending = editorInputPending(fd);
+  if((!pending && (L.urgent || since >= SHIM_FRAME_MS)) || since >= SHIM_FRAME_STALE_MS) {
+    editorRefreshScreen();
+    return -1;
+  }
+  return pending ? 0 : (int) (SHIM_FRAME_MS - since) + 1;
+}
 
-  // wait until a keypress occurr
-  while((nread = read(fd, &c, 1)) != 1) {
-    if(nread == -1 && errno != EAGAIN) die("read");
+int editorWaitInput(int fd, int timeout_ms) {
+  // run the event loop until there are bytes from the terminal in L.input
+  // with a timeout_ms that isn't negative, stop waiting after that long and return 0
+  double start = editorNowMs();
+  char buf[64];
+
+  while(L.inpos == L.inlen) {
+    int wait = -1;
+    double next = editorRunTimers();
+    if(next >= 0) wait = (int) next + 1;
+    // a frame isn't drawn in the middle of a key, while waiting for the rest of it
+    int frame = (timeout_ms < 0) ? editorFrameWait(fd) : -1;
+    if(frame >= 0 && (wait < 0 || frame < wait)) wait = frame;
+    if(timeout_ms >= 0) {
+      int left = timeout_ms - (int) (editorNowMs() - start);
+      if(left <= 0) return 0;
+      if(wait < 0 || left < wait) wait = left;
+    }
+    // rows are highlighted while there's nothing else to do, many of them are left to a worker
+    int idle = (E.hl_stale && !E.hl_jobs) || E.match_pending;
+    // the lines written to a followed file go after the rows of the file that are still loading
+    int follow = (E.follow.pending && !E.load.job);
+    if(idle || follow) wait = 0;
+
+    // poll skips the inotify instance while it's -1
+    struct pollfd pfd[4] = {{fd, POLLIN, 0}, {L.wake[0], POLLIN, 0}, {W.pipe[0], POLLIN, 0},
+                            {E.follow.notify, POLLIN, 0}};
+    int n = poll(pfd, 4, wait);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      die("poll");
+    }
+    if(pfd[1].revents & POLLIN) {
+      // the terminal has been resized
+      while(read(L.wake[0], buf, sizeof(buf)) > 0);
+      editorHandleResize();
+    }
+    if((pfd[2].revents & POLLIN) && editorJobsFinish()) {
+      // show what the background jobs have done
+      editorScheduleFrame(0);
+    }
+    if(pfd[3].revents & POLLIN) editorFollowEvents();
+    if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      // read all the input there is at once, a paste or a burst of keys takes one read
+      int nread = read(fd, L.input, sizeof(L.input));
+      if(nread > 0) {
+        L.inlen = nread;
+        L.inpos = 0;
+      } else if(nread == 0 || (errno != EAGAIN && errno != EINTR)) {
+        die("read");
+      }
+    } else if(follow) {
+      // a burst of lines is appended a piece at a time, with a look at the input in between
+      editorFollowRead();
+    } else if(n == 0 && E.match_pending) {
+      // the pair of a bracket far away is looked for a piece at a time
+      if(editorMatchClosingCallback()) editorScheduleFrame(0);
+    } else if(n == 0 && idle) {
+      if(!editorHighlightStartJob()) editorHighlightPending(E.numrows, SHIM_HL_IDLE_MS);
+    }
   }
+  return 1;
+}
+
+int editorReadByte(int fd, char* c, int timeout_ms) {
+  // get the next byte of input, returns 0 if none came within timeout_ms
+  if(!editorWaitInput(fd, timeout_ms)) return 0;
+  *c = L.input[L.inpos++];
+  return 1;
+}
+
+int editorReadKey(int fd) {
+  char c = '\0';
+
+  // wait until a keypress occurr, a read without a timeout only returns with a byte
+  if(!editorReadByte(fd, &c, -1)) return c;
+  // whatever the key does is drawn in the next frame, what a typed character looks like
+  // is shown right away, the other keys may share a frame
+  editorScheduleFrame(c == '\t' || (c >= 32 && c < 127));
   
   if(c == '\x1b') {
     // parse escape sequence
     char seq[3];
     
-    if(read(fd, &seq[0], 1) != 1) return c;
-    if(read(fd, &seq[1], 1) != 1) return c;
+    if(!editorReadByte(fd, &seq[0], SHIM_ESC_MS)) return c;
+    if(!editorReadByte(fd, &seq[1], SHIM_ESC_MS)) return c;
 
     if(seq[0] == '[') { 
       if(seq[1] >= '0' && seq[1] <= '9') {
-        if(read(fd, &seq[2], 1) != 1) return c;
-        if(seq[2] == '~') {
-          switch(seq[1]) {
-            case '1' : return HOME_KEY;
-            case '3' : return DEL_KEY;
-            case '4' : return END_KEY;
-            case '5' : return PAGE_UP;
-            case '6' : return PAGE_DOWN;
-            case '7' : return HOME_KEY;
-            case '8' : return END_KEY;
-          }
+        // a number ended by '~'
+        int num = seq[1] - '0';
+        while(1) {
+          if(!editorReadByte(fd, &seq[2], SHIM_ESC_MS)) return c;
+          if(seq[2] == '~') break;
+          if(seq[2] < '0' || seq[2] > '9' || num > 1000) return c;
+          num = num * 10 + seq[2] - '0';
+        }
+        switch(num) {
+          case 1 : return HOME_KEY;
+          case 3 : return DEL_KEY;
+          case 4 : return END_KEY;
+          case 5 : return PAGE_UP;
+          case 6 : return PAGE_DOWN;
+          case 7 : return HOME_KEY;
+          case 8 : return END_KEY;
+          case 200 : return PASTE_START;
         }
       }
       else {
@@ -260,6 +1013,71 @@ int editorReadKey(int fd) {
   return c;
 }
 
+int editorIsTextByte(int c) {
+  // tells if a byte of input is text to insert as it is, when it comes with others
+  return c == '\t' || c == '\r' || c == '\n' || (c >= 32 && c != 127);
+}
+
+int editorCleanText(char* s, int len) {
+  // turn "\r\n" and "\r" into '\n' and drop the other control characters, in place
+  // returns the new length
+  int n = 0;
+  for(int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if(c == '\r') {
+      if(i + 1 < len && s[i + 1] == '\n') i++;
+      s[n++] = '\n';
+    } else if(editorIsTextByte(c)) {
+      s[n++] = c;
+    }
+  }
+  return n;
+}
+
+char* editorReadPaste(int fd, int* len) {
+  // read the text of a bracketed paste, after PASTE_START, up to the sequence that ends it
+  static const char end[] = "\x1b[201~";
+  int endlen = sizeof(end) - 1;
+  int cap = 1024, n = 0;
+  char* buf = malloc(cap);
+  if(!buf) die("editorReadPaste");
+
+  char c;
+  while(editorReadByte(fd, &c, SHIM_PASTE_MS)) {
+    if(n == cap) {
+      cap *= 2;
+      char* grown = realloc(buf, cap);
+      if(!grown) die("editorReadPaste");
+      buf = grown;
+    }
+    buf[n++] = c;
+    if(n >= endlen && !memcmp(&buf[n - endlen], end, endlen)) {
+      n -= endlen;
+      break;
+    }
+  }
+  *len = editorCleanText(buf, n);
+  return buf;
+}
+
+char* editorReadBurst(char first, int* len) {
+  // a key that comes with at least SHIM_PASTE_BURST bytes of text in the same read is part of
+  // a paste from a terminal that doesn't bracket them, take all the text read along with it
+  // returns NULL otherwise, fast typing and key repeat are handled a key at a time
+  if(!editorIsTextByte((unsigned char) first)) return NULL;
+
+  int n = 1;
+  while(L.inpos + n - 1 < L.inlen && editorIsTextByte((unsigned char) L.input[L.inpos + n - 1])) n++;
+  if(n < SHIM_PASTE_BURST) return NULL;
+  char* buf = malloc(n);
+  if(!buf) die("editorReadBurst");
+  buf[0] = first;
+  memcpy(&buf[1], &L.input[L.inpos], n - 1);
+  L.inpos += n - 1;
+  *len = editorCleanText(buf, n);
+  return buf;
+}
+
 int getCursorPosition(int* rows, int *cols) {
   char buffer[32];
   unsigned int i = 0;
@@ -269,7 +1087,9 @@ int getCursorPosition(int* rows, int *cols) {
   // parse Cursor Position Report from input
   // a valid reply is in the form of '\x1b[24;80R', where 24 and 80 are screen height and width
   while (i < sizeof(buffer) - 1) {
-    if(read(STDIN_FILENO, &buffer[i], 1) != 1) break;
+    // read() doesn't wait for input, poll for the next byte of the report
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if(poll(&pfd, 1, SHIM_ESC_MS) != 1 || read(STDIN_FILENO, &buffer[i], 1) != 1) break;
     if (buffer[i] == 'R') break;
     i++;
   }
@@ -301,681 +1121,4769 @@ int getWindowSize(int* rows, int *cols) {
   } 
 }
 
-int is_bracket(int c) {
-  return strchr("()[]{}", c) != NULL;
+ROW_LEAF* rowTreeFind(int at, int* base) {
+  // find the leaf that holds the row 'at' and the index of its first row
+  // at == E.numrows finds the last leaf, where a new row can be appended
+  if(E.rowcache && at >= E.rowcache_base && 
+     (at < E.rowcache_base + E.rowcache->node.count ||
+      (at == E.numrows && E.rowcache_base + E.rowcache->node.count == at))) {
+    *base = E.rowcache_base;
+    return E.rowcache;
+  }
+  ROW_NODE* n = E.rowtree;
+  int b = 0;
+
+  while(!n->is_leaf) {
+    ROW_INNER* inner = (ROW_INNER*)n;
+    int i;
+    for(i = 0; i < n->count - 1; i++) {
+      if(at < b + inner->child[i]->nrows) break;
+      b += inner->child[i]->nrows; // skip all the rows of this subtree
+    }
+    n = inner->child[i];
+  }
+  E.rowcache = (ROW_LEAF*)n;
+  E.rowcache_base = b;
+  *base = b;
+  return E.rowcache;
 }
 
-int is_separator(int c) {
-  // checks if c is a separator character or not
-  // strchr looks for c in the given string and return a pointer to the matching character
-  return isspace(c) || is_bracket(c) || c == '\0' || strchr(",.+-/*!?=~%<>:;&|^\"\'\\", c) != NULL;
+E_ROW* rowTreeRow(int at) {
+  // the row 'at' as it is in the tree, its characters may be compressed
+  if(at < 0 || at >= E.numrows) return NULL;
+  int base;
+  ROW_LEAF* leaf = rowTreeFind(at, &base);
+  return &leaf->rows[at - base];
 }
 
-void editorUpdateSyntax(E_ROW* row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if(E.syntax == NULL) return; // if NULL, no syntax highlight should be done
-  
-  char** keywords = E.syntax->keywords;
-  char** specials = E.syntax->specials;
-
-  char* scs = E.syntax->singleline_comment_start;
-  char* mcs = E.syntax->multiline_comment_start;
-  char* mce = E.syntax->multiline_comment_end;
-  
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  // if the previous character was a separator
-  int prev_sep = 1; // assume true with the beginning of the line as a separator
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-  int in_special = 0;
-
-  int i = 0;
-  while(i < row->rsize) {
-    char c = row->render[i];
-    
-    if(scs_len && !in_string && !in_comment) {
-      if(!strncmp(&row->render[i], scs, scs_len)) {
-        // if is starting a single-line comment
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-    
-    if(mcs_len && mce_len && !in_string) {
-      if(in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if(!strncmp(&row->render[i], mce, mce_len)) { // finishing ml comment
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++; continue;
-        }
-      } else if(!strncmp(&row->render[i], mcs, mcs_len)) { // starting ml comment
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1; 
-        continue;
-      }
-    }
+E_ROW* editorRowAt(int at) {
+  if(at < 0 || at >= E.numrows) return NULL;
+  int base;
+  ROW_LEAF* leaf = rowTreeFind(at, &base);
+  if(leaf != C.last) {
+    C.lookups++;
+    C.last = leaf;
+  }
+  if(leaf->packed) rowLeafUnpack(leaf);
+  return &leaf->rows[at - base];
+}
 
-    if(E.syntax->flags & HL_HIGHLIGHT_SPECIAL) {
-      if(in_special) {
-        while(i < row->rsize && !isspace(c = row->render[i])) {
-          row->hl[i] = HL_SPECIAL;
-          i++;
-        }
-      }
-      else if(!in_string && c == E.syntax->special_start) {
-        int idx = i++;
-        while(isspace(c = row->render[i])) i++;
-        
-        for(int j = 0; specials[j]; j++){
-          int slen = strlen(specials[j]);
-          
-          if(!strncmp(&row->render[i], specials[j], slen) && // match special token
-             is_separator(row->render[i + slen])) {
-             
-            row->hl[idx] = HL_SPECIAL;
-            memset(&row->hl[i], HL_SPECIAL, slen);
-            in_special = 1; i += slen - 1;
-            prev_sep = 0; continue;
-          }
-        }
-      }
-    }
+int editorRowIndex(E_ROW* row) {
+  // compute the position of a row in the file by walking up to the root
+  ROW_LEAF* leaf = row->leaf;
+  int idx = row - leaf->rows;
+  if(leaf == E.rowcache) return E.rowcache_base + idx;
+
+  ROW_NODE* n = &leaf->node;
+  while(n->parent) {
+    ROW_INNER* parent = (ROW_INNER*)n->parent;
+    // count the rows of the siblings to the left of n
+    for(int i = 0; parent->child[i] != n; i++) idx += parent->child[i]->nrows;
+    n = n->parent;
+  }
+  return idx;
+}
 
-    if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if(in_string) {
-        row->hl[i++] = HL_STRING;
-        if(c == '\\' && i+1 < row->rsize) { // could be a '\'' or '\"' escape character 
-          row->hl[i] = HL_STRING;
-          i += 1;
-          continue;
-        }
-        if(c == in_string) in_string = 0; // closing quotes
-        prev_sep = 1;
-        continue;
-      } else {
-        if(c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i++] = HL_STRING;
-          continue;
-        }
-      }
+long long editorRowOffset(int at) {
+  // bytes of the text before the row 'at', as it would be saved
+  // at == E.numrows gives the size of the whole text
+  if(!E.rowtree) return 0;
+  if(at >= E.numrows) return E.rowtree->bytes;
+  ROW_NODE* n = E.rowtree;
+  long long off = 0;
+  int b = 0;
+
+  while(!n->is_leaf) {
+    ROW_INNER* inner = (ROW_INNER*)n;
+    int i;
+    for(i = 0; i < n->count - 1; i++) {
+      if(at < b + inner->child[i]->nrows) break;
+      b += inner->child[i]->nrows;
+      off += inner->child[i]->bytes;
     }
+    n = inner->child[i];
+  }
+  ROW_LEAF* leaf = (ROW_LEAF*)n;
+  for(int i = 0; i < at - b; i++) off += leaf->rows[i].size + 1;
+  return off;
+}
 
-    if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      
-      if(prev_sep && (isdigit(c) || 
-                     (c == '.' && i+1 < row->rsize && isdigit(row->render[i+1])))) {
-        int start = i;
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL; // previous highlight type
-        unsigned char curr_hl = HL_NORMAL;
-        int err_flag = 0; // if error in the highlight logic
-        int is_hexa = 0, is_octa = 0;
-        int count = 0; // count decimal points
-
-        do {
-          if(err_flag) {
-            i++; continue; // consume invalid input
-          }
-
-          if((is_octa && (c >= '0' && c <= '7')) ||
-             (is_hexa && (isdigit(c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f')))) {
-            prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
-
-          } else if (!is_octa && !is_hexa && (isdigit(c) && ((prev_sep && c != '0') || prev_hl == HL_NUMBER))) {
-            prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
-
-          } else if(!is_octa && !is_hexa && c == '.' && ++count == 1 && 
-                    (prev_hl == HL_NUMBER || prev_hl == HL_NORMAL)) { // parse numbers with decimal points
-            prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
-
-          } else if(prev_sep && c == '0') {
-		        
-            if(!is_hexa && !is_octa && i+1 < row->rsize) {
-            
-              c = row->render[i+1];            
-
-              if(isdigit(c)) { // octal 
-                is_octa = 1;
-              } else if(c == 'x' || c == 'X') { // hexadecimal
-                is_hexa = 1; i++;
-              }
-            }
-            prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
-
-          } else {
-            curr_hl = count > 1 ? HL_NORMAL : HL_ERROR;
-            err_flag = 1;
-          }
-          i++; 
-
-        } while(i < row->rsize && (!is_separator(c = row->render[i]) || c == '.')); // or not all separators except '.'
-		
-        int hl_size = (int)(i-start);
-        memset(row->hl + start, curr_hl, hl_size);
-      }
-    }
-    
-    if(prev_sep) {
-    
-      int j;
-      
-      for(j = 0; keywords[j]; j++) {
-        int kwlen = strlen(keywords[j]);
-        int kw2 = keywords[j][kwlen - 1] == '|'; // if is of type keyword2
-        if(kw2) kwlen--;
-
-        if(!strncmp(&row->render[i], keywords[j], kwlen) && // match keyword
-           is_separator(row->render[i + kwlen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, kwlen);
-          i += kwlen - 1;
-        }
-      }
-      if(keywords[j] != NULL) {
-        // if isn't the end of the keywords array, so it matched one keyword
-        prev_sep = 0; // a keyword isn't a separator
-        continue;
-      }
+int editorRowAtOffset(long long off, int* x) {
+  // find the row that holds the byte at 'off' of the text and its column in the row,
+  // the newline at the end of a row is in that row, past its last character
+  // returns E.numrows if the offset is past the end of the text
+  if(!E.rowtree || off < 0 || off >= E.rowtree->bytes) {
+    *x = 0;
+    return E.numrows;
+  }
+  ROW_NODE* n = E.rowtree;
+  int b = 0;
+
+  while(!n->is_leaf) {
+    ROW_INNER* inner = (ROW_INNER*)n;
+    int i;
+    for(i = 0; i < n->count - 1; i++) {
+      if(off < inner->child[i]->bytes) break;
+      b += inner->child[i]->nrows;
+      off -= inner->child[i]->bytes;
     }
-    prev_sep = is_separator(c);
-    i++;
+    n = inner->child[i];
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if(changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  ROW_LEAF* leaf = (ROW_LEAF*)n;
+  int i = 0;
+  while(i < n->count - 1 && off > leaf->rows[i].size) off -= leaf->rows[i++].size + 1;
+  *x = off;
+  return b + i;
 }
 
-int editorSyntaxToStyle(int hl) {
-  switch(hl) {
-    // HL_NORMAL have already been handled
-    // change foreground style
-    case HL_COMMENT : 
-    case HL_MLCOMMENT: return 0x020088ff; // italic sky blue
-    case HL_KEYWORD1 : return 0x01ff9d00; // bold bright orange
-    case HL_KEYWORD2 : return 0x0080ffbb; // normal teal blue
-    case HL_SPECIAL : return 0x0180ffbb; // bold teal blue 
-    case HL_NUMBER : return 0x00ff0044; // normal nail polish pink
-    case HL_STRING : return 0x003ad900; // normal spring green
-    // change background style
-    case HL_MATCH : return 0x001e96c8; // RGB(30, 150, 200), blue
-    case HL_ERROR : return 0x00820000; // normal dark maroon
-    default: return 0x00ffffff; // RGB(255, 255, 255), white
+void rowTreeAddRows(ROW_NODE* n, int delta, long long bytes) {
+  for(; n; n = n->parent) {
+    n->nrows += delta;
+    n->bytes += bytes;
+    n->br_valid = 0;
   }
 }
 
-void editorSelectSyntaxHighlight() {
-  // tries to match the current filename to one of the filematch fields in HLDB  
-
-  E.syntax = NULL;
-  if(E.filename == NULL) return;
-  
-  char* ext = strchr(E.filename, '.'); // get file extension
-
-  for(unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    editorSyntax* s = &HLDB[j];
-    
-    unsigned int i = 0;
-    while(s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      // check if the pattern in the filematch exists in the filename
-      if((is_ext && ext && !strcmp(ext, s->filematch[i])) || // if the extension matches or
-         (!is_ext && strstr(E.filename, s->filematch[i]))) { // if is a substring of filename
-        E.syntax = s; // update highlight syntax for this file
-        
-         // must refactor syntax highlighting after updating it
-        for(int filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
-    }
-  }
+void rowTreeAddBytes(E_ROW* row, int delta) {
+  // called when the size of a row changes
+  for(ROW_NODE* n = &row->leaf->node; n; n = n->parent) n->bytes += delta;
 }
 
-int ndigits(int num) {
-  int d = 0;
-  
-  do {
-    ++d;
-  } while(num /= 10);
-  
-  return d; 
+void rowTreeInvalidate(ROW_NODE* n) {
+  // the brackets of the subtree have changed, so they have to be counted again
+  // the ancestors of a node that isn't valid aren't valid either
+  for(; n && n->br_valid; n = n->parent) n->br_valid = 0;
 }
 
-int editorRowCxtoRx(E_ROW* row, int cx) {
-  // convert a chars index into a render index
-  int j, rx = 0;
-  // loop through all the characters to the left of cx
-  // to figure out how many spaces each TAB takes up
-  for(j = 0; j < cx; j++) {
-    if(row->chars[j] == '\t'){
-      // get rx just to the left of the next tab stop
-      rx += (SHIM_TAB_STOP - 1) - (rx % SHIM_TAB_STOP);	  
-    }
-    rx++;
-  }
-  return rx;
+int rowTreeChildIndex(ROW_NODE* parent, ROW_NODE* child) {
+  ROW_INNER* inner = (ROW_INNER*)parent;
+  int i = 0;
+  while(inner->child[i] != child) i++;
+  return i;
 }
 
-int editorRowRxtoCx(E_ROW* row, int rx) {
-  // convert a render index into a chars index  
+void rowTreeLink(ROW_NODE* left, ROW_NODE* right);
 
-  int curr_rx = 0, cx;
+ROW_INNER* rowTreeSplitInner(ROW_INNER* inner, int half) {
+  // move the children of a full inner node from 'half' onwards to a new sibling
+  ROW_INNER* sibling = calloc(1, sizeof(ROW_INNER));
+  if(!sibling) die("rowTreeSplitInner");
 
-  for(cx = 0; cx < row->size; cx++) {
-    if(row->chars[cx] == '\t') {
-      curr_rx += (SHIM_TAB_STOP - 1) - (curr_rx % SHIM_TAB_STOP);
-    }
-    curr_rx++;
-    if(curr_rx > rx) return cx;
+  int moved = inner->node.count - half;
+  memcpy(sibling->child, &inner->child[half], sizeof(ROW_NODE*) * moved);
+  sibling->node.count = moved;
+  inner->node.count = half;
+
+  for(int i = 0; i < moved; i++) {
+    sibling->child[i]->parent = &sibling->node;
+    sibling->node.nrows += sibling->child[i]->nrows;
+    sibling->node.bytes += sibling->child[i]->bytes;
   }
-  return cx;
+  // the moved rows are counted again when the sibling gets linked
+  rowTreeAddRows(&inner->node, -sibling->node.nrows, -sibling->node.bytes);
+  rowTreeLink(&inner->node, &sibling->node);
+  return sibling;
 }
 
-void editorUpdateRow(E_ROW* row) {
-  int j, tabs = 0;
-  for(j = 0; j < row->size; j++){
-    if(row->chars[j] == '\t') tabs++;
+void rowTreeLink(ROW_NODE* left, ROW_NODE* right) {
+  // insert 'right' just after 'left' in the children of their parent
+  // the rows of 'right' must not be counted yet by any node of the tree
+  ROW_INNER* parent = (ROW_INNER*)left->parent;
+
+  if(!parent) { // left is the root, grow the tree by one level
+    parent = calloc(1, sizeof(ROW_INNER));
+    if(!parent) die("rowTreeLink");
+    parent->child[0] = left;
+    parent->node.count = 1;
+    parent->node.nrows = left->nrows;
+    parent->node.bytes = left->bytes;
+    left->parent = &parent->node;
+    E.rowtree = &parent->node;
   }
-  free(row->render);
-  // allocate memory for render
-  // the maximum number of characters needed for each tab is SHIM_TAB_STOP
-  // row->size already counts 1 character for each tab 
-  // so multiply tabs by (SHIM_TAB_STOP - 1) and add that to row->size
-  row->render = malloc(row->size + tabs*(SHIM_TAB_STOP - 1) + 1);
-  
-  int idx = 0;
-  for(j = 0; j < row->size; j++){
-    if(row->chars[j] == '\t'){
-      // render tabulation character as spaces
-      row->render[idx++] = ' ';
-      while(idx % SHIM_TAB_STOP != 0) row->render[idx++] = ' ';
+  int at = rowTreeChildIndex(&parent->node, left) + 1;
+
+  if(parent->node.count == SHIM_ROW_NODE_MAX) {
+    // appending after the last child starts an empty sibling, so that the nodes
+    // filled in order while loading a file stay full, otherwise split in half
+    int half = (at == SHIM_ROW_NODE_MAX) ? at : SHIM_ROW_NODE_MAX / 2;
+    ROW_INNER* sibling = rowTreeSplitInner(parent, half);
+    if(at >= half) {
+      parent = sibling;
+      at -= half;
     }
-    else row->render[idx++] = row->chars[j];
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-
-  editorUpdateSyntax(row);
+  memmove(&parent->child[at + 1], &parent->child[at], sizeof(ROW_NODE*) * (parent->node.count - at));
+  parent->child[at] = right;
+  parent->node.count++;
+  right->parent = &parent->node;
+  rowTreeAddRows(&parent->node, right->nrows, right->bytes);
 }
 
-void editorUpdateRowOffset() {
-  //E.screencols += (E.row_num_offset + 1);
-  E.row_num_offset = ndigits(E.numrows);
-  //E.screencols -= (E.row_num_offset + 1);
+ROW_LEAF* rowTreeSplitLeaf(ROW_LEAF* leaf, int half) {
+  // move the rows of a full leaf from 'half' onwards to a new sibling leaf
+  ROW_LEAF* sibling = calloc(1, sizeof(ROW_LEAF));
+  if(!sibling) die("rowTreeSplitLeaf");
+  sibling->node.is_leaf = 1;
+
+  int moved = leaf->node.count - half;
+  memcpy(sibling->rows, &leaf->rows[half], sizeof(E_ROW) * moved);
+  for(int i = 0; i < moved; i++) {
+    sibling->rows[i].leaf = sibling;
+    sibling->node.bytes += sibling->rows[i].size + 1;
+  }
+  sibling->node.count = sibling->node.nrows = moved;
+  leaf->node.count = half;
+
+  rowTreeAddRows(&leaf->node, -moved, -sibling->node.bytes);
+  rowTreeLink(&leaf->node, &sibling->node);
+  return sibling;
+}
+
+E_ROW* rowTreeInsert(int at) {
+  // make room for a new row at position 'at' and return it
+  if(!E.rowtree) {
+    ROW_LEAF* leaf = calloc(1, sizeof(ROW_LEAF));
+    if(!leaf) die("rowTreeInsert");
+    leaf->node.is_leaf = 1;
+    E.rowtree = &leaf->node;
+  }
+  int base;
+  ROW_LEAF* leaf = rowTreeFind(at, &base);
+  int pos = at - base;
+
+  if(leaf->node.count == SHIM_ROW_LEAF_MAX) {
+    // appending to a full leaf starts a new one, inserting splits it in half
+    if(leaf->packed) rowLeafUnpack(leaf);
+    int half = (pos == SHIM_ROW_LEAF_MAX) ? pos : SHIM_ROW_LEAF_MAX / 2;
+    ROW_LEAF* sibling = rowTreeSplitLeaf(leaf, half);
+    if(pos >= half) {
+      pos -= half;
+      base += half;
+      leaf = sibling;
+    }
+  }
+  memmove(&leaf->rows[pos + 1], &leaf->rows[pos], sizeof(E_ROW) * (leaf->node.count - pos));
+  leaf->node.count++;
+  rowTreeAddRows(&leaf->node, 1, 1); // an empty row, its characters are counted once they're set
+  // the rows before the leaf didn't move, so appending the next row doesn't look it up again
+  E.rowcache = leaf;
+  E.rowcache_base = base;
+
+  leaf->rows[pos].leaf = leaf;
+  return &leaf->rows[pos];
+}
+
+void rowTreeUnlink(ROW_NODE* n) {
+  // remove an empty node from the tree, along with its ancestors that become empty
+  ROW_INNER* parent = (ROW_INNER*)n->parent;
+  int at = parent ? rowTreeChildIndex(&parent->node, n) : 0;
+  if(n->is_leaf) rowLeafDropPacked((ROW_LEAF*)n);
+  free(n);
+
+  if(!parent) {
+    E.rowtree = NULL;
+    return;
+  }
+  memmove(&parent->child[at], &parent->child[at + 1], sizeof(ROW_NODE*) * (parent->node.count - at - 1));
+  rowTreeInvalidate(&parent->node);
+  if(--parent->node.count == 0) {
+    rowTreeUnlink(&parent->node);
+    return;
+  }
+  // shrink the tree when the root is left with a single child
+  while(!E.rowtree->is_leaf && E.rowtree->count == 1) {
+    ROW_NODE* root = E.rowtree;
+    E.rowtree = ((ROW_INNER*)root)->child[0];
+    E.rowtree->parent = NULL;
+    free(root);
+  }
+}
+
+void rowTreeMergeLeaf(ROW_LEAF* leaf) {
+  // merge a leaf that is almost empty with its right sibling, when they fit in one leaf
+  ROW_INNER* parent = (ROW_INNER*)leaf->node.parent;
+  if(!parent) return;
+
+  int at = rowTreeChildIndex(&parent->node, &leaf->node);
+  if(at + 1 == parent->node.count) return;
+
+  ROW_LEAF* sibling = (ROW_LEAF*)parent->child[at + 1];
+  int moved = sibling->node.count;
+  if(leaf->node.count + moved > SHIM_ROW_LEAF_MAX) return;
+  if(leaf->packed) rowLeafUnpack(leaf);
+  if(sibling->packed) rowLeafUnpack(sibling);
+
+  memcpy(&leaf->rows[leaf->node.count], sibling->rows, sizeof(E_ROW) * moved);
+  for(int i = 0; i < moved; i++) leaf->rows[leaf->node.count + i].leaf = leaf;
+  leaf->node.count += moved;
+  leaf->node.nrows += moved;
+  leaf->node.bytes += sibling->node.bytes;
+  rowTreeInvalidate(&leaf->node);
+  sibling->node.count = sibling->node.nrows = 0;
+  sibling->node.bytes = 0;
+  rowTreeUnlink(&sibling->node);
+}
+
+void rowTreeDelete(int at) {
+  // remove the row at position 'at' from the tree, the row must have been freed
+  int base;
+  ROW_LEAF* leaf = rowTreeFind(at, &base);
+  int pos = at - base;
+  long long bytes = leaf->rows[pos].size + 1;
+
+  memmove(&leaf->rows[pos], &leaf->rows[pos + 1], sizeof(E_ROW) * (leaf->node.count - pos - 1));
+  leaf->node.count--;
+  rowTreeAddRows(&leaf->node, -1, -bytes);
+  E.rowcache = NULL;
+
+  if(leaf->node.count == 0) rowTreeUnlink(&leaf->node);
+  else if(leaf->node.count < SHIM_ROW_LEAF_MAX / 4) rowTreeMergeLeaf(leaf);
+}
+
+void rowMemInit() {
+  for(int i = 0, c = 0; i <= ROW_MEM_SMALL / 8; i++) {
+    while(row_mem_sizes[c] < i * 8) c++;
+    M.class_of[i] = c;
+  }
+}
+
+char* rowMemAlloc(int size, int* cap) {
+  // get a block of at least size bytes, its actual size is stored in cap
+  if(size > ROW_MEM_SMALL) {
+    // leave room for the row to grow a bit
+    *cap = size + size / 8;
+    char* p = malloc(*cap);
+    if(!p) die("rowMemAlloc");
+    M.big_bytes += *cap;
+    return p;
+  }
+  int c = M.class_of[(size + 7) / 8];
+  *cap = row_mem_sizes[c];
+  if(M.free[c]) {
+    void* p = M.free[c];
+    M.free[c] = *(void**) p;
+    M.free_bytes -= *cap;
+    return p;
+  }
+  if(M.slab_left < (size_t) *cap) {
+    // the end of the old slab goes to the free lists
+    for(int k = ROW_MEM_CLASSES - 1; k >= 0 && M.slab_left >= (size_t) row_mem_sizes[0]; k--) {
+      while(M.slab_left >= (size_t) row_mem_sizes[k]) {
+        *(void**) M.slab = M.free[k];
+        M.free[k] = M.slab;
+        M.free_bytes += row_mem_sizes[k];
+        M.slab += row_mem_sizes[k];
+        M.slab_left -= row_mem_sizes[k];
+      }
+    }
+    M.slab = malloc(SHIM_SLAB_SIZE);
+    if(!M.slab) die("rowMemAlloc");
+    M.slab_left = SHIM_SLAB_SIZE;
+    M.slab_bytes += SHIM_SLAB_SIZE;
+  }
+  char* p = M.slab;
+  M.slab += *cap;
+  M.slab_left -= *cap;
+  return p;
+}
+
+void rowMemFree(void* p, int cap) {
+  if(!p) return;
+  if(cap > ROW_MEM_SMALL) {
+    M.big_bytes -= cap;
+    free(p);
+    return;
+  }
+  int c = M.class_of[cap / 8];
+  *(void**) p = M.free[c];
+  M.free[c] = p;
+  M.free_bytes += cap;
+}
+
+char* rowMemGrow(char* p, int* cap, int size) {
+  // make a block hold at least size bytes, keeping its content
+  if(size <= *cap) return p;
+  int old = *cap;
+  char* q = rowMemAlloc(size, cap);
+  memcpy(q, p, old);
+  rowMemFree(p, old);
+  return q;
+}
+
+// a block compressor in the spirit of LZ4: each sequence is a token with the lengths of its
+// literals and of its match in two nibbles, the literals, then a 16-bit offset back to the match
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+int lzPutLength(unsigned char** o, unsigned char* end, int len) {
+  // the part of a length that doesn't fit in its nibble, in bytes of 255
+  for(; len >= 255; len -= 255) {
+    if(*o >= end) return -1;
+    *(*o)++ = 255;
+  }
+  if(*o >= end) return -1;
+  *(*o)++ = len;
+  return 0;
+}
+
+int lzCompress(const char* src, int len, char* dst, int cap) {
+  // returns the bytes written to dst, or 0 if they don't fit in cap
+  static int table[1 << LZ_HASH_BITS];
+  const unsigned char* s = (const unsigned char*) src;
+  unsigned char* o = (unsigned char*) dst;
+  unsigned char* end = o + cap;
+  for(int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+  int i = 0, anchor = 0;
+  while(i <= len) {
+    int ref = -1, m = 0;
+    if(i + LZ_MIN_MATCH <= len) {
+      unsigned int v;
+      memcpy(&v, s + i, 4);
+      unsigned int h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+      ref = table[h];
+      table[h] = i;
+      if(ref >= 0 && i - ref <= 0xffff && !memcmp(s + ref, s + i, LZ_MIN_MATCH)) {
+        m = LZ_MIN_MATCH;
+        while(i + m < len && s[ref + m] == s[i + m]) m++;
+      }
+    }
+    if(!m && i < len) {
+      i++;
+      continue;
+    }
+    // a sequence ends with a match, the last one with the end of the block
+    int lit = i - anchor;
+    if(o + 1 + lit > end) return 0;
+    unsigned char* token = o++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15 && lzPutLength(&o, end, lit - 15) == -1) return 0;
+    if(o + lit > end) return 0;
+    memcpy(o, s + anchor, lit);
+    o += lit;
+    if(!m) break;
+    if(o + 2 > end) return 0;
+    *o++ = (i - ref) & 0xff;
+    *o++ = (i - ref) >> 8;
+    int ml = m - LZ_MIN_MATCH;
+    *token |= (ml < 15 ? ml : 15);
+    if(ml >= 15 && lzPutLength(&o, end, ml - 15) == -1) return 0;
+    i += m;
+    anchor = i;
+  }
+  return o - (unsigned char*) dst;
+}
+
+int lzGetLength(const unsigned char** s, int len) {
+  if(len < 15) return len;
+  unsigned char b;
+  do {
+    b = *(*s)++;
+    len += b;
+  } while(b == 255);
+  return len;
+}
+
+int lzDecompress(const char* src, int len, char* dst) {
+  // returns the bytes written to dst, which must have room for all of them
+  const unsigned char* s = (const unsigned char*) src;
+  const unsigned char* end = s + len;
+  char* o = dst;
+  while(s < end) {
+    int token = *s++;
+    int lit = lzGetLength(&s, token >> 4);
+    memcpy(o, s, lit);
+    o += lit;
+    s += lit;
+    if(s >= end) break;
+    int off = s[0] | (s[1] << 8);
+    s += 2;
+    int m = lzGetLength(&s, token & 15) + LZ_MIN_MATCH;
+    // the match may overlap the bytes being written, so it is copied a byte at a time
+    for(const char* from = o - off; m > 0; m--) *o++ = *from++;
+  }
+  return o - dst;
+}
+
+void rowLeafUnpack(ROW_LEAF* leaf) {
+  // give the packed rows of a leaf their characters back
+  static char* scratch = NULL;
+  static int scratch_size = 0;
+  if(leaf->packed_raw > scratch_size) {
+    scratch_size = leaf->packed_raw;
+    scratch = realloc(scratch, scratch_size);
+    if(!scratch) die("rowLeafUnpack");
+  }
+  lzDecompress(leaf->packed, leaf->packed_len, scratch);
+  const char* p = scratch;
+  for(int i = 0; i < leaf->node.count; i++) {
+    E_ROW* row = &leaf->rows[i];
+    if(!(row->flags & ROW_PACKED)) continue;
+    row->chars = rowMemAlloc(row->size + 1, &row->chars_cap);
+    memcpy(row->chars, p, row->size);
+    row->chars[row->size] = '\0';
+    row->flags &= ~ROW_PACKED;
+    row->gen = E.snap_gen;
+    p += row->size;
+  }
+  C.unpacks++;
+  rowLeafDropPacked(leaf);
+}
+
+void rowLeafDropPacked(ROW_LEAF* leaf) {
+  if(!leaf->packed) return;
+  C.raw_bytes -= leaf->packed_raw;
+  C.packed_bytes -= leaf->packed_len;
+  if(leaf->packed == C.view_block) C.view_block = NULL;
+  if(leaf->packed_gen <= E.shared_gen) editorBuryChars(leaf->packed, -1); // a snapshot may still read it
+  else free(leaf->packed);
+  leaf->packed = NULL;
+  leaf->packed_len = leaf->packed_raw = 0;
+}
+
+const char* rowTreeChars(E_ROW* row) {
+  // the characters of a row, a compressed one is read without uncompressing its leaf,
+  // they stay readable until another leaf is read
+  if(!(row->flags & ROW_PACKED)) return row->chars;
+  ROW_LEAF* leaf = row->leaf;
+  if(leaf->packed != C.view_block) {
+    if(leaf->packed_raw > C.view_cap) {
+      C.view_cap = leaf->packed_raw;
+      C.view = realloc(C.view, C.view_cap);
+      if(!C.view) die("rowTreeChars");
+    }
+    lzDecompress(leaf->packed, leaf->packed_len, C.view);
+    C.view_block = leaf->packed;
+  }
+  int offset = 0;
+  for(E_ROW* r = leaf->rows; r != row; r++) {
+    if(r->flags & ROW_PACKED) offset += r->size;
+  }
+  return C.view + offset;
+}
+
+void editorMemoryStats() {
+  // show how much memory the rows use, for each line of the file
+  long long text = 0, leaves = 0;
+  ROW_LEAF* leaf = NULL;
+  for(int j = 0; j < E.numrows; j++) {
+    E_ROW* row = rowTreeRow(j);
+    text += row->size + 1;
+    if(row->leaf != leaf) leaves++;
+    leaf = row->leaf;
+  }
+  long long used = M.slab_bytes - M.free_bytes - (long long) M.slab_left + M.big_bytes;
+  long long total = used + leaves * (long long) sizeof(ROW_LEAF);
+  int n = E.numrows ? E.numrows : 1;
+  editorSetStatusMessage("%d rows, %.1f B/line (text %.1f) | slabs %lld KB, %lld KB free | big %lld KB",
+    E.numrows, (double) total / n, (double) text / n, M.slab_bytes >> 10, M.free_bytes >> 10, M.big_bytes >> 10);
+}
+
+int editorRowShared(E_ROW* row) {
+  // tells if a snapshot may still be reading the characters of the row
+  return !(row->flags & ROW_MAPPED) && row->gen <= E.shared_gen;
+}
+
+SNAPSHOT* editorSnapshot() {
+  // get a snapshot of the rows, the caller must release it
+  if(E.snap) {
+    E.snap->refs++;
+    return E.snap;
+  }
+  SNAPSHOT* snap = malloc(sizeof(SNAPSHOT));
+  if(!snap) die("editorSnapshot");
+  snap->rows = malloc(sizeof(SNAP_ROW) * (E.numrows ? E.numrows : 1));
+  if(!snap->rows) die("editorSnapshot");
+  snap->blocks = NULL;
+  snap->nblocks = 0;
+  int cap = 0, offset = 0;
+  ROW_LEAF* leaf = NULL;
+  for(int j = 0; j < E.numrows; j++) {
+    // compressed leaves stay compressed, the workers uncompress the blocks they read
+    E_ROW* row = rowTreeRow(j);
+    SNAP_ROW* sr = &snap->rows[j];
+    if(row->leaf != leaf) {
+      leaf = row->leaf;
+      offset = 0;
+      if(leaf->packed) {
+        if(snap->nblocks == cap) {
+          cap = cap ? cap * 2 : 64;
+          snap->blocks = realloc(snap->blocks, sizeof(SNAP_BLOCK) * cap);
+          if(!snap->blocks) die("editorSnapshot");
+        }
+        SNAP_BLOCK* b = &snap->blocks[snap->nblocks++];
+        b->packed = leaf->packed;
+        b->len = leaf->packed_len;
+        b->raw = leaf->packed_raw;
+      }
+    }
+    sr->chars = row->chars;
+    sr->size = row->size;
+    sr->mapped = (row->flags & ROW_MAPPED) != 0;
+    sr->block = (row->flags & ROW_PACKED) ? snap->nblocks - 1 : -1;
+    sr->offset = offset;
+    if(row->flags & ROW_PACKED) offset += row->size;
+  }
+  snap->nrows = E.numrows;
+  snap->edits = E.edits;
+  snap->refs = 2; // for the caller and for the cache
+  E.snap = snap;
+
+  // characters allocated up to now may be referenced by a snapshot from now on
+  E.shared_gen = E.snap_gen++;
+  E.snapshots++;
+  return snap;
+}
+
+void editorSnapshotRelease(SNAPSHOT* snap) {
+  if(--snap->refs > 0) return;
+  free(snap->rows);
+  free(snap->blocks);
+  free(snap);
+
+  if(--E.snapshots == 0) {
+    // nothing reads the old characters anymore
+    for(int i = 0; i < E.graveyard_len; i++) {
+      if(E.graveyard[i].cap < 0) free(E.graveyard[i].chars);
+      else rowMemFree(E.graveyard[i].chars, E.graveyard[i].cap);
+    }
+    E.graveyard_len = 0;
+    E.shared_gen = 0;
+  }
+}
+
+const char* snapRowChars(SNAP_READER* r, int j) {
+  // the characters of the row j of the snapshot, a compressed row stays readable
+  // until another block is uncompressed
+  SNAP_ROW* row = &r->snap->rows[j];
+  if(row->block < 0) return row->chars;
+  if(row->block != r->block) {
+    SNAP_BLOCK* b = &r->snap->blocks[row->block];
+    if(b->raw > r->cap) {
+      r->cap = b->raw;
+      r->buf = realloc(r->buf, r->cap);
+      if(!r->buf) die("snapRowChars");
+    }
+    lzDecompress(b->packed, b->len, r->buf);
+    r->block = row->block;
+  }
+  return r->buf + row->offset;
+}
+
+void editorBuryChars(char* chars, int cap) {
+  // free characters once no snapshot can read them
+  if(E.graveyard_len == E.graveyard_cap) {
+    E.graveyard_cap = E.graveyard_cap ? E.graveyard_cap * 2 : 64;
+    E.graveyard = realloc(E.graveyard, sizeof(BURIED_CHARS) * E.graveyard_cap);
+    if(!E.graveyard) die("editorBuryChars");
+  }
+  E.graveyard[E.graveyard_len].chars = chars;
+  E.graveyard[E.graveyard_len++].cap = cap;
+}
+
+void editorNoteEdit(int at) {
+  // a row at index 'at' is about to change, or rows are inserted or deleted there
+  E.edits++;
+  if(at < E.edit_low) E.edit_low = at;
+  // the cached snapshot doesn't match the rows anymore
+  if(E.snap) {
+    editorSnapshotRelease(E.snap);
+    E.snap = NULL;
+  }
+}
+
+void* editorWorker(void* arg) {
+  (void)arg;
+  while(1) {
+    pthread_mutex_lock(&W.lock);
+    while(!W.queue) pthread_cond_wait(&W.ready, &W.lock);
+    EDITOR_JOB* job = W.queue;
+    W.queue = job->next;
+    if(!W.queue) W.queue_tail = NULL;
+    pthread_mutex_unlock(&W.lock);
+
+    job->run(job);
+
+    job->next = NULL;
+    pthread_mutex_lock(&W.lock);
+    if(W.finished_tail) W.finished_tail->next = job;
+    else W.finished = job;
+    W.finished_tail = job;
+    pthread_mutex_unlock(&W.lock);
+    // the pipe is only drained by the main thread, a full pipe already wakes it up
+    while(write(W.pipe[1], "", 1) == -1 && errno == EINTR);
+  }
+  return NULL;
+}
+
+void editorJobsInit() {
+  if(pipe(W.pipe) == -1) die("pipe");
+  fcntl(W.pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(W.pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&W.lock, NULL);
+  pthread_cond_init(&W.ready, NULL);
+  W.queue = W.queue_tail = NULL;
+  W.finished = W.finished_tail = NULL;
+  W.running = 0;
+
+  // the workers must not take the signals meant for the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for(int i = 0; i < SHIM_WORKERS; i++) {
+    if(pthread_create(&W.threads[i], NULL, editorWorker, NULL) != 0) die("pthread_create");
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void editorJobSubmit(EDITOR_JOB* job) {
+  job->next = NULL;
+  job->buffer = E.id;
+  W.running++;
+  pthread_mutex_lock(&W.lock);
+  if(W.queue_tail) W.queue_tail->next = job;
+  else W.queue = job;
+  W.queue_tail = job;
+  pthread_cond_signal(&W.ready);
+  pthread_mutex_unlock(&W.lock);
+}
+
+int editorJobsFinish() {
+  // run the done callback of the jobs that have finished, returns how many there were
+  char buf[64];
+  while(read(W.pipe[0], buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&W.lock);
+  EDITOR_JOB* job = W.finished;
+  W.finished = W.finished_tail = NULL;
+  pthread_mutex_unlock(&W.lock);
+
+  int n = 0;
+  while(job) {
+    EDITOR_JOB* next = job->next;
+    SNAPSHOT* snap = job->snap;
+    W.running--;
+    // the job may come from a buffer that isn't the current one anymore
+    int from = B.current, at = (job->buffer == E.id) ? from : editorBufferFind(job->buffer);
+    if(at != from) editorBufferEnter(at);
+    job->done(job);
+    if(snap) editorSnapshotRelease(snap);
+    if(at != from) editorBufferEnter(from);
+    job = next;
+    n++;
+  }
+  return n;
+}
+int is_bracket(int c) {
+  return strchr("()[]{}", c) != NULL;
+}
+
+char lexAt(const char* s, int len, int i) {
+  // the lexer sees the end of the line as a '\0', as if the line was a C string
+  return i < len ? s[i] : '\0';
+}
+
+int lexMatch(const char* s, int len, int i, const char* token, int tlen) {
+  // check if the line has 'token' at position i
+  return i + tlen <= len && !memcmp(&s[i], token, tlen);
+}
+
+int lexWordLength(SYNTAX_TABLES* tables, const char* s, int len, int i) {
+  // length of the word starting at position i, up to the next separator
+  int j = i;
+  while(j < len && !(tables->cls[(unsigned char) s[j]] & CC_SEP)) j++;
+  return j - i;
+}
+
+unsigned int keywordHash(const char* s, int len) {
+  unsigned int h = 2166136261u; // FNV-1a
+  for(int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int keywordLookup(KEYWORD_TABLE* t, const char* s, int len) {
+  // return the highlight type of the word if it is in the table, HL_NORMAL otherwise
+  if(len == 0 || !(t->lens[(unsigned char) s[0]] >> (len < 31 ? len : 31) & 1)) return HL_NORMAL;
+
+  unsigned int h = keywordHash(s, len) & t->mask;
+  while(t->slots[h].word) {
+    if(t->slots[h].len == len && !memcmp(t->slots[h].word, s, len)) return t->slots[h].hl;
+    h = (h + 1) & t->mask;
+  }
+  return HL_NORMAL;
+}
+
+void keywordTableBuild(KEYWORD_TABLE* t, char** words, int hl, int hl2) {
+  // words ending with '|' get the highlight type hl2, the others get hl
+  int n = 0;
+  while(words && words[n]) n++;
+
+  unsigned int size = 8;
+  while(size < 2 * (unsigned int)n) size *= 2; // keep the table at most half full
+  t->slots = calloc(size, sizeof(struct keywordSlot));
+  if(!t->slots) die("keywordTableBuild");
+  t->mask = size - 1;
+  memset(t->lens, 0, sizeof(t->lens));
+
+  for(int j = 0; j < n; j++) {
+    int len = strlen(words[j]);
+    int type = hl;
+    if(len > 0 && words[j][len - 1] == '|') {
+      type = hl2; len--;
+    }
+    if(len == 0) continue;
+
+    unsigned int h = keywordHash(words[j], len) & t->mask;
+    while(t->slots[h].word) h = (h + 1) & t->mask;
+    t->slots[h].word = words[j];
+    t->slots[h].len = len;
+    t->slots[h].hl = type;
+
+    t->lens[(unsigned char) words[j][0]] |= 1u << (len < 31 ? len : 31);
+  }
+}
+
+void editorCompileSyntax(editorSyntax* syntax) {
+  // build the lookup tables that editorHighlightLine uses for a syntax
+  if(syntax->tables) return;
+
+  SYNTAX_TABLES* tables = calloc(1, sizeof(SYNTAX_TABLES));
+  if(!tables) die("editorCompileSyntax");
+
+  keywordTableBuild(&tables->keywords, syntax->keywords, HL_KEYWORD1, HL_KEYWORD2);
+  keywordTableBuild(&tables->specials, syntax->specials, HL_SPECIAL, HL_SPECIAL);
+
+  char* scs = syntax->singleline_comment_start;
+  char* mcs = syntax->multiline_comment_start;
+  char* mce = syntax->multiline_comment_end;
+  tables->scs_len = scs ? strlen(scs) : 0;
+  tables->mcs_len = mcs ? strlen(mcs) : 0;
+  tables->mce_len = mce ? strlen(mce) : 0;
+  if(!tables->mce_len) tables->mcs_len = 0; // a comment that can't end isn't one
+
+  const char* seps = syntax->separators ? syntax->separators : ",.+-/*!?=~%<>:;&|^\"\'\\";
+  for(int c = 0; c < 256; c++) {
+    if(isspace(c)) tables->cls[c] |= CC_SPACE;
+    if(isspace(c) || c == '\0' || strchr("()[]{}", c) || strchr(seps, c)) tables->cls[c] |= CC_SEP;
+  }
+
+  // the flags and the delimiters of the syntax are looked at once here, rather than at each
+  // token, so the lexer only has to test what each character may start
+  for(int c = 0; c < 256; c++) {
+    int cls = tables->cls[c];
+    int act = 0;
+    if(tables->scs_len && c == (unsigned char) scs[0]) act |= LEX_ACT_SCS;
+    if(tables->mcs_len && c == (unsigned char) mcs[0]) act |= LEX_ACT_MCS;
+    if((syntax->flags & HL_HIGHLIGHT_SPECIAL) && syntax->special_start &&
+       c == (unsigned char) syntax->special_start) act |= LEX_ACT_SPECIAL;
+    if((syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) act |= LEX_ACT_STRING;
+    if((syntax->flags & HL_HIGHLIGHT_NUMBERS) && (isdigit(c) || c == '.')) act |= LEX_ACT_NUMBER;
+    if(!(cls & CC_SEP) && tables->keywords.lens[c]) act |= LEX_ACT_KEYWORD;
+    tables->act[c] = act;
+  }
+  tables->plain_words = 1;
+  for(int c = 0; c < 256; c++) {
+    int starts = tables->act[c] & (LEX_ACT_SCS | LEX_ACT_MCS | LEX_ACT_SPECIAL | LEX_ACT_STRING);
+    if(starts && !(tables->cls[c] & CC_SEP)) tables->plain_words = 0;
+  }
+
+  // the characters that may start a comment, a string or a special line have to be looked at
+  // more closely wherever a token can start, so do the ones that may start a keyword or a number
+  for(int c = 0; c < 256; c++) {
+    int cls = tables->cls[c];
+    int delim = tables->act[c] & (LEX_ACT_SCS | LEX_ACT_MCS);
+    int starts = tables->act[c] & (LEX_ACT_SCS | LEX_ACT_MCS | LEX_ACT_SPECIAL | LEX_ACT_STRING);
+    unsigned short* next[LEX_MODES];
+    for(int m = 0; m < LEX_MODES; m++) next[m] = &tables->next[m][c];
+
+    *next[LEX_CODE] = tables->act[c] ? LEX_SLOW : (cls & CC_SEP) ? LEX_CODE << 8 | HL_NORMAL : LEX_WORD << 8 | HL_NORMAL;
+    *next[LEX_WORD] = starts ? LEX_SLOW : (cls & CC_SEP) ? LEX_CODE << 8 | HL_NORMAL : LEX_WORD << 8 | HL_NORMAL;
+
+    *next[LEX_STRING2] = (c == '\\') ? LEX_SLOW : (c == '"') ? LEX_CODE << 8 | HL_STRING : LEX_STRING2 << 8 | HL_STRING;
+    *next[LEX_STRING1] = (c == '\\') ? LEX_SLOW : (c == '\'') ? LEX_CODE << 8 | HL_STRING : LEX_STRING1 << 8 | HL_STRING;
+
+    int end = tables->mce_len && c == (unsigned char) mce[0];
+    *next[LEX_COMMENT] = end ? LEX_SLOW : LEX_COMMENT << 8 | HL_MLCOMMENT;
+    *next[LEX_SPECIAL_COMMENT] = end ? LEX_SLOW : LEX_SPECIAL_COMMENT << 8 | HL_MLCOMMENT;
+
+    // a special line is highlighted a word at a time, comments can only start between words
+    *next[LEX_SPECIAL_RUN] = (cls & CC_SPACE) ? LEX_SPECIAL_GAP << 8 | HL_NORMAL : LEX_SPECIAL_RUN << 8 | HL_SPECIAL;
+    *next[LEX_SPECIAL_GAP] = delim ? LEX_SLOW : *next[LEX_SPECIAL_RUN];
+  }
+
+  syntax->tables = tables;
+}
+
+void lexStateInit(LEX_STATE* st, int in_comment) {
+  // the state at the start of a line, the beginning of the line counts as a separator
+  st->mode = in_comment ? LEX_COMMENT : LEX_CODE;
+}
+
+int lexStateInComment(LEX_STATE* st) {
+  return st->mode == LEX_COMMENT || st->mode == LEX_SPECIAL_COMMENT;
+}
+
+int lexStatePack(LEX_STATE* st, const unsigned char* hl, int i) {
+  // the state at i as a single value, with the highlight just before i
+  // since the highlight of a number depends on it
+  int prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+  return st->mode | prev_hl << 8;
+}
+
+void lexStateUnpack(LEX_STATE* st, int state) {
+  st->mode = state & 0xff;
+}
+
+int lexNumber(SYNTAX_TABLES* tables, const char* s, int len, unsigned char* hl, int i) {
+  // highlight the number that starts at i, after a separator, returns where it ends
+  int start = i;
+  char c = s[i];
+  int prev_sep = 1;
+  unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL; // previous highlight type
+  unsigned char curr_hl = HL_NORMAL;
+  int err_flag = 0; // if error in the highlight logic
+  int is_hexa = 0, is_octa = 0;
+  int count = 0; // count decimal points
+
+  do {
+    if(err_flag) {
+      i++; continue; // consume invalid input
+    }
+
+    if((is_octa && (c >= '0' && c <= '7')) ||
+       (is_hexa && (isdigit(c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f')))) {
+      prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
+
+    } else if (!is_octa && !is_hexa && (isdigit(c) && ((prev_sep && c != '0') || prev_hl == HL_NUMBER))) {
+      prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
+
+    } else if(!is_octa && !is_hexa && c == '.' && ++count == 1 && 
+              (prev_hl == HL_NUMBER || prev_hl == HL_NORMAL)) { // parse numbers with decimal points
+      prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
+
+    } else if(prev_sep && c == '0') {
+
+      if(!is_hexa && !is_octa && i+1 < len) {
+
+        c = lexAt(s, len, i+1);            
+
+        if(isdigit(c)) { // octal 
+          is_octa = 1;
+        } else if(c == 'x' || c == 'X') { // hexadecimal
+          is_hexa = 1; i++;
+        }
+      }
+      prev_hl = curr_hl = HL_NUMBER; prev_sep = 0;
+
+    } else {
+      curr_hl = count > 1 ? HL_NORMAL : HL_ERROR;
+      err_flag = 1;
+    }
+    i++; 
+
+  } while(i < len && (!(tables->cls[(unsigned char)(c = s[i])] & CC_SEP) || c == '.')); // or not all separators except '.'
+
+  memset(hl + start, curr_hl, i - start);
+  return i;
+}
+
+int editorLexRun(editorSyntax* syntax, const char* s, int len, unsigned char* hl, LEX_STATE* st, int from, int stop) {
+  // highlight the characters of s from 'from', in the state st, until the first token that
+  // starts at or after stop, and leave the state there in st
+  // the token that crosses stop is highlighted whole, returns where it ends
+  if(syntax == NULL) { // if NULL, no syntax highlight should be done
+    memset(&hl[from], HL_NORMAL, stop - from);
+    return stop;
+  }
+  
+  SYNTAX_TABLES* tables = syntax->tables;
+
+  char* scs = syntax->singleline_comment_start;
+  char* mcs = syntax->multiline_comment_start;
+  char* mce = syntax->multiline_comment_end;
+  
+  int scs_len = tables->scs_len;
+  int mcs_len = tables->mcs_len;
+  int mce_len = tables->mce_len;
+
+  int mode = st->mode;
+  int i = from;
+  while(i < stop) {
+    if(mce_len && (mode == LEX_COMMENT || mode == LEX_SPECIAL_COMMENT)) {
+      // a comment can only end at the first character of its end delimiter,
+      // memchr finds it many bytes at a time
+      const char* end = memchr(&s[i], mce[0], stop - i);
+      int to = end ? end - s : stop;
+      memset(&hl[i], HL_MLCOMMENT, to - i);
+      i = to;
+      if(i >= stop) break;
+    }
+
+    // most characters just move the lexer to its next mode
+    unsigned short next;
+    while(i < stop && (next = tables->next[mode][(unsigned char) s[i]]) != LEX_SLOW) {
+      hl[i++] = (unsigned char) next;
+      mode = next >> 8;
+    }
+    if(i >= stop) break;
+
+    char c = s[i];
+    int act = tables->act[(unsigned char) c];
+
+    if(mode == LEX_STRING2 || mode == LEX_STRING1) { // a backslash
+      hl[i++] = HL_STRING;
+      if(i+1 < len) hl[i++] = HL_STRING; // could be a '\'' or '\"' escape character 
+      continue;
+    }
+
+    if(mode == LEX_COMMENT || mode == LEX_SPECIAL_COMMENT) { // what may be the end of the comment
+      if(lexMatch(s, len, i, mce, mce_len)) { // finishing ml comment
+        memset(&hl[i], HL_MLCOMMENT, mce_len);
+        i += mce_len;
+        mode = (mode == LEX_COMMENT) ? LEX_CODE : LEX_SPECIAL_GAP;
+      } else {
+        hl[i++] = HL_MLCOMMENT;
+      }
+      continue;
+    }
+
+    // a token may start here
+    int scs_here = !(syntax->flags & HL_COMMENT_AFTER_SPACE) || i == 0 ||
+                   (tables->cls[(unsigned char) s[i - 1]] & CC_SPACE);
+    if((act & LEX_ACT_SCS) && scs_here && lexMatch(s, len, i, scs, scs_len)) { // starting a single-line comment
+      memset(&hl[i], HL_COMMENT, len - i);
+      i = len;
+      break;
+    }
+    
+    if((act & LEX_ACT_MCS) && lexMatch(s, len, i, mcs, mcs_len)) { // starting ml comment
+      memset(&hl[i], HL_MLCOMMENT, mcs_len);
+      i += mcs_len;
+      mode = (mode == LEX_SPECIAL_GAP) ? LEX_SPECIAL_COMMENT : LEX_COMMENT;
+      continue;
+    }
+
+    if(mode == LEX_SPECIAL_GAP) { // not a comment, the next word of the special line
+      hl[i++] = HL_SPECIAL;
+      mode = LEX_SPECIAL_RUN;
+      continue;
+    }
+
+    if(act & LEX_ACT_SPECIAL) {
+      int w = i + 1;
+      while(w < len && (tables->cls[(unsigned char) s[w]] & CC_SPACE)) w++;
+      
+      int slen = lexWordLength(tables, s, len, w);
+      if(keywordLookup(&tables->specials, &s[w], slen)) { // match special token
+        memset(&hl[i], HL_NORMAL, w - i); // may be past stop
+        hl[i] = HL_SPECIAL;
+        memset(&hl[w], HL_SPECIAL, slen);
+        i = w + slen;
+        mode = LEX_SPECIAL_GAP;
+        continue;
+      }
+      hl[i++] = HL_NORMAL; // the lexer goes on as if it wasn't there
+      continue;
+    }
+
+    if(act & LEX_ACT_STRING) {
+      mode = (c == '"') ? LEX_STRING2 : LEX_STRING1;
+      hl[i++] = HL_STRING;
+      continue;
+    }
+
+    if(mode == LEX_CODE) {
+      if((act & LEX_ACT_NUMBER) && (isdigit(c) || (c == '.' && i+1 < len && isdigit(s[i+1])))) {
+        i = lexNumber(tables, s, len, hl, i); // may be past stop
+        mode = LEX_WORD;
+        continue;
+      }
+
+      // a keyword is a whole word, so only the word starting here can match
+      int kwlen = (act & LEX_ACT_KEYWORD) ? lexWordLength(tables, s, len, i) : 0;
+      int kwtype = keywordLookup(&tables->keywords, &s[i], kwlen);
+
+      if(kwtype) { // match keyword
+        memset(&hl[i], kwtype, kwlen);
+        i += kwlen;
+        mode = LEX_WORD; // a keyword isn't a separator
+        continue;
+      }
+      if(kwlen > 0 && tables->plain_words) { // the rest of the word is highlighted the same
+        memset(&hl[i], HL_NORMAL, kwlen);
+        i += kwlen;
+        mode = LEX_WORD;
+        continue;
+      }
+    }
+    mode = (tables->cls[(unsigned char) c] & CC_SEP) ? LEX_CODE : LEX_WORD;
+    hl[i++] = HL_NORMAL;
+  }
+  st->mode = mode;
+  return i;
+}
+
+int editorHighlightLine(editorSyntax* syntax, const char* s, int len, unsigned char* hl, int in_comment) {
+  // highlight len characters of s into hl, starting inside a multi-line comment or not
+  // s doesn't need to be null-terminated, so rows that point into the file mapping can be used
+  // returns whether the line ends inside a multi-line comment
+  LEX_STATE st;
+  lexStateInit(&st, in_comment);
+  editorLexRun(syntax, s, len, hl, &st, 0, len);
+  return syntax ? lexStateInComment(&st) : 0;
+}
+
+void editorMarkRowStale(int at) {
+  // the comment state that the row was highlighted with isn't valid anymore
+  // only the flags change, a compressed row stays compressed
+  E_ROW* row = rowTreeRow(at);
+  if(row->flags & ROW_HL_STALE) return;
+  row->flags |= ROW_HL_STALE;
+  // brackets in strings and comments don't count, so they may have to be counted again
+  rowTreeInvalidate(&row->leaf->node);
+  E.hl_stale++;
+  if(at < E.hl_stale_from) E.hl_stale_from = at;
+}
+
+void editorSetRowState(E_ROW* row, int at, int in_comment) {
+  // store the comment state at the end of a row that was just highlighted
+  // the next row was highlighted with the previous state, so it's stale if the state changed
+  int changed = (row->hl_open_comment != in_comment);
+  row->hl_open_comment = in_comment;
+
+  if(row->flags & ROW_HL_STALE) {
+    row->flags &= ~ROW_HL_STALE;
+    E.hl_stale--;
+    rowTreeInvalidate(&row->leaf->node);
+  }
+  if(changed && at + 1 < E.numrows) editorMarkRowStale(at + 1);
+}
+
+LONG_LINE* editorLongLine(E_ROW* row) {
+  // the lexer states of a row with the ROW_LONG flag, there are few long rows so a search will do
+  for(int i = 0; i < E.nlong_lines; i++) {
+    if(E.long_lines[i].hl == row->hl) return &E.long_lines[i];
+  }
+  return NULL;
+}
+
+LONG_LINE* editorLongLineAdd(E_ROW* row) {
+  if(E.nlong_lines == E.long_lines_cap) {
+    E.long_lines_cap = E.long_lines_cap ? 2 * E.long_lines_cap : 4;
+    E.long_lines = realloc(E.long_lines, E.long_lines_cap * sizeof(LONG_LINE));
+    if(!E.long_lines) die("editorLongLineAdd");
+  }
+  LONG_LINE* ll = &E.long_lines[E.nlong_lines++];
+  ll->hl = row->hl;
+  ll->chunks = NULL;
+  ll->nchunks = ll->cap = 0;
+  ll->lexed = 0;
+  ll->first = 1;
+  ll->last = 0;
+  row->flags |= ROW_LONG;
+  return ll;
+}
+
+void editorLongLineDrop(E_ROW* row) {
+  // forget the lexer states of a row, before its hl is freed
+  LONG_LINE* ll = editorLongLine(row);
+  free(ll->chunks);
+  *ll = E.long_lines[--E.nlong_lines];
+  row->flags &= ~ROW_LONG;
+}
+
+void lineChunkAppend(LONG_LINE* ll, LINE_CHUNK c) {
+  if(ll->nchunks == ll->cap) {
+    ll->cap = ll->cap ? 2 * ll->cap : 64;
+    ll->chunks = realloc(ll->chunks, ll->cap * sizeof(LINE_CHUNK));
+    if(!ll->chunks) die("lineChunkAppend");
+  }
+  ll->chunks[ll->nchunks++] = c;
+}
+
+int lineChunkFind(LONG_LINE* ll, int i, int by_rx) {
+  // the chunk that the character at index i of chars is in, or render index i with by_rx
+  int lo = 1, hi = ll->nchunks; // the chunks below lo start at or before i
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if((by_rx ? ll->chunks[mid].rx : ll->chunks[mid].start) <= i) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+int renderColumn(const char* s, int from, int to, int rx, int* tabs) {
+  // the render index of the character 'to' of s, from the render index rx of the character 'from',
+  // the characters between the tabs are skipped at once, the tabs in between go in *tabs
+  int n = 0;
+  while(from < to) {
+    const char* tab = memchr(&s[from], '\t', to - from);
+    int next = tab ? tab - s : to;
+    rx += next - from;
+    from = next;
+    if(tab) {
+      rx += SHIM_TAB_STOP - rx % SHIM_TAB_STOP;
+      from++;
+      n++;
+    }
+  }
+  if(tabs) *tabs = n;
+  return rx;
+}
+
+void editorLongLineBuild(E_ROW* row) {
+  // cut a long row in chunks, without lexing it, the state at its end is already kept
+  // the chunks only get a state when they are shown, see editorLongLineLexTo
+  LONG_LINE* ll = editorLongLineAdd(row);
+  int at = editorRowIndex(row);
+  LEX_STATE st;
+  lexStateInit(&st, at > 0 && editorRowAt(at - 1)->hl_open_comment);
+
+  int rx = 0;
+  for(int p = 0; p < row->size; p += SHIM_LINE_CHUNK) {
+    int end = (row->size - p > SHIM_LINE_CHUNK) ? p + SHIM_LINE_CHUNK : row->size;
+    LINE_CHUNK c = {p, rx, lexStatePack(&st, NULL, 0), 0};
+    rx = renderColumn(row->chars, p, end, rx, &c.tabs);
+    lineChunkAppend(ll, c);
+  }
+  ll->lexed = 1;
+  row->rsize = rx;
+}
+
+unsigned char* editorLongLineLexRun(E_ROW* row, LEX_STATE* st, int state, int from, int stop, int* end) {
+  // lex the characters of a long row from 'from', in the packed state saved there, until the first
+  // token that starts at or after stop, returns their highlight in a scratch block and where the
+  // lexer stopped in *end
+  // the lexer only sees a little past stop, and as much again when a token goes on past that,
+  // so the rest of the row after a single-line comment is left to LEX_REST_COMMENT
+  static unsigned char* scratch = NULL;
+  static int scratch_size = 0;
+
+  int slack = SHIM_LINE_CHUNK / 16;
+  while(1) {
+    int len = (row->size - stop > slack) ? stop + slack : row->size;
+    int base = (from > 0) ? from - 1 : 0; // numbers look at the highlight just before them
+    if(len - base > scratch_size) {
+      scratch_size = len - base;
+      scratch = realloc(scratch, scratch_size);
+      if(!scratch) die("editorLongLineLexRun");
+    }
+    unsigned char* hl = scratch + (from - base);
+    if(from > base) scratch[0] = state >> 8;
+    if(st->mode == LEX_REST_COMMENT) {
+      memset(hl, HL_COMMENT, stop - from);
+      *end = stop;
+      return hl;
+    }
+
+    LEX_STATE run = *st;
+    int p = editorLexRun(E.syntax, row->chars + base, len - base, scratch, &run, from - base, stop - base) + base;
+    if(p == len && len < row->size) {
+      if(hl[p - 1 - from] != HL_COMMENT) { // the last token may go on past what the lexer saw
+        slack *= 2;
+        continue;
+      }
+      run.mode = LEX_REST_COMMENT;
+      p = stop;
+    }
+    *st = run;
+    *end = p;
+    return hl;
+  }
+}
+
+void editorLongLineLexTo(E_ROW* row, LONG_LINE* ll, int upto) {
+  // find the states of the first upto chunks of a long row, lexing on from the last known one
+  // a chunk has to start where the lexer stopped, so the start of a chunk that a token crosses
+  // moves to the end of the token, and the chunks that the token goes past are merged
+  while(ll->lexed < upto && ll->lexed < ll->nchunks) {
+    int k = ll->lexed;
+    LINE_CHUNK* c = &ll->chunks[k - 1];
+    LEX_STATE st;
+    int p;
+    lexStateUnpack(&st, c->state);
+    unsigned char* hl = editorLongLineLexRun(row, &st, c->state, c->start, c[1].start, &p);
+
+    int e = k; // the chunks from k to e start inside the token
+    while(e < ll->nchunks && ll->chunks[e].start < p) e++;
+    if(e > k) {
+      int last = (p < row->size) ? e - 1 : e; // the one that starts at p now
+      for(int i = k; i < last; i++) c->tabs += ll->chunks[i].tabs;
+      if(last < e) {
+        LINE_CHUNK* m = &ll->chunks[last];
+        int tabs;
+        m->rx = renderColumn(row->chars, m->start, p, m->rx, &tabs);
+        m->start = p;
+        m->tabs -= tabs;
+        c->tabs += tabs;
+      }
+      memmove(&ll->chunks[k], &ll->chunks[last], (ll->nchunks - last) * sizeof(LINE_CHUNK));
+      ll->nchunks -= last - k;
+      ll->first = 1; // the chunks in the render moved
+      ll->last = 0;
+    }
+    if(k < ll->nchunks) ll->chunks[k].state = lexStatePack(&st, hl, p - c->start);
+    ll->lexed = k + 1;
+  }
+}
+
+void editorLongLineView(E_ROW* row, int rx, int len, char** render, unsigned char** hl) {
+  // the render and the highlight of len columns of a long row from the render index rx on,
+  // only the chunks they are in are rendered and highlighted, into the block of the row
+  LONG_LINE* ll = editorLongLine(row);
+  int f, l;
+  while(1) {
+    f = lineChunkFind(ll, rx, 1);
+    l = lineChunkFind(ll, rx + len - 1, 1);
+    // the chunk after the last one shown gets a state too, an edit on the screen stops there
+    if(ll->lexed >= l + 2 || ll->lexed == ll->nchunks) break;
+    editorLongLineLexTo(row, ll, l + 2);
+  }
+
+  if(f < ll->first || l > ll->last) {
+    LINE_CHUNK* c = &ll->chunks[f];
+    int to = (l + 1 < ll->nchunks) ? ll->chunks[l + 1].start : row->size;
+    int width = ((l + 1 < ll->nchunks) ? ll->chunks[l + 1].rx : row->rsize) - c->rx;
+    if(width > row->render_cap / 2) {
+      int cap;
+      unsigned char* block = (unsigned char*) rowMemAlloc(2 * width, &cap);
+      rowMemFree(row->hl, row->render_cap);
+      ll->hl = row->hl = block;
+      row->render_cap = cap;
+    }
+    row->render = (char*) row->hl + row->render_cap / 2;
+
+    LEX_STATE st;
+    int end;
+    lexStateUnpack(&st, c->state);
+    unsigned char* chl = editorLongLineLexRun(row, &st, c->state, c->start, to, &end);
+    // each tab turns into spaces with the highlight of the tab
+    const char* s = row->chars;
+    int i = c->start, out = 0;
+    while(i < to) {
+      const char* tab = memchr(&s[i], '\t', to - i);
+      int next = tab ? tab - s : to;
+      memcpy(&row->render[out], &s[i], next - i);
+      memcpy(&row->hl[out], &chl[i - c->start], next - i);
+      out += next - i;
+      i = next;
+      if(tab) {
+        int spaces = SHIM_TAB_STOP - (c->rx + out) % SHIM_TAB_STOP;
+        memset(&row->render[out], ' ', spaces);
+        memset(&row->hl[out], chl[i - c->start], spaces);
+        out += spaces;
+        i++;
+      }
+    }
+    ll->first = f;
+    ll->last = l;
+  }
+  int off = rx - ll->chunks[ll->first].rx;
+  *render = row->render + off;
+  *hl = row->hl + off;
+}
+
+void editorRowView(E_ROW* row, int rx, int len, char** render, unsigned char** hl) {
+  // the render and the highlight of a rendered row from the render index rx on, for len columns
+  if((row->flags & ROW_LONG) && len > 0) {
+    editorLongLineView(row, rx, len, render, hl);
+    return;
+  }
+  *render = &row->render[rx];
+  *hl = &row->hl[rx];
+}
+
+void editorLongLineRestart(E_ROW* row, int at) {
+  // the start state of a long row changed, its chunks are lexed again when they are shown
+  LONG_LINE* ll = editorLongLine(row);
+  LEX_STATE st;
+  lexStateInit(&st, at > 0 && rowTreeRow(at - 1)->hl_open_comment);
+  ll->chunks[0].state = lexStatePack(&st, NULL, 0);
+  ll->lexed = 1;
+  ll->first = 1;
+  ll->last = 0;
+}
+
+int editorHighlightLongLine(E_ROW* row, int in_comment, int at, int delta) {
+  // lex a long row again after the characters from 'at' changed and the ones after the change
+  // moved by delta, the chunks after the change move along with them
+  // starts from a saved state before the change and stops at the first saved state after it
+  // that is still the same, with 'at' = -1 the whole row is lexed
+  // returns whether the row ends inside a multi-line comment
+  LONG_LINE* ll = editorLongLine(row);
+  LINE_CHUNK* old = ll->chunks;
+  int nold = ll->nchunks, old_lexed = ll->lexed;
+
+  // the state saved at a position also depends on the few characters after it that the lexer
+  // looks ahead at, so only the states well before the change are kept
+  int kept = 0;
+  if(at >= 0) {
+    while(kept < old_lexed && old[kept].start + SHIM_LINE_CHUNK <= at) kept++;
+  }
+  ll->chunks = NULL;
+  ll->nchunks = ll->cap = 0;
+  for(int k = 0; k < kept; k++) lineChunkAppend(ll, old[k]);
+
+  LEX_STATE st;
+  if(kept == 0) {
+    lexStateInit(&st, in_comment);
+    lineChunkAppend(ll, (LINE_CHUNK){0, 0, lexStatePack(&st, NULL, 0), 0});
+  }
+  int state = ll->chunks[ll->nchunks - 1].state;
+  int p = ll->chunks[ll->nchunks - 1].start;
+  int rx = ll->chunks[ll->nchunks - 1].rx;
+  ll->chunks[ll->nchunks - 1].tabs = 0; // its end may move
+  lexStateUnpack(&st, state);
+
+  // the old states after the change, where the lexer can stop if it's in the same state again
+  int gone = (at >= 0) ? at + (delta < 0 ? -delta : 0) : INT_MAX;
+  int changed_end = (at >= 0) ? at + (delta > 0 ? delta : 0) : INT_MAX;
+  int j = kept;
+  int same = -1;
+  while(1) {
+    while(j < nold && (old[j].start < gone || old[j].start + delta <= p)) j++;
+    int stop = p + SHIM_LINE_CHUNK;
+    int target = (j < old_lexed) ? old[j].start + delta : -1;
+    if(target >= changed_end && target < stop) stop = target;
+    if(stop > row->size) stop = row->size;
+    int q, tabs;
+    unsigned char* hl = editorLongLineLexRun(row, &st, state, p, stop, &q);
+    rx = renderColumn(row->chars, p, q, rx, &tabs);
+    ll->chunks[ll->nchunks - 1].tabs += tabs;
+    if(q >= row->size) break;
+    state = lexStatePack(&st, hl, q - p);
+    p = q;
+    if(p == target && target >= changed_end && state == old[j].state) {
+      same = j;
+      break;
+    }
+    lineChunkAppend(ll, (LINE_CHUNK){p, rx, state, 0});
+  }
+
+  if(same >= 0) {
+    // the rest of the row is lexed as it was, along with its end state, and its chunks keep
+    // their render width unless the render before them moved by a part of a tab stop
+    for(int k = same; k < nold; k++) {
+      LINE_CHUNK c = old[k];
+      c.start += delta;
+      c.rx = rx;
+      lineChunkAppend(ll, c);
+      int shift = rx - old[k].rx;
+      int end = (k + 1 < nold) ? old[k + 1].start + delta : row->size;
+      int old_end = (k + 1 < nold) ? old[k + 1].rx : row->rsize;
+      if(shift % SHIM_TAB_STOP == 0 || c.tabs == 0) rx = old_end + shift;
+      else rx = renderColumn(row->chars, c.start, end, rx, NULL);
+    }
+    ll->lexed = ll->nchunks - (nold - old_lexed);
+    in_comment = row->hl_open_comment;
+  } else {
+    ll->lexed = ll->nchunks;
+    in_comment = E.syntax ? lexStateInComment(&st) : 0;
+  }
+  row->rsize = rx;
+  ll->first = 1;
+  ll->last = 0;
+  free(old);
+  return in_comment;
+}
+
+void editorUpdateSyntaxFrom(E_ROW* row, int at, int delta) {
+  // highlight the row again, a long row only around the change from 'at'
+  // rows that are stale start in another state, so they are highlighted whole
+  PROBE_BEGIN(PROBE_HIGHLIGHT);
+  PROBE_ROWS(1);
+  int idx = editorRowIndex(row);
+  int in_comment = (idx > 0 && editorRowAt(idx - 1)->hl_open_comment);
+  if(row->flags & ROW_LONG) {
+    if(row->flags & ROW_HL_STALE) at = -1;
+    in_comment = editorHighlightLongLine(row, in_comment, at, delta);
+  } else {
+    in_comment = editorHighlightLine(E.syntax, row->render, row->rsize, row->hl, in_comment);
+  }
+  editorSetRowState(row, idx, in_comment);
+  bracketEditEnd(row);
+  PROBE_END(PROBE_HIGHLIGHT);
+}
+
+void editorUpdateSyntax(E_ROW* row) {
+  editorUpdateSyntaxFrom(row, -1, 0);
+}
+
+void editorHighlightRow(int at) {
+  // highlight a stale row again, for rows that aren't rendered only the comment state is kept
+  static unsigned char* scratch = NULL;
+  static int scratch_size = 0;
+
+  E_ROW* row = editorRowAt(at);
+  if(row->render) {
+    editorUpdateSyntax(row);
+    return;
+  }
+  PROBE_BEGIN(PROBE_HIGHLIGHT);
+  PROBE_ROWS(1);
+  if(row->size > scratch_size) {
+    scratch_size = row->size;
+    scratch = realloc(scratch, scratch_size);
+    if(!scratch) die("editorHighlightRow");
+  }
+  // tabs are separators like the spaces they render to, so the state is the same
+  int in_comment = (at > 0 && editorRowAt(at - 1)->hl_open_comment);
+  in_comment = editorHighlightLine(E.syntax, row->chars, row->size, scratch, in_comment);
+  editorSetRowState(row, at, in_comment);
+  PROBE_END(PROBE_HIGHLIGHT);
+}
+
+double editorElapsedMs(struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+void editorHighlightPending(int upto, double budget_ms) {
+  // highlight the stale rows in file order, until all the rows above 'upto' are up to date
+  // with a positive budget_ms, stop after spending that much time
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  PROBE_BEGIN(PROBE_HIGHLIGHT);
+
+  int n = 0;
+  while(E.hl_stale > 0 && E.hl_stale_from < upto && E.hl_stale_from < E.numrows) {
+    E_ROW* row = editorRowAt(E.hl_stale_from);
+    // highlighting a row can only make the row just below it stale
+    if(row->flags & ROW_HL_STALE) editorHighlightRow(E.hl_stale_from);
+    E.hl_stale_from++;
+
+    if(budget_ms > 0 && ++n % 256 == 0 && editorElapsedMs(&start) >= budget_ms) break;
+  }
+  if(E.hl_stale == 0) E.hl_stale_from = E.numrows;
+  PROBE_END(PROBE_HIGHLIGHT);
+}
+
+// comment states of the rows from 'from' on, computed by a worker
+typedef struct highlightJob {
+  EDITOR_JOB job;
+  editorSyntax* syntax;
+  int from;
+  int in_comment;        // state at the end of the row above 'from'
+  unsigned char* states; // state at the end of each row
+} HIGHLIGHT_JOB;
+
+void editorHighlightJobRun(EDITOR_JOB* job) {
+  HIGHLIGHT_JOB* hj = (HIGHLIGHT_JOB*) job;
+  SNAPSHOT* snap = job->snap;
+  unsigned char* scratch = NULL;
+  int scratch_size = 0;
+  SNAP_READER r = {snap, -1, NULL, 0};
+
+  int in_comment = hj->in_comment;
+  for(int j = hj->from; j < snap->nrows; j++) {
+    SNAP_ROW* row = &snap->rows[j];
+    if(row->size > scratch_size) {
+      scratch_size = row->size;
+      scratch = realloc(scratch, scratch_size);
+      if(!scratch) die("editorHighlightJobRun");
+    }
+    in_comment = editorHighlightLine(hj->syntax, snapRowChars(&r, j), row->size, scratch, in_comment);
+    hj->states[j - hj->from] = in_comment;
+  }
+  free(scratch);
+  free(r.buf);
+}
+
+void editorHighlightJobDone(EDITOR_JOB* job) {
+  HIGHLIGHT_JOB* hj = (HIGHLIGHT_JOB*) job;
+  E.hl_jobs--;
+
+  // the states are still right for the rows above the first one edited since the job started
+  int end = job->snap->nrows;
+  if(end > E.edit_low) end = E.edit_low;
+  if(hj->syntax != E.syntax) end = hj->from;
+
+  int at;
+  for(at = hj->from; at < end && E.hl_stale > 0; at++) {
+    // compressed rows only get their state, they aren't uncompressed for it
+    E_ROW* row = rowTreeRow(at);
+    if(!(row->flags & ROW_HL_STALE)) continue;
+    // a rendered row needs its highlight too, the row above it already has the right state
+    // a long row only needs its chunks lexed again, when they are shown
+    if(row->render && !(row->flags & ROW_LONG)) {
+      editorUpdateSyntax(editorRowAt(at)); // a rendered row isn't compressed
+      continue;
+    }
+    if(row->flags & ROW_LONG) editorLongLineRestart(row, at);
+    editorSetRowState(row, at, hj->states[at - hj->from]);
+  }
+  if(E.hl_stale == 0) E.hl_stale_from = E.numrows;
+  else if(E.hl_stale_from >= hj->from && E.hl_stale_from < at) E.hl_stale_from = at;
+
+  free(hj->states);
+  free(hj);
+}
+
+int editorHighlightStartJob() {
+  // let a worker find the comment states when many rows are stale
+  // returns 0 if there are too few of them, and they should be highlighted right away
+  if(E.hl_jobs) return 1;
+  if(E.hl_stale < SHIM_JOB_MIN_ROWS) return 0;
+
+  HIGHLIGHT_JOB* hj = malloc(sizeof(HIGHLIGHT_JOB));
+  if(!hj) die("editorHighlightStartJob");
+  hj->job.run = editorHighlightJobRun;
+  hj->job.done = editorHighlightJobDone;
+  hj->job.snap = editorSnapshot();
+  hj->syntax = E.syntax;
+  hj->from = E.hl_stale_from;
+  hj->in_comment = (hj->from > 0 && editorRowAt(hj->from - 1)->hl_open_comment);
+  hj->states = malloc(E.numrows - hj->from + 1);
+  if(!hj->states) die("editorHighlightStartJob");
+
+  E.edit_low = INT_MAX;
+  E.hl_jobs++;
+  editorJobSubmit(&hj->job);
+  return 1;
+}
+
+void editorMarkAllStale() {
+  for(int j = 0; j < E.numrows; j++) editorMarkRowStale(j);
+}
+
+int editorSyntaxToStyle(int hl) {
+  switch(hl) {
+    // HL_NORMAL have already been handled
+    // change foreground style
+    case HL_COMMENT : 
+    case HL_MLCOMMENT: return 0x020088ff; // italic sky blue
+    case HL_KEYWORD1 : return 0x01ff9d00; // bold bright orange
+    case HL_KEYWORD2 : return 0x0080ffbb; // normal teal blue
+    case HL_SPECIAL : return 0x0180ffbb; // bold teal blue 
+    case HL_NUMBER : return 0x00ff0044; // normal nail polish pink
+    case HL_STRING : return 0x003ad900; // normal spring green
+    // change background style
+    case HL_MATCH : return 0x001e96c8; // RGB(30, 150, 200), blue
+    case HL_ERROR : return 0x00820000; // normal dark maroon
+    default: return 0x00ffffff; // RGB(255, 255, 255), white
+  }
+}
+
+char** syntaxAddWords(char** list, char* words, int type2) {
+  // add the words separated by spaces to a NULL terminated list,
+  // the words of type 2 get the '|' that the keyword table looks for
+  int n = 0;
+  while(list && list[n]) n++;
+
+  for(char* w = strtok(words, " \t"); w; w = strtok(NULL, " \t")) {
+    list = realloc(list, (n + 2) * sizeof(char*));
+    char* word = malloc(strlen(w) + 2);
+    if(!list || !word) die("syntaxAddWords");
+    sprintf(word, "%s%s", w, type2 ? "|" : "");
+    list[n++] = word;
+    list[n] = NULL;
+  }
+  return list;
+}
+
+void syntaxFreeWords(char** list) {
+  for(int n = 0; list && list[n]; n++) free(list[n]);
+  free(list);
+}
+
+void editorFreeSyntax(editorSyntax* s) {
+  // free what editorLoadSyntax read, for a syntax file that can't be used
+  free(s->filetype);
+  syntaxFreeWords(s->filematch);
+  syntaxFreeWords(s->keywords);
+  syntaxFreeWords(s->specials);
+  free(s->singleline_comment_start);
+  free(s->multiline_comment_start);
+  free(s->multiline_comment_end);
+  free(s->separators);
+  if(s->tables) {
+    free(s->tables->keywords.slots);
+    free(s->tables->specials.slots);
+    free(s->tables);
+  }
+  memset(s, 0, sizeof(*s));
+}
+
+char* syntaxWord(char* old, char* value) {
+  // the first word of a value, for the settings that have a single one, in place of the old one
+  free(old);
+  value[strcspn(value, " \t")] = '\0';
+  char* word = strdup(value);
+  if(!word) die("syntaxWord");
+  return word;
+}
+
+int editorLoadSyntax(const char* path, editorSyntax* s) {
+  // read a syntax definition file, made of lines like "keywords if else while"
+  // returns 0 if it doesn't define a usable syntax
+  FILE* fp = fopen(path, "r");
+  if(!fp) return 0;
+
+  memset(s, 0, sizeof(*s));
+  int flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS;
+  char* line = NULL;
+  size_t linecapacity = 0;
+  ssize_t linelen;
+  int nline = 0, bad = 0;
+  int comment_after = 0;
+
+  while((linelen = getline(&line, &linecapacity, fp)) != -1) {
+    nline++;
+    while(linelen > 0 && isspace((unsigned char) line[linelen - 1])) line[--linelen] = '\0';
+    char* key = line + strspn(line, " \t");
+    if(*key == '\0' || *key == '#') continue; // empty line or comment
+
+    char* value = key + strcspn(key, " \t");
+    if(*value) *value++ = '\0';
+    value += strspn(value, " \t");
+
+    if(!strcmp(key, "filetype")) s->filetype = syntaxWord(s->filetype, value);
+    else if(!strcmp(key, "match")) s->filematch = syntaxAddWords(s->filematch, value, 0);
+    else if(!strcmp(key, "keywords")) s->keywords = syntaxAddWords(s->keywords, value, 0);
+    else if(!strcmp(key, "types")) s->keywords = syntaxAddWords(s->keywords, value, 1);
+    else if(!strcmp(key, "specials")) s->specials = syntaxAddWords(s->specials, value, 0);
+    else if(!strcmp(key, "special_start")) s->special_start = value[0];
+    else if(!strcmp(key, "comment")) s->singleline_comment_start = syntaxWord(s->singleline_comment_start, value);
+    else if(!strcmp(key, "comment_start")) s->multiline_comment_start = syntaxWord(s->multiline_comment_start, value);
+    else if(!strcmp(key, "comment_end")) s->multiline_comment_end = syntaxWord(s->multiline_comment_end, value);
+    else if(!strcmp(key, "separators")) s->separators = syntaxWord(s->separators, value);
+    else if(!strcmp(key, "comment_after")) {
+      // where a single-line comment can start, anywhere if the line isn't there
+      if(!strcmp(value, "space")) comment_after = HL_COMMENT_AFTER_SPACE;
+      else if(!bad) bad = nline;
+    }
+    else if(!strcmp(key, "highlight")) {
+      // the kinds of tokens to highlight, numbers and strings if the line isn't there
+      flags = 0;
+      for(char* w = strtok(value, " \t"); w; w = strtok(NULL, " \t")) {
+        if(!strcmp(w, "numbers")) flags |= HL_HIGHLIGHT_NUMBERS;
+        else if(!strcmp(w, "strings")) flags |= HL_HIGHLIGHT_STRINGS;
+        else if(!bad) bad = nline;
+      }
+    }
+    else if(!bad) bad = nline;
+  }
+  free(line);
+  fclose(fp);
+
+  if(s->specials && s->special_start) flags |= HL_HIGHLIGHT_SPECIAL;
+  s->flags = flags | comment_after;
+
+  if(bad) editorSetStatusMessage("%s:%d: unknown setting", path, bad);
+  if(!s->filetype || !s->filematch) {
+    editorSetStatusMessage("%s: no filetype or match", path);
+    editorFreeSyntax(s);
+    return 0;
+  }
+  return 1;
+}
+
+int syntaxNameCompare(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void editorLoadSyntaxes() {
+  // read the *.syntax files in $SHIM_SYNTAX_DIR, or ~/.config/shim/syntax,
+  // in the order of their names
+  char dir[PATH_MAX];
+  const char* env = getenv("SHIM_SYNTAX_DIR");
+  const char* home = getenv("HOME");
+  if(env) snprintf(dir, sizeof(dir), "%s", env);
+  else if(home) snprintf(dir, sizeof(dir), "%s/.config/shim/syntax", home);
+  else return;
+
+  DIR* d = opendir(dir);
+  if(!d) return;
+
+  char** names = NULL;
+  int n = 0;
+  struct dirent* ent;
+  while((ent = readdir(d))) {
+    int len = strlen(ent->d_name);
+    if(len <= 7 || strcmp(ent->d_name + len - 7, ".syntax")) continue;
+    names = realloc(names, (n + 1) * sizeof(char*));
+    if(!names || !(names[n] = strdup(ent->d_name))) die("editorLoadSyntaxes");
+    n++;
+  }
+  closedir(d);
+  if(n > 0) qsort(names, n, sizeof(char*), syntaxNameCompare);
+
+  for(int j = 0; j < n; j++) {
+    char path[sizeof(dir) + sizeof(ent->d_name)];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[j]);
+    
+    editorSyntax s;
+    if(editorLoadSyntax(path, &s)) {
+      E.syntaxes = realloc(E.syntaxes, (E.nsyntaxes + 1) * sizeof(editorSyntax));
+      if(!E.syntaxes) die("editorLoadSyntaxes");
+      E.syntaxes[E.nsyntaxes++] = s;
+    }
+    free(names[j]);
+  }
+  free(names);
+}
+
+int syntaxMatches(editorSyntax* s, const char* filename) {
+  // check if the filename matches one of the filematch fields of the syntax
+  char* ext = strchr(filename, '.'); // get file extension
+
+  for(unsigned int i = 0; s->filematch[i]; i++) {
+    int is_ext = (s->filematch[i][0] == '.');
+    // check if the pattern in the filematch exists in the filename
+    if((is_ext && ext && !strcmp(ext, s->filematch[i])) || // if the extension matches or
+       (!is_ext && strstr(filename, s->filematch[i]))) { // if is a substring of filename
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void editorSelectSyntaxHighlight() {
+  // tries to match the current filename to one of the loaded syntaxes, then to HLDB
+
+  if(E.syntax) editorMarkAllStale(); // remove the highlight of the previous syntax
+  E.syntax = NULL;
+  if(E.filename == NULL || E.safe) return;
+
+  int total = E.nsyntaxes + HLDB_ENTRIES;
+  for(int j = 0; j < total; j++) {
+    editorSyntax* s = (j < E.nsyntaxes) ? &E.syntaxes[j] : &HLDB[j - E.nsyntaxes];
+    
+    if(syntaxMatches(s, E.filename)) {
+      E.syntax = s; // update highlight syntax for this file
+      editorCompileSyntax(s);
+      
+      // must refactor syntax highlighting after updating it
+      // the rows on the screen are highlighted when drawn, the rest in the background
+      editorMarkAllStale();
+      return;
+    }
+  }
+}
+
+// the thresholds past which a file opens in safe mode, where it isn't highlighted,
+// brackets aren't matched and new lines aren't indented
+static struct {
+  long long size;
+  long rows, line;
+} safe_limits;
+
+enum editorSafeReason {
+  SAFE_SIZE = 1,
+  SAFE_ROWS = 2,
+  SAFE_LINE = 4,
+  SAFE_USER = 8 // turned on with Ctrl-E
+};
+
+long long editorSafeLimit(const char* name, long long def) {
+  // a threshold from the environment, like 512M, 0 turns it off
+  const char* env = getenv(name);
+  if(!env || !*env) return def;
+  char* end;
+  long long n = strtoll(env, &end, 10);
+  switch(*end) {
+    case 'G': case 'g': n <<= 10; // fall through
+    case 'M': case 'm': n <<= 10; // fall through
+    case 'K': case 'k': n <<= 10; end++;
+  }
+  return (n < 0 || *end) ? def : n;
+}
+
+void editorSafeInit() {
+  safe_limits.size = editorSafeLimit("SHIM_SAFE_SIZE", SHIM_SAFE_SIZE);
+  safe_limits.rows = editorSafeLimit("SHIM_SAFE_ROWS", SHIM_SAFE_ROWS);
+  safe_limits.line = editorSafeLimit("SHIM_SAFE_LINE", SHIM_SAFE_LINE);
+}
+
+void editorSafeCheck(long long size, int longest) {
+  // go to safe mode if the file that was opened crosses one of the thresholds
+  // a size of -1 checks the rows, once they're all loaded
+  int why = 0;
+  if(size >= 0) {
+    if(safe_limits.size && size >= safe_limits.size) why = SAFE_SIZE;
+  } else if(safe_limits.rows && E.numrows >= safe_limits.rows) {
+    why = SAFE_ROWS;
+  } else if(safe_limits.line && longest >= safe_limits.line) {
+    why = SAFE_LINE;
+  }
+  if(!why || E.safe) return;
+
+  E.safe = why;
+  editorSelectSyntaxHighlight(); // the rows loaded already are highlighted again without a syntax
+  if(why == SAFE_SIZE) {
+    editorSetStatusMessage("Safe mode for a file of %lld MB, Ctrl-E turns highlighting on", size >> 20);
+  } else if(why == SAFE_ROWS) {
+    editorSetStatusMessage("Safe mode for a file of %d lines, Ctrl-E turns highlighting on", E.numrows);
+  } else {
+    editorSetStatusMessage("Safe mode for a line of %d bytes, Ctrl-E turns highlighting on", longest);
+  }
+}
+
+void editorSafeToggle() {
+  // leave safe mode, or go to it for a file that is slow to edit
+  E.safe = E.safe ? 0 : SAFE_USER;
+  editorSelectSyntaxHighlight();
+  if(E.safe) editorMatchRestore();
+  else editorMatchClosingCallback();
+  editorSetStatusMessage(E.safe ? "Safe mode: no highlighting, bracket matching or indenting" :
+    "Safe mode is off, the file is highlighted in the background");
+}
+
+int ndigits(int num) {
+  int d = 0;
+  
+  do {
+    ++d;
+  } while(num /= 10);
+  
+  return d; 
+}
+
+int* editorRowTabs(E_ROW* row) {
+  // the tab table of a rendered row is at the start of its block, just before hl:
+  // the index of each tab in chars, then the render index just after each one
+  return (int*) row->hl - 2 * row->ntabs;
+}
+
+int editorRowCxtoRx(E_ROW* row, int cx) {
+  // convert a chars index into a render index
+  if(row->flags & ROW_LONG) {
+    LONG_LINE* ll = editorLongLine(row);
+    LINE_CHUNK* c = &ll->chunks[lineChunkFind(ll, cx, 0)];
+    return renderColumn(row->chars, c->start, cx, c->rx, NULL);
+  }
+  if(row->render) {
+    // find the last tab before cx in the tab table
+    int* tab_cx = editorRowTabs(row);
+    int* tab_end = tab_cx + row->ntabs;
+    int lo = 0, hi = row->ntabs; // the tabs below lo are before cx
+    while(lo < hi) {
+      int mid = (lo + hi) / 2;
+      if(tab_cx[mid] < cx) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo ? tab_end[lo - 1] + (cx - tab_cx[lo - 1] - 1) : cx;
+  }
+  int j, rx = 0;
+  // loop through all the characters to the left of cx
+  // to figure out how many spaces each TAB takes up
+  for(j = 0; j < cx; j++) {
+    if(row->chars[j] == '\t'){
+      // get rx just to the left of the next tab stop
+      rx += (SHIM_TAB_STOP - 1) - (rx % SHIM_TAB_STOP);	  
+    }
+    rx++;
+  }
+  return rx;
+}
+
+int editorRowRxtoCx(E_ROW* row, int rx) {
+  // convert a render index into a chars index  
+  if(row->flags & ROW_LONG) {
+    LONG_LINE* ll = editorLongLine(row);
+    LINE_CHUNK* c = &ll->chunks[lineChunkFind(ll, rx, 1)];
+    int cx = c->start, curr_rx = c->rx;
+    while(cx < row->size) {
+      // the characters up to the next tab take a column each
+      int next = cx + (rx - curr_rx);
+      const char* tab = memchr(&row->chars[cx], '\t', (next < row->size ? next + 1 : row->size) - cx);
+      if(!tab) return next < row->size ? next : row->size;
+      curr_rx += (tab - &row->chars[cx]);
+      cx = tab - row->chars;
+      curr_rx += SHIM_TAB_STOP - curr_rx % SHIM_TAB_STOP;
+      if(curr_rx > rx) return cx;
+      cx++;
+    }
+    return cx;
+  }
+  if(row->render) {
+    // find the tab that rx is in, or the last one before it
+    int* tab_cx = editorRowTabs(row);
+    int* tab_end = tab_cx + row->ntabs;
+    int lo = 0, hi = row->ntabs; // the tabs below lo end before rx
+    while(lo < hi) {
+      int mid = (lo + hi) / 2;
+      if(tab_end[mid] <= rx) lo = mid + 1;
+      else hi = mid;
+    }
+    if(lo < row->ntabs) {
+      int start = lo ? tab_end[lo - 1] + (tab_cx[lo] - tab_cx[lo - 1] - 1) : tab_cx[0];
+      if(rx >= start) return tab_cx[lo];
+    }
+    int cx = lo ? tab_cx[lo - 1] + 1 + (rx - tab_end[lo - 1]) : rx;
+    return cx < row->size ? cx : row->size;
+  }
+
+  int curr_rx = 0, cx;
+
+  for(cx = 0; cx < row->size; cx++) {
+    if(row->chars[cx] == '\t') {
+      curr_rx += (SHIM_TAB_STOP - 1) - (curr_rx % SHIM_TAB_STOP);
+    }
+    curr_rx++;
+    if(curr_rx > rx) return cx;
+  }
+  return cx;
+}
+
+int editorUpdateLongRow(E_ROW* row, int at, int delta) {
+  // a long row keeps its chunks, only the ones around the change are lexed again and
+  // its characters aren't scanned for tabs, returns 0 if the row must be built again
+  if(!(row->flags & ROW_LONG) || at < 0 || row->size < SHIM_LONG_LINE) return 0;
+  editorUpdateSyntaxFrom(row, at, delta);
+  return 1;
+}
+
+int scanCountByteScalar(const char* s, int len, char c) {
+  int n = 0;
+  for(int i = 0; i < len; i++) n += (s[i] == c);
+  return n;
+}
+
+int scanCountByte(const char* s, int len, char c) {
+  // how many times c is in the len bytes at s, 16 bytes are compared at once
+  int n = 0, i = 0;
+#ifdef __SSE2__
+  const __m128i v = _mm_set1_epi8(c);
+  for(; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, v)));
+  }
+#elif defined(SHIM_NEON)
+  const uint8x16_t v = vdupq_n_u8(c);
+  for(; i + 16 <= len; i += 16) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*) (s + i)), v);
+    n += vaddvq_u8(vshrq_n_u8(eq, 7));
+  }
+#endif
+  return n + scanCountByteScalar(s + i, len - i, c);
+}
+
+int scanControlScalar(const char* s, int len) {
+  int i = 0;
+  while(i < len && (unsigned char) s[i] >= 32 && s[i] != 127) i++;
+  return i;
+}
+
+int scanControl(const char* s, int len) {
+  // index of the first control character in the len bytes at s, or len if there's none
+  // the same characters as iscntrl in the C locale, the bytes of UTF-8 sequences aren't ones
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i low = _mm_set1_epi8(31), del = _mm_set1_epi8(127);
+  for(; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+    // the bytes below 32 are the ones that min leaves unchanged
+    __m128i ctrl = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(a, low), a), _mm_cmpeq_epi8(a, del));
+    unsigned mask = _mm_movemask_epi8(ctrl);
+    if(mask) return i + __builtin_ctz(mask);
+  }
+#elif defined(SHIM_NEON)
+  const uint8x16_t space = vdupq_n_u8(32), del = vdupq_n_u8(127);
+  for(; i + 16 <= len; i += 16) {
+    uint8x16_t a = vld1q_u8((const uint8_t*) (s + i));
+    if(vmaxvq_u8(vorrq_u8(vcltq_u8(a, space), vceqq_u8(a, del)))) break;
+  }
+#endif
+  return i + scanControlScalar(s + i, len - i);
+}
+
+int editorExpandTabs(const char* s, int len, char* out, int* tab_cx, int* tab_end) {
+  // copy the len characters at s to out with each tab turned into spaces up to the next tab stop,
+  // and note where each tab is in s and where its spaces end in out, returns the length of out
+  // the characters between the tabs are copied at once
+  const char* end = s + len;
+  const char* p = s;
+  const char* tab;
+  int idx = 0, k = 0;
+  while((tab = memchr(p, '\t', end - p)) != NULL) {
+    memcpy(&out[idx], p, tab - p);
+    idx += tab - p;
+    int spaces = SHIM_TAB_STOP - idx % SHIM_TAB_STOP;
+    memset(&out[idx], ' ', spaces);
+    idx += spaces;
+    tab_cx[k] = tab - s;
+    tab_end[k++] = idx;
+    p = tab + 1;
+  }
+  memcpy(&out[idx], p, end - p);
+  return idx + (end - p);
+}
+
+void editorUpdateRowFrom(E_ROW* row, int at, int delta) {
+  // build the render and the highlight of a row again after its characters changed from 'at',
+  // the characters after the change moved by delta, with 'at' = -1 all of them may have changed
+  if(editorUpdateLongRow(row, at, delta)) return;
+  if(row->flags & ROW_LONG) editorLongLineDrop(row);
+  // a long row is rendered a chunk at a time, there's no need to count its tabs
+  int tabs = (row->size < SHIM_LONG_LINE) ? scanCountByte(row->chars, row->size, '\t') : 0;
+
+  // allocate memory for render
+  // the maximum number of characters needed for each tab is SHIM_TAB_STOP
+  // row->size already counts 1 character for each tab 
+  // so multiply tabs by (SHIM_TAB_STOP - 1) and add that to row->size
+  // the tab table, hl and render share one block, a row without tabs is its own render
+  // an empty row gets a block as well, so that every rendered row has an hl
+  int maxlen = row->size + tabs*(SHIM_TAB_STOP - 1);
+  int need = tabs ? 2 * tabs * (int) sizeof(int) + 2 * maxlen + 1 : (row->size ? row->size : 1);
+  if(row->size >= SHIM_LONG_LINE) need = 4 * SHIM_LINE_CHUNK; // the render and hl of two chunks
+  char* block = row->render ? (char*) editorRowTabs(row) : NULL;
+  if(need > row->render_cap) {
+    rowMemFree(block, row->render_cap);
+    block = rowMemAlloc(need, &row->render_cap);
+  }
+  int* tab_cx = (int*) block;
+  int* tab_end = tab_cx + tabs;
+  row->ntabs = tabs;
+  row->hl = (unsigned char*)(tab_end + tabs);
+
+  if(row->size >= SHIM_LONG_LINE) {
+    row->render = (char*) row->hl + row->render_cap / 2;
+    // a row that is only being rendered keeps the state at its end, it's lexed when it's shown
+    if(at < 0) {
+      editorLongLineBuild(row);
+      return;
+    }
+    editorLongLineAdd(row);
+    editorUpdateSyntax(row);
+    return;
+  }
+  if(tabs == 0) {
+    row->render = row->chars;
+    row->rsize = row->size;
+    editorUpdateSyntax(row);
+    return;
+  }
+  row->render = (char*) row->hl + maxlen;
+  row->rsize = editorExpandTabs(row->chars, row->size, row->render, tab_cx, tab_end);
+  row->render[row->rsize] = '\0';
+
+  editorUpdateSyntax(row);
+}
+
+void editorUpdateRow(E_ROW* row) {
+  editorUpdateRowFrom(row, -1, 0);
+}
+
+void editorUpdateRowOffset() {
+  //E.screencols += (E.row_num_offset + 1);
+  E.row_num_offset = ndigits(E.numrows);
+  //E.screencols -= (E.row_num_offset + 1);
+}
+
+void editorUndoStep(int kind) {
+  // called before each key, the changes it makes start a new undo step
+  // unless they continue a run of typing or erasing
+  E_UNDO* u = &E.undo;
+  if(kind != UNDO_EDIT && kind == u->kind && (u->head >= 0 || u->lost)) return;
+
+  if(u->head >= 0) {
+    UNDO_RECORD* head = (UNDO_RECORD*)(u->buf + u->head);
+    head->ay = E.curr_y;
+    head->ax = E.curr_x;
+  }
+  u->head = -1;
+  u->kind = kind;
+  u->lost = 0;
+}
+
+int editorUndoReserve(long size) {
+  // make room for size more bytes after pos, dropping the oldest steps if there's no memory left
+  // returns 0 if the step being recorded is too big to be kept
+  E_UNDO* u = &E.undo;
+  if(u->pos + size <= u->cap) return 1;
+
+  if(size > SHIM_UNDO_MAX / 2 || (u->head >= 0 && u->pos + size - u->head > SHIM_UNDO_MAX / 2)) {
+    // the steps before it can't be undone without it, so they are dropped as well
+    u->len = u->pos = 0;
+    u->last = u->head = u->saved = -1;
+    u->lost = 1;
+    return 0;
+  }
+  if(u->pos + size > SHIM_UNDO_MAX) {
+    // drop a quarter of the journal at once, so that it isn't moved at every change
+    long want = u->pos + size - SHIM_UNDO_MAX + SHIM_UNDO_MAX / 4;
+    long cut = 0;
+    while(cut < u->pos) {
+      UNDO_RECORD* rec = (UNDO_RECORD*)(u->buf + cut);
+      if(cut >= want && rec->step) break;
+      cut += rec->size;
+    }
+    memmove(u->buf, u->buf + cut, u->pos - cut);
+    u->len = u->pos -= cut;
+    u->last = (u->last >= cut) ? u->last - cut : -1;
+    if(u->head >= 0) u->head -= cut;
+    u->saved = (u->saved >= cut) ? u->saved - cut : -1;
+    if(u->pos > 0) ((UNDO_RECORD*)u->buf)->prev = 0;
+    if(u->pos + size <= u->cap) return 1;
+  }
+  long cap = u->cap ? u->cap : 4096;
+  while(cap < u->pos + size) cap *= 2;
+  if(cap > SHIM_UNDO_MAX) cap = SHIM_UNDO_MAX;
+  u->buf = realloc(u->buf, cap);
+  if(!u->buf) die("editorUndoReserve");
+  u->cap = cap;
+  return 1;
+}
+
+long editorUndoRecordSize(int len) {
+  // records stay aligned for their fields
+  return (sizeof(UNDO_RECORD) + len + 7) & ~7L;
+}
+
+void editorUndoRecord(int type, int y, int x, const char* s, int len) {
+  // add a change to the undo journal, typed characters are merged into the change before them
+  E_UNDO* u = &E.undo;
+  if(u->paused || u->lost) return;
+  u->len = u->pos; // the changes that were undone can't be redone anymore
+  if(u->saved > u->pos) u->saved = -1;
+
+  if(u->kind != UNDO_EDIT && u->head >= 0) {
+    UNDO_RECORD* rec = (UNDO_RECORD*)(u->buf + u->last);
+    int append = (type == UNDO_INSERT_CHARS && x == rec->x + rec->len) || // typing
+                 (type == UNDO_DELETE_CHARS && x == rec->x);              // deleting forward
+    int prepend = (type == UNDO_DELETE_CHARS && x + len == rec->x);       // erasing backward
+    if(rec->type == type && rec->y == y && (append || prepend)) {
+      long size = editorUndoRecordSize(rec->len + len);
+      if(!editorUndoReserve(size - rec->size)) return;
+      rec = (UNDO_RECORD*)(u->buf + u->last);
+      char* text = (char*)(rec + 1);
+      if(append) {
+        memcpy(text + rec->len, s, len);
+      } else {
+        memmove(text + len, text, rec->len);
+        memcpy(text, s, len);
+        rec->x = x;
+      }
+      rec->len += len;
+      u->len = u->pos += size - rec->size;
+      rec->size = size;
+      return;
+    }
+  }
+
+  long size = editorUndoRecordSize(len);
+  if(!editorUndoReserve(size)) return;
+  UNDO_RECORD* rec = (UNDO_RECORD*)(u->buf + u->pos);
+  rec->size = size;
+  rec->prev = (u->last >= 0) ? u->pos - u->last : 0;
+  rec->type = type;
+  rec->step = (u->head < 0);
+  rec->y = y;
+  rec->x = x;
+  rec->len = len;
+  rec->cy = rec->ay = E.curr_y;
+  rec->cx = rec->ax = E.curr_x;
+  memcpy(rec + 1, s, len);
+
+  if(rec->step) u->head = u->pos;
+  u->last = u->pos;
+  u->len = u->pos += size;
 }
 
 void editorInsertRow(int at, char* s, size_t len, int leading_spaces) { 
   if(at < 0 || at > E.numrows) return;
 
-  E.row = realloc(E.row, sizeof(E_ROW) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(E_ROW) * (E.numrows - at));
-  for(int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+  editorNoteEdit(at);
+  E_ROW* row = rowTreeInsert(at);
+  E.numrows++;
+
+  row->size = len + leading_spaces;
+  rowTreeAddBytes(row, row->size);
+  row->chars = rowMemAlloc(len + leading_spaces + 1, &row->chars_cap);
+  memset(row->chars, ' ', leading_spaces);
+  memcpy(row->chars + leading_spaces, s, len);
+  row->chars[len + leading_spaces] = '\0';
+  editorUndoRecord(UNDO_INSERT_ROW, at, 0, row->chars, row->size);
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->render_cap = 0;
+  row->hl = NULL;
+  row->ntabs = 0;
+  // start with the state that the row below was highlighted with
+  row->hl_open_comment = (at > 0 && editorRowAt(at - 1)->hl_open_comment);
+  row->flags = 0;
+  row->gen = E.snap_gen;
+  editorUpdateRow(row);
+  // a long row isn't lexed when it's built, so the state at its end is found later
+  if(E.syntax && (row->flags & ROW_LONG)) editorMarkRowStale(at);
+
+  editorUpdateRowOffset();
+  E.dirty++;
+}
+
+E_ROW* editorAppendLazyRow(char* s, int len) {
+  // append a row with the characters at s, which become the row's
+  // it will be rendered and highlighted only when it's needed
+  E_ROW* row = rowTreeInsert(E.numrows);
+  E.numrows++;
+
+  row->size = len;
+  rowTreeAddBytes(row, len);
+  row->chars = s;
+  row->chars_cap = 0;
+  row->rsize = 0;
+  row->render = NULL;
+  row->render_cap = 0;
+  row->hl = NULL;
+  row->ntabs = 0;
+  row->hl_open_comment = 0;
+  row->flags = 0;
+  row->gen = E.snap_gen;
+  // the comment state is unknown until the row gets highlighted
+  if(E.syntax) editorMarkRowStale(E.numrows - 1);
+  return row;
+}
+
+void editorAppendMappedRow(char* s, int len) {
+  // append a row whose characters stay in the file mapping
+  editorAppendLazyRow(s, len)->flags |= ROW_MAPPED;
+}
+
+E_ROW* editorRenderRow(int at) {
+  // get a row, building its render and highlight if it was loaded lazily
+  E_ROW* row = editorRowAt(at);
+  if(row && !row->render) editorUpdateRow(row);
+  return row;
+}
+
+void editorRowMoveChars(E_ROW* row, char* chars) {
+  // a row without tabs is its own render, so the render follows its characters
+  if(row->render == row->chars) row->render = chars;
+  row->chars = chars;
+}
+
+void editorRowOwnChars(E_ROW* row) {
+  // called before modifying the characters of a row
+  // they're copied if they are in the file mapping, or if a snapshot may be reading them
+  editorNoteEdit(editorRowIndex(row));
+  bracketEditBegin(row);
+  int shared = editorRowShared(row);
+  if(!(row->flags & ROW_MAPPED) && !shared) return;
+
+  int cap;
+  char* chars = rowMemAlloc(row->size + 1, &cap);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  if(shared) editorBuryChars(row->chars, row->chars_cap);
+  editorRowMoveChars(row, chars);
+  row->chars_cap = cap;
+  row->flags &= ~ROW_MAPPED;
+  row->gen = E.snap_gen;
+}
+
+void editorRowGrowChars(E_ROW* row, int size) {
+  // make the characters of a row hold at least size bytes
+  editorRowMoveChars(row, rowMemGrow(row->chars, &row->chars_cap, size));
+}
+
+void editorFreeRow(E_ROW* row) {
+  if(row->flags & ROW_LONG) editorLongLineDrop(row);
+  if(row->render) rowMemFree(editorRowTabs(row), row->render_cap);
+  if(row->flags & ROW_PACKED) return; // the packed block goes with the leaf
+  if(editorRowShared(row)) editorBuryChars(row->chars, row->chars_cap);
+  else if(!(row->flags & ROW_MAPPED)) rowMemFree(row->chars, row->chars_cap);
+}
+
+void editorDelRow(int at) {
+  if(at < 0 || at >= E.numrows) return;
+  
+  editorNoteEdit(at);
+  E_ROW* row = editorRowAt(at);
+  editorUndoRecord(UNDO_DELETE_ROW, at, 0, row->chars, row->size);
+  int in_comment = row->hl_open_comment;
+  if(row->flags & ROW_HL_STALE) E.hl_stale--;
+  editorFreeRow(row);
+  rowTreeDelete(at);
+  E.numrows--;
+
+  if(at < E.hl_stale_from) E.hl_stale_from--;
+  // the row below now follows the row above, which may end in another comment state
+  int prev = (at > 0 && editorRowAt(at - 1)->hl_open_comment);
+  if(at < E.numrows && prev != in_comment) editorMarkRowStale(at);
+
+  editorUpdateRowOffset();
+  E.dirty++;
+}
+
+int bracketType(char c, int* v) {
+  // returns the pair that a bracket belongs to, and sets v to 1 if it opens or -1 if it closes
+  // returns -1 if c isn't a bracket
+  *v = 0;
+  switch(c) {
+    case '(' : *v = 1; return 0;
+    case ')' : *v = -1; return 0;
+    case '[' : *v = 1; return 1;
+    case ']' : *v = -1; return 1;
+    case '{' : *v = 1; return 2;
+    case '}' : *v = -1; return 2;
+  }
+  return -1;
+}
+
+int bracketCounts(const unsigned char* hl, int i) {
+  // brackets in strings and comments don't pair with the ones in the code around them
+  if(!hl) return 1;
+  return hl[i] != HL_STRING && hl[i] != HL_COMMENT && hl[i] != HL_MLCOMMENT;
+}
+
+void bracketSumLine(BRACKET_SUM* sum, const char* s, const unsigned char* hl, int len) {
+  // add the brackets of a line at the end of the ones counted in sum
+  for(int i = 0; i < len; i++) {
+    int v, t = bracketType(s[i], &v);
+    if(t < 0 || !bracketCounts(hl, i)) continue;
+    sum->net[t] += v;
+    if(sum->net[t] < sum->min[t]) sum->min[t] = sum->net[t];
+  }
+}
+
+void bracketSumAppend(BRACKET_SUM* sum, BRACKET_SUM* next) {
+  // add the brackets counted in next at the end of the ones counted in sum
+  for(int t = 0; t < 3; t++) {
+    if(sum->net[t] + next->min[t] < sum->min[t]) sum->min[t] = sum->net[t] + next->min[t];
+    sum->net[t] += next->net[t];
+  }
+}
+
+unsigned char* bracketRowHighlight(E_ROW* row, int at) {
+  // lex the characters of a row into a scratch block, to tell which of its brackets are in
+  // strings and comments, row->hl only has the chunks of a long row that are on the screen
+  // the highlight is NULL when there is no syntax
+  static unsigned char* scratch = NULL;
+  static int scratch_size = 0;
+
+  if(!E.syntax) return NULL;
+  if(row->size > scratch_size) {
+    scratch_size = row->size;
+    scratch = realloc(scratch, scratch_size);
+    if(!scratch) die("bracketRowHighlight");
+  }
+  // tabs are separators like the spaces they render to, so the state is the same
+  int in_comment = (at > 0 && editorRowAt(at - 1)->hl_open_comment);
+  editorHighlightLine(E.syntax, row->chars, row->size, scratch, in_comment);
+  return scratch;
+}
+
+unsigned char* bracketChunkHighlight(E_ROW* row, int i, int* start, int* end) {
+  // the highlight of the chunk of a long row that character i is in, from *start to *end,
+  // so that a bracket close by doesn't lex the whole row
+  LONG_LINE* ll = editorLongLine(row);
+  editorLongLineLexTo(row, ll, lineChunkFind(ll, i, 0) + 1);
+  LINE_CHUNK* c = &ll->chunks[lineChunkFind(ll, i, 0)];
+  LEX_STATE st;
+  int stop;
+  lexStateUnpack(&st, c->state);
+  *start = c->start;
+  *end = (c + 1 < ll->chunks + ll->nchunks) ? c[1].start : row->size;
+  return editorLongLineLexRun(row, &st, c->state, *start, *end, &stop);
+}
+
+int bracketRowCounts(E_ROW* row, int at, int i) {
+  // whether the bracket at character i of the row at index 'at' pairs with the ones around it
+  if(E.syntax && (row->flags & ROW_LONG)) {
+    int start, end;
+    unsigned char* hl = bracketChunkHighlight(row, i, &start, &end);
+    return bracketCounts(hl, i - start);
+  }
+  return bracketCounts(bracketRowHighlight(row, at), i);
+}
+
+void bracketRowSum(E_ROW* row, int at, BRACKET_SUM* sum) {
+  memset(sum, 0, sizeof(BRACKET_SUM));
+  bracketSumLine(sum, row->chars, bracketRowHighlight(row, at), row->size);
+}
+
+// the brackets of the row being changed, counted before the change
+static E_ROW* bracket_edit_row = NULL;
+static BRACKET_SUM bracket_edit_sum;
+
+void bracketEditBegin(E_ROW* row) {
+  // called before the characters of a row change, the subtrees above it only have to be
+  // counted again if the change adds or removes brackets that count, not on every key
+  // long rows aren't lexed twice for each key, their leaf is counted again instead
+  bracket_edit_row = NULL;
+  if(!row->leaf->node.br_valid || row->size >= SHIM_LONG_LINE) {
+    rowTreeInvalidate(&row->leaf->node);
+    return;
+  }
+  bracketRowSum(row, editorRowIndex(row), &bracket_edit_sum);
+  bracket_edit_row = row;
+}
+
+void bracketEditEnd(E_ROW* row) {
+  // called once the row changed in bracketEditBegin is highlighted again
+  if(row != bracket_edit_row) return;
+  bracket_edit_row = NULL;
+  if(!row->leaf->node.br_valid) return; // its comment state changed the next row
+  BRACKET_SUM sum;
+  if(row->size < SHIM_LONG_LINE) {
+    bracketRowSum(row, editorRowIndex(row), &sum);
+    if(memcmp(&sum, &bracket_edit_sum, sizeof(BRACKET_SUM)) == 0) return;
+  }
+  rowTreeInvalidate(&row->leaf->node);
+}
+
+int bracketHighlighted(int upto, double deadline) {
+  // highlight the stale rows above 'upto' until the deadline, tells if they are all up to date
+  double left = deadline - editorNowMs();
+  if(left > 0) editorHighlightPending(upto, left);
+  return E.hl_stale == 0 || E.hl_stale_from >= upto;
+}
+
+int bracketNodeUpdate(ROW_NODE* n, double deadline) {
+  // count the brackets of a subtree again, if they have changed
+  // returns 0 if the deadline came first, the subtrees counted so far stay counted
+  if(n->br_valid) return 1;
+
+  BRACKET_SUM br;
+  memset(&br, 0, sizeof(BRACKET_SUM));
+  if(n->is_leaf) {
+    ROW_LEAF* leaf = (ROW_LEAF*)n;
+    if(leaf->packed) rowLeafUnpack(leaf);
+    int base = editorRowIndex(&leaf->rows[0]);
+    // the comment states of the rows must be known
+    if(!bracketHighlighted(base + n->count, deadline) || editorNowMs() >= deadline) return 0;
+    for(int i = 0; i < n->count; i++) {
+      E_ROW* row = &leaf->rows[i];
+      bracketSumLine(&br, row->chars, bracketRowHighlight(row, base + i), row->size);
+    }
+  } else {
+    ROW_INNER* inner = (ROW_INNER*)n;
+    for(int i = 0; i < n->count; i++) {
+      if(!bracketNodeUpdate(inner->child[i], deadline)) return 0;
+      bracketSumAppend(&br, &inner->child[i]->br);
+    }
+  }
+  n->br = br;
+  n->br_valid = 1;
+  return 1;
+}
+
+int bracketReaches(BRACKET_SUM* sum, int t, int dir, int depth) {
+  // tells if walking through the brackets counted in sum brings depth down to 0
+  // going backward the lowest depth is reached at the start, after the net change is undone
+  if(dir == 1) return depth + sum->min[t] <= 0;
+  return sum->net[t] - sum->min[t] >= depth;
+}
+
+int bracketScanRow(int at, int from, int dir, int t, int* depth) {
+  // walk the brackets of the row at index 'at' from the character from,
+  // or from the start or the end of the row with from == -1, until depth gets to 0
+  // returns the character of the bracket that gets it there, or -1
+  E_ROW* row = editorRowAt(at);
+  if(from == -1) from = (dir == 1) ? 0 : row->size - 1;
+  // a long row is lexed a chunk at a time, as far as the walk goes
+  int chunked = E.syntax && (row->flags & ROW_LONG);
+  int start = 0, end = row->size;
+  unsigned char* hl = chunked ? NULL : bracketRowHighlight(row, at);
+
+  for(int i = from; i >= 0 && i < row->size; i += dir) {
+    if(chunked && (!hl || i < start || i >= end)) hl = bracketChunkHighlight(row, i, &start, &end);
+    int v, tt = bracketType(row->chars[i], &v);
+    if(tt != t || !bracketCounts(hl, i - start)) continue;
+    *depth += v * dir;
+    if(*depth == 0) return i;
+  }
+  return -1;
+}
+
+int bracketFound(int at, int cx, int* match_y, int* match_x) {
+  *match_y = at;
+  *match_x = editorRowCxtoRx(editorRowAt(at), cx);
+  return 1;
+}
+
+int editorFindBracket(int y, int x, int* match_y, int* match_x, double deadline) {
+  // find the bracket that pairs with the one at render column x of row y
+  // the brackets counted by the row tree are used to skip the subtrees that can't have it,
+  // so the search walks one path up the tree and one path down
+  // the rows have to be highlighted with their comment states up to date before their
+  // brackets are counted, the rows after the cursor are highlighted as the search gets there
+  // returns 1 if the pair is found, 0 if there's none, and -1 if the deadline came first
+  if(!bracketHighlighted(y + 1, deadline)) return -1;
+  E_ROW* row = editorRowAt(y);
+  int cx = editorRowRxtoCx(row, x);
+  if(cx >= row->size) return 0;
+  int v, t = bracketType(row->chars[cx], &v);
+  if(t < 0 || !bracketRowCounts(row, y, cx)) return 0;
+
+  int dir = v; // an opening bracket pairs with one after it
+  int depth = 1;
+  int col = (cx + dir >= 0) ? bracketScanRow(y, cx + dir, dir, t, &depth) : -1;
+  if(col >= 0) return bracketFound(y, col, match_y, match_x);
+
+  // the other rows of the leaf
+  ROW_LEAF* leaf = row->leaf;
+  int base = y - (int)(row - leaf->rows);
+  if(dir == 1 && !bracketHighlighted(base + leaf->node.count, deadline)) return -1;
+  for(int p = y - base + dir; p >= 0 && p < leaf->node.count; p += dir) {
+    if((col = bracketScanRow(base + p, -1, dir, t, &depth)) >= 0) {
+      return bracketFound(base + p, col, match_y, match_x);
+    }
+  }
+
+  // go up until a sibling reaches the pair, then down into it
+  ROW_NODE* n = &leaf->node;
+  ROW_NODE* found = NULL;
+  int next = base + leaf->node.count; // first row after the subtrees walked forward
+  while(n->parent && !found) {
+    ROW_INNER* parent = (ROW_INNER*)n->parent;
+    for(int i = rowTreeChildIndex(n->parent, n) + dir; i >= 0 && i < parent->node.count; i += dir) {
+      ROW_NODE* c = parent->child[i];
+      if(dir == 1) {
+        // a stale row may change the brackets that count in a subtree that looks valid
+        next += c->nrows;
+        if(!bracketHighlighted(next, deadline)) return -1;
+      }
+      if(!bracketNodeUpdate(c, deadline)) return -1;
+      if(bracketReaches(&c->br, t, dir, depth)) {
+        found = c;
+        break;
+      }
+      depth += dir * c->br.net[t];
+    }
+    n = n->parent;
+  }
+  if(!found) return 0;
+
+  while(!found->is_leaf) {
+    ROW_INNER* inner = (ROW_INNER*)found;
+    int i = (dir == 1) ? 0 : found->count - 1;
+    for(; i >= 0 && i < found->count; i += dir) {
+      ROW_NODE* c = inner->child[i];
+      if(bracketReaches(&c->br, t, dir, depth)) break;
+      depth += dir * c->br.net[t];
+    }
+    if(i < 0 || i >= found->count) return 0;
+    found = inner->child[i];
+  }
+  leaf = (ROW_LEAF*)found;
+  if(leaf->packed) rowLeafUnpack(leaf);
+  base = editorRowIndex(&leaf->rows[0]);
+  int p = (dir == 1) ? 0 : leaf->node.count - 1;
+  for(; p >= 0 && p < leaf->node.count; p += dir) {
+    if((col = bracketScanRow(base + p, -1, dir, t, &depth)) >= 0) {
+      return bracketFound(base + p, col, match_y, match_x);
+    }
+  }
+  return 0;
+}
+
+// the brackets highlighted by editorMatchClosingCallback, painted over the rows when they're drawn
+static int saved_hl_row[2];
+static int saved_hl_col[2]; // render index
+static char has_saved_hl = 0;
+
+void editorMatchRestore() {
+  // stop highlighting the matched brackets
+  has_saved_hl = 0;
+  E.match_pending = 0;
+}
+
+void editorDrawBracketMatch(int r, int col, int filerow, int len) {
+  // paint the matched brackets in the len columns of the row drawn from col on
+  if(!has_saved_hl) return;
+  for(int k = 0; k < 2; k++) {
+    int x = saved_hl_col[k] - E.coloff;
+    if(saved_hl_row[k] == filerow && x >= 0 && x < len) E.back.styles[r * E.gridcols + col + x] = HL_MATCH;
+  }
+}
+
+int editorMatchClosingCallback() {
+  // highlight the bracket under the cursor and the one that pairs with it
+  editorMatchRestore();
+
+  if(E.numrows == 0) return 0; // nothing to match in an empty buffer
+  if(E.safe) return 0; // finding the pair may have to count the brackets of the whole file
+
+  int x = E.curr_x, y = E.curr_y;
+  if(y >= E.numrows) y = E.numrows - 1;
+  E_ROW* row = editorRenderRow(y);
+  if(row->size == 0) return 0;
+  if(x >= row->size) x = row->size - 1;
+  x = editorRowCxtoRx(row, x);
+
+  int match_y, match_x;
+  int found = editorFindBracket(y, x, &match_y, &match_x, editorNowMs() + SHIM_BRACKET_MS);
+  if(found < 0) E.match_pending = 1; // the rest is looked for while there's no input
+  if(found <= 0) return 0;
+
+  saved_hl_row[0] = y;
+  saved_hl_col[0] = x;
+  saved_hl_row[1] = match_y;
+  saved_hl_col[1] = match_x;
+  has_saved_hl = 1;
+  return 1;
+}
+
+void editorRowInsertChar(E_ROW* row, int at, char c) {
+  if(at < 0 || at > row->size) at = row->size;
+  
+  char closing = 0;
+  if(c == '(') closing = c + 1;
+  else if(c == '{' || c == '[') closing = c + 2;
+  else if(c == '"' || c == '\'') closing = c;
+  
+  int clen = closing ? 2 : 1;
+
+  editorRowOwnChars(row);
+  editorRowGrowChars(row, row->size + clen + 1);
+  memmove(&row->chars[at + clen], &row->chars[at], row->size - at + 1);
+  row->size += clen;
+  rowTreeAddBytes(row, clen);
+  row->chars[at] = c;
+  if(closing) row->chars[at + 1] = closing;
+  editorUndoRecord(UNDO_INSERT_CHARS, editorRowIndex(row), at, &row->chars[at], clen);
+  editorUpdateRowFrom(row, at, clen);
+  E.dirty++;
+}
+
+void editorRowAppendString(E_ROW* row, char* s, size_t len) {
+  editorRowOwnChars(row);
+  editorRowGrowChars(row, row->size + len + 1);
+  // move len bytes from s to row->chars starting at row->size
+  memcpy(&row->chars[row->size], s, len);
+  editorUndoRecord(UNDO_INSERT_CHARS, editorRowIndex(row), row->size, s, len);
+  row->size += len;
+  rowTreeAddBytes(row, len);
+  row->chars[row->size] = '\0';
+  editorUpdateRowFrom(row, row->size - len, len);
+  E.dirty++;
+}
+
+void editorRowInsertString(E_ROW* row, int at, const char* s, int len) {
+  // insert len characters at 'at', without closing brackets
+  if(at < 0 || at > row->size) at = row->size;
+
+  editorRowOwnChars(row);
+  editorRowGrowChars(row, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  rowTreeAddBytes(row, len);
+  editorUndoRecord(UNDO_INSERT_CHARS, editorRowIndex(row), at, s, len);
+  editorUpdateRowFrom(row, at, len);
+  E.dirty++;
+}
+
+void editorRowDelChars(E_ROW* row, int at, int len) {
+  // delete len characters from 'at', or the ones up to the end of the row if there are fewer
+  if(at < 0 || at >= row->size || len <= 0) return;
+  if(len > row->size - at) len = row->size - at;
+
+  editorUndoRecord(UNDO_DELETE_CHARS, editorRowIndex(row), at, &row->chars[at], len);
+  editorRowOwnChars(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  rowTreeAddBytes(row, -len);
+  editorUpdateRowFrom(row, at, -len);
+  E.dirty++;
+}
+
+void editorRowDelChar(E_ROW* row, int at) {
+  editorRowDelChars(row, at, 1);
+}
+
+void editorInsertChar(int c) {
+  if(E.curr_y == E.numrows) {
+    // the cursor is on the tilde line after EOF
+    editorInsertRow(E.numrows, "", 0, 0);
+  }
+  // insert char at the current cursor position
+  editorRowInsertChar(editorRowAt(E.curr_y), E.curr_x, c);
+  E.curr_x++;
+  
+  editorMatchClosingCallback();
+}
+
+void editorInsertText(const char* s, int len) {
+  // insert text at the cursor as it is, without closing brackets or indenting the new lines
+  // the rows are updated once each, however long the text is
+  if(len == 0) return;
+  if(E.curr_y == E.numrows) editorInsertRow(E.numrows, "", 0, 0);
+
+  E_ROW* row = editorRowAt(E.curr_y);
+  const char* nl = memchr(s, '\n', len);
+  if(!nl) {
+    editorRowInsertString(row, E.curr_x, s, len);
+    E.curr_x += len;
+    editorMatchClosingCallback();
+    return;
+  }
+
+  // the characters after the cursor move to the end of the last line of the text
+  int taillen = row->size - E.curr_x;
+  char* tail = malloc(taillen + 1);
+  if(!tail) die("editorInsertText");
+  memcpy(tail, &row->chars[E.curr_x], taillen);
+  editorRowDelChars(row, E.curr_x, taillen);
+  editorRowAppendString(row, (char*) s, nl - s);
+
+  const char* end = s + len;
+  const char* line = nl + 1;
+  while(1) {
+    E.curr_y++;
+    nl = memchr(line, '\n', end - line);
+    if(!nl) break;
+    editorInsertRow(E.curr_y, (char*) line, nl - line, 0);
+    line = nl + 1;
+  }
+  editorInsertRow(E.curr_y, (char*) line, end - line, 0);
+  E.curr_x = end - line;
+  if(taillen) editorRowAppendString(editorRowAt(E.curr_y), tail, taillen);
+  free(tail);
+
+  editorMatchClosingCallback();
+}
+
+int getLeadingSpaces(int at) {
+  // the indentation of a row, which new lines after it start with
+  // rows in safe mode may be megabytes of spaces, so they aren't indented
+  if(at < 0 || at >= E.numrows || E.safe) return 0;
+  
+  // tabs count as the spaces they render to
+  E_ROW* row = editorRenderRow(at);
+  int cx = 0;
+  while(cx < row->size && (row->chars[cx] == ' ' || row->chars[cx] == '\t')) cx++;
+  return editorRowCxtoRx(row, cx);
+}
+
+void editorInsertNewLine() {
+  int leading_spaces = getLeadingSpaces(E.curr_y);
+
+  if(E.curr_x == 0) {
+    // insert an empty line at curr_y
+    editorInsertRow(E.curr_y, "", 0, leading_spaces);
+  } else {
+    // split line at curr_x
+    E_ROW* row = editorRowAt(E.curr_y);
+    // create a new row after the current one, with the characters to the right of the cursor
+    editorInsertRow(E.curr_y + 1, &row->chars[E.curr_x], row->size - E.curr_x, leading_spaces);
+    row = editorRowAt(E.curr_y);
+    editorRowDelChars(row, E.curr_x, row->size - E.curr_x); // truncate the current line
+  }
+  E.curr_y++;
+  E.curr_x = leading_spaces;
+  
+  editorMatchClosingCallback();
+}
+
+void editorDelChar() {
+  if(E.curr_y == E.numrows) return; // cursor is past the EOF, nothing to delete
+  if(E.curr_y == 0 && E.curr_x == 0) return; // cursor is at the beginning of the first line, nothing to do  
+
+  E_ROW* row = editorRowAt(E.curr_y);
+  if(E.curr_x > 0) { // there is a character to the left of the cursor
+    editorRowDelChar(row, E.curr_x - 1);
+    E.curr_x--;
+  } else { // beginning of a line
+    E.curr_x = editorRowAt(E.curr_y - 1)->size; // point cursor to the end of the previous line
+    editorRowAppendString(editorRowAt(E.curr_y - 1), row->chars, row->size);
+    editorDelRow(E.curr_y);
+    E.curr_y--;
+  }
+  editorMatchClosingCallback();
+}
+
+void editorUndoApply(UNDO_RECORD* rec, int undo) {
+  // make a change of the journal again, or the opposite change to undo it
+  const char* s = (const char*)(rec + 1);
+  int type = undo ? rec->type ^ 1 : rec->type;
+  switch(type) {
+    case UNDO_INSERT_CHARS: editorRowInsertString(editorRowAt(rec->y), rec->x, s, rec->len); break;
+    case UNDO_DELETE_CHARS: editorRowDelChars(editorRowAt(rec->y), rec->x, rec->len); break;
+    case UNDO_INSERT_ROW: editorInsertRow(rec->y, (char*) s, rec->len, 0); break;
+    case UNDO_DELETE_ROW: editorDelRow(rec->y); break;
+  }
+}
+
+void editorUndo() {
+  // undo the changes of the last step, from the last one to the first
+  E_UNDO* u = &E.undo;
+  if(u->last < 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  u->paused = 1;
+  long off = u->last;
+  UNDO_RECORD* rec;
+  while(1) {
+    rec = (UNDO_RECORD*)(u->buf + off);
+    editorUndoApply(rec, 1);
+    if(rec->step) break;
+    off -= rec->prev;
+  }
+  u->pos = off;
+  u->last = rec->prev ? off - rec->prev : -1;
+  u->paused = 0;
+  if(u->pos == u->saved) E.dirty = 0; // back to the file as it was saved
+
+  E.curr_y = rec->cy;
+  E.curr_x = rec->cx;
+  editorMatchClosingCallback();
+}
+
+void editorRedo() {
+  // make the changes of the next step that was undone again
+  E_UNDO* u = &E.undo;
+  if(u->pos == u->len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  u->paused = 1;
+  UNDO_RECORD* head = (UNDO_RECORD*)(u->buf + u->pos);
+  do {
+    UNDO_RECORD* rec = (UNDO_RECORD*)(u->buf + u->pos);
+    editorUndoApply(rec, 0);
+    u->last = u->pos;
+    u->pos += rec->size;
+  } while(u->pos < u->len && !((UNDO_RECORD*)(u->buf + u->pos))->step);
+  u->paused = 0;
+  if(u->pos == u->saved) E.dirty = 0;
+
+  E.curr_y = head->ay;
+  E.curr_x = head->ax;
+  editorMatchClosingCallback();
+}
+
+// the line index of a big file is written to the cache directory when the file is closed,
+// so that opening the file again appends its rows without looking for the newlines.
+// an index file has this header, then the real path of the file, the size of each row,
+// and a byte for each row: bit 0 is the comment state at the end of the row,
+// the other bits count the carriage returns before the newline that ends it
+typedef struct cacheHeader {
+  char magic[8];             // CACHE_MAGIC
+  long long size;            // of the file
+  long long mtime_sec, mtime_nsec;
+  unsigned long long hash;   // of the blocks of the file sampled by editorCacheHashFile
+  unsigned long long syntax; // of the syntax that found the comment states, see editorCacheHashSyntax
+  int nrows;
+  int known;                 // rows at the start whose comment state is known
+  int cy, cx, rowoff, coloff;
+  int pathlen;
+} CACHE_HEADER;
+
+#define CACHE_MAGIC "SHIMIDX1"
+#define CACHE_MAX_CR 127 // carriage returns at the end of a row that its byte can count
+#define CACHE_BLOCK 512  // bytes of each block sampled from a file
+#define CACHE_HASH_INIT 14695981039346656037ull
+
+unsigned long long cacheHash(unsigned long long h, const void* p, size_t len) {
+  const unsigned char* s = p;
+  for(size_t i = 0; i < len; i++) {
+    h ^= s[i];
+    h *= 1099511628211ull; // FNV-1a
+  }
+  return h;
+}
+
+unsigned long long cacheHashString(unsigned long long h, const char* s) {
+  // the null is hashed too, so that the strings that follow each other stay apart
+  if(!s) return cacheHash(h, "\xff", 1);
+  return cacheHash(h, s, strlen(s) + 1);
+}
+
+unsigned long long editorCacheHashFile(const char* map, size_t size) {
+  // hashing the whole file would read it as much as looking for the newlines does,
+  // so only evenly spaced blocks and the last one are hashed, the size and the
+  // modification time of the file catch most of the other changes
+  unsigned long long h = CACHE_HASH_INIT;
+  for(int j = 0; j <= SHIM_CACHE_SAMPLES; j++) {
+    size_t at = size / SHIM_CACHE_SAMPLES * j;
+    if(j == SHIM_CACHE_SAMPLES) at = size > CACHE_BLOCK ? size - CACHE_BLOCK : 0;
+    size_t len = size - at < CACHE_BLOCK ? size - at : CACHE_BLOCK;
+    h = cacheHash(h, map + at, len);
+  }
+  return h;
+}
+
+unsigned long long editorCacheHashSyntax(editorSyntax* s) {
+  // the comment states are only valid for the syntax that found them, and a syntax file
+  // may have changed since, so everything the lexer is compiled from is hashed
+  unsigned long long h = CACHE_HASH_INIT;
+  h = cacheHashString(h, s->filetype);
+  for(char** k = s->keywords; k && *k; k++) h = cacheHashString(h, *k);
+  h = cacheHashString(h, NULL);
+  for(char** k = s->specials; k && *k; k++) h = cacheHashString(h, *k);
+  h = cacheHashString(h, NULL);
+  h = cacheHash(h, &s->special_start, 1);
+  h = cacheHashString(h, s->singleline_comment_start);
+  h = cacheHashString(h, s->multiline_comment_start);
+  h = cacheHashString(h, s->multiline_comment_end);
+  h = cacheHash(h, &s->flags, sizeof(s->flags));
+  h = cacheHashString(h, s->separators);
+  return h;
+}
+
+char* editorCachePath(const char* filename, char** real, int create) {
+  // the index of a file is in $SHIM_CACHE_DIR, $XDG_CACHE_HOME/shim or ~/.cache/shim,
+  // named after the hash of its real path. returns NULL if there's no cache directory,
+  // otherwise the path of the index, with the real path of the file in *real
+  char dir[PATH_MAX];
+  const char* env = getenv("SHIM_CACHE_DIR");
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if(env) snprintf(dir, sizeof(dir), "%s", env);
+  else if(xdg && xdg[0]) snprintf(dir, sizeof(dir), "%s/shim", xdg);
+  else if(home) snprintf(dir, sizeof(dir), "%s/.cache/shim", home);
+  else return NULL;
+
+  if(create) {
+    // make the directories that don't exist yet, only the owner can read the indexes
+    for(char* p = dir + 1; *p; p++) {
+      if(*p != '/') continue;
+      *p = '\0';
+      mkdir(dir, 0700);
+      *p = '/';
+    }
+    if(mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+  }
+
+  *real = realpath(filename, NULL);
+  if(!*real) return NULL;
+  size_t size = strlen(dir) + 32;
+  char* path = malloc(size);
+  if(!path) die("editorCachePath");
+  snprintf(path, size, "%s/%016llx.idx", dir, cacheHash(CACHE_HASH_INIT, *real, strlen(*real)));
+  return path;
+}
+
+int editorCacheLoad(const struct stat* st, int* longest) {
+  // append the rows of the mapped file from its index, if the index was made for this version
+  // of the file, along with the comment states and the cursor
+  // returns -1 if there's no such index, then the file must be scanned for the newlines
+  if(st->st_size < SHIM_CACHE_MIN) return -1;
+  char* real;
+  char* path = editorCachePath(E.filename, &real, 0);
+  if(!path) return -1;
+  FILE* fp = fopen(path, "r");
+  free(path);
+  if(!fp) {
+    free(real);
+    return -1;
+  }
+
+  CACHE_HEADER h;
+  int pathlen = strlen(real);
+  char* name = NULL;
+  unsigned int* sizes = NULL;
+  unsigned char* info = NULL;
+  int ok = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, CACHE_MAGIC, 8) &&
+           h.size == st->st_size && h.mtime_sec == st->st_mtim.tv_sec &&
+           h.mtime_nsec == st->st_mtim.tv_nsec && h.nrows > 0 && (size_t) h.nrows <= E.mapsize &&
+           h.known >= 0 && h.known <= h.nrows && h.pathlen == pathlen;
+  if(ok) {
+    // the hash of the path may be the same for another file
+    name = malloc(pathlen);
+    sizes = malloc((size_t) h.nrows * (sizeof(unsigned int) + 1));
+    if(!name || !sizes) die("editorCacheLoad");
+    info = (unsigned char*) (sizes + h.nrows);
+    ok = fread(name, pathlen, 1, fp) == 1 && !memcmp(name, real, pathlen) &&
+         fread(sizes, sizeof(unsigned int), h.nrows, fp) == (size_t) h.nrows &&
+         fread(info, 1, h.nrows, fp) == (size_t) h.nrows &&
+         h.hash == editorCacheHashFile(E.map, E.mapsize);
+  }
+  fclose(fp);
+  free(real);
+  free(name);
+
+  // the rows must all be inside the mapping before any is appended
+  size_t off = 0;
+  for(int j = 0; ok && j < h.nrows; j++) {
+    if(sizes[j] > INT_MAX || sizes[j] > E.mapsize - off) ok = 0;
+    off += sizes[j] + 1 + (info[j] >> 1);
+    if(j + 1 < h.nrows && off > E.mapsize) ok = 0;
+  }
+  if(!ok) {
+    free(sizes);
+    return -1;
+  }
+
+  // the rows whose comment state is known don't have to be highlighted in the background
+  int known = (E.syntax && h.syntax == editorCacheHashSyntax(E.syntax)) ? h.known : 0;
+  off = 0;
+  for(int j = 0; j < h.nrows; j++) {
+    editorAppendMappedRow(E.map + off, sizes[j]);
+    if((int) sizes[j] > *longest) *longest = sizes[j];
+    off += sizes[j] + 1 + (info[j] >> 1);
+    if(j >= known) continue;
+    E_ROW* row = editorRowAt(j);
+    row->hl_open_comment = info[j] & 1;
+    if(row->flags & ROW_HL_STALE) E.hl_stale--;
+    row->flags &= ~ROW_HL_STALE;
+  }
+  if(E.hl_stale_from < known) E.hl_stale_from = known;
+  free(sizes);
+
+  if(h.cy >= 0 && h.cy < E.numrows && h.cx >= 0 && h.cx <= editorRowAt(h.cy)->size) {
+    E.curr_y = h.cy;
+    E.curr_x = h.cx;
+  }
+  if(h.rowoff >= 0 && h.rowoff <= E.curr_y && h.coloff >= 0) {
+    E.rowoff = h.rowoff;
+    E.coloff = h.coloff;
+  }
+  return 0;
+}
+
+void editorCacheSave() {
+  // write the index of the file of the buffer in E, if the rows are still the lines
+  // of the file as it was mapped
+  if(!E.map || E.dirty || E.mapsize < SHIM_CACHE_MIN || E.numrows == 0 || E.load.offset < E.mapsize) return;
+  struct stat st;
+  if(stat(E.filename, &st) == -1 || st.st_size != (off_t) E.mapsize ||
+     st.st_mtim.tv_sec != E.map_mtime.tv_sec || st.st_mtim.tv_nsec != E.map_mtime.tv_nsec) return;
+
+  unsigned int* sizes = malloc((size_t) E.numrows * (sizeof(unsigned int) + 1));
+  if(!sizes) die("editorCacheSave");
+  unsigned char* info = (unsigned char*) (sizes + E.numrows);
+  int known = E.syntax ? -1 : 0;
+  const char* end = E.map; // end of the previous row
+  int ok = 1;
+  for(int j = 0; ok && j < E.numrows; j++) {
+    E_ROW* row = rowTreeRow(j); // a compressed row isn't in the mapping, it isn't uncompressed to tell
+    if(!(row->flags & ROW_MAPPED)) {
+      ok = 0;
+      break;
+    }
+    long gap = row->chars - end; // the newline and the carriage returns before it
+    if(j == 0 ? gap != 0 : gap < 1 || gap > CACHE_MAX_CR + 1) {
+      ok = 0;
+      break;
+    }
+    if(j > 0) info[j - 1] |= (gap - 1) << 1;
+    if(known < 0 && (row->flags & ROW_HL_STALE)) known = j;
+    info[j] = (known < 0) ? row->hl_open_comment : 0;
+    sizes[j] = row->size;
+    end = row->chars + row->size;
+  }
+  if(known < 0) known = E.numrows;
+
+  char* real;
+  char* path = ok ? editorCachePath(E.filename, &real, 1) : NULL;
+  if(!path) {
+    free(sizes);
+    return;
+  }
+  CACHE_HEADER h;
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.size = E.mapsize;
+  h.mtime_sec = E.map_mtime.tv_sec;
+  h.mtime_nsec = E.map_mtime.tv_nsec;
+  h.hash = editorCacheHashFile(E.map, E.mapsize);
+  h.syntax = E.syntax ? editorCacheHashSyntax(E.syntax) : 0;
+  h.nrows = E.numrows;
+  h.known = known;
+  h.cy = E.curr_y;
+  h.cx = E.curr_x;
+  h.rowoff = E.rowoff;
+  h.coloff = E.coloff;
+  h.pathlen = strlen(real);
+
+  // the index is written next to the old one and renamed over it,
+  // so that another editor never reads half of it
+  size_t len = strlen(path) + 8;
+  char* tmpname = malloc(len);
+  if(!tmpname) die("editorCacheSave");
+  snprintf(tmpname, len, "%s.XXXXXX", path);
+  int fd = mkstemp(tmpname);
+  FILE* fp = (fd == -1) ? NULL : fdopen(fd, "w");
+  if(fp) {
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(real, h.pathlen, 1, fp) == 1 &&
+         fwrite(sizes, sizeof(unsigned int), E.numrows, fp) == (size_t) E.numrows &&
+         fwrite(info, 1, E.numrows, fp) == (size_t) E.numrows;
+    if(fclose(fp) != 0) ok = 0;
+    if(!ok || rename(tmpname, path) == -1) unlink(tmpname);
+  } else if(fd != -1) {
+    close(fd);
+    unlink(tmpname);
+  }
+  free(tmpname);
+  free(path);
+  free(real);
+  free(sizes);
+}
+
+// a chunk of a mapped file split into rows by a worker, the rows are appended on the main thread
+typedef struct loadJob {
+  EDITOR_JOB job;
+  const char* from;   // start of the chunk, where a row starts
+  const char* end;    // end of the file
+  size_t* nl;         // offsets of the newlines of the chunk from its start
+  int n, cap;
+  int last;           // the chunk goes up to the end of the file
+  int cancel;         // set when the buffer is closed, the rest of the chunk isn't split then
+} LOAD_JOB;
+
+void editorLoadAppend(const char* p, const char* nl) {
+  // append the row of the mapped file that starts at p and ends at the newline nl
+  int linelen = nl - p;
+  // strip off the carriage returns at the end of the line
+  while(linelen > 0 && p[linelen - 1] == '\r') linelen--;
+  editorAppendMappedRow((char*) p, linelen);
+  if(linelen > E.load.longest) E.load.longest = linelen;
+}
+
+void editorLoadJobRun(EDITOR_JOB* job) {
+  // find the newlines of about SHIM_LOAD_CHUNK bytes, the chunk ends with a whole row
+  LOAD_JOB* lj = (LOAD_JOB*) job;
+  const char* p = lj->from;
+  while(p - lj->from < SHIM_LOAD_CHUNK) {
+    const char* nl = memchr(p, '\n', lj->end - p);
+    if(!nl) {
+      lj->last = 1;
+      break;
+    }
+    if(lj->n == lj->cap) {
+      lj->cap = lj->cap ? lj->cap * 2 : 4096;
+      lj->nl = realloc(lj->nl, sizeof(size_t) * lj->cap);
+      if(!lj->nl) die("editorLoadJobRun");
+    }
+    lj->nl[lj->n++] = nl - lj->from;
+    p = nl + 1;
+    if(p == lj->end) lj->last = 1;
+    if(lj->last || ((lj->n & 1023) == 0 && __atomic_load_n(&lj->cancel, __ATOMIC_RELAXED))) break;
+  }
+}
+
+void editorLoadSubmit();
+
+void editorLoadJobDone(EDITOR_JOB* job) {
+  LOAD_JOB* lj = (LOAD_JOB*) job;
+  E.load.job = NULL;
+
+  if(!lj->cancel) {
+    // the cursor of a followed file stays on the last row
+    int at_end = (E.follow.fd != -1 && E.curr_y >= E.numrows - 1);
+    editorNoteEdit(E.numrows);
+    const char* p = lj->from;
+    for(int i = 0; i < lj->n; i++) {
+      editorLoadAppend(p, lj->from + lj->nl[i]);
+      p = lj->from + lj->nl[i] + 1;
+    }
+    // a file that doesn't end with a newline ends with a row without it
+    if(lj->last && p < lj->end) {
+      editorLoadAppend(p, lj->end);
+      p = lj->end;
+    }
+    E.load.offset = p - E.map;
+    editorUpdateRowOffset();
+    if(at_end) E.curr_y = E.numrows - 1;
+    editorSafeCheck(-1, E.load.longest);
+    if(E.load.offset < E.mapsize) editorLoadSubmit();
+    else editorSetStatusMessage("Loaded %d lines in %.0f ms%s", E.numrows, editorElapsedMs(&E.load.start),
+      E.safe ? ", in safe mode, Ctrl-E turns highlighting on" : "");
+    if(E.search.re) editorSearchStartJob(); // count the matches on the new rows too
+  }
+  free(lj->nl);
+  free(lj);
+}
+
+void editorLoadSubmit() {
+  // split the next chunk of the mapped file on a worker
+  LOAD_JOB* lj = calloc(1, sizeof(LOAD_JOB));
+  if(!lj) die("editorLoadSubmit");
+  lj->job.run = editorLoadJobRun;
+  lj->job.done = editorLoadJobDone;
+  lj->job.snap = NULL; // the mapping doesn't change, the rows aren't read
+  lj->from = E.map + E.load.offset;
+  lj->end = E.map + E.mapsize;
+  E.load.job = lj;
+  editorJobSubmit(&lj->job);
+}
+
+void editorLoadWait() {
+  // block until the whole file is loaded, or until the job that was cancelled returns
+  while(E.load.job) {
+    struct pollfd pfd = {W.pipe[0], POLLIN, 0};
+    if(poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+    editorJobsFinish();
+  }
+}
+
+void editorLoadCancel() {
+  // stop loading the file, the rows that are loaded already stay
+  if(!E.load.job) return;
+  __atomic_store_n(&E.load.job->cancel, 1, __ATOMIC_RELAXED);
+  editorLoadWait();
+}
+
+int editorOpenMapped(const char* filename, int* longest) {
+  // map the file in memory and build only the rows that point into it
+  // returns -1 if the file can't be mapped, e.g. it is empty or isn't a regular file
+  // sets longest to the length of the longest row
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1) return -1;
+
+  struct stat st;
+  if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd); return -1;
+  }
+  char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping stays valid after closing the file
+  if(map == MAP_FAILED) return -1;
+
+  E.map = map;
+  E.mapsize = st.st_size;
+  E.map_mtime = st.st_mtim;
+  E.follow.offset = st.st_size;
+  E.follow.open_line = (map[st.st_size - 1] != '\n');
+
+  // the rows may be in the cache directory already, from the last time the file was open
+  E.load.offset = st.st_size;
+  if(editorCacheLoad(&st, longest) == -1) {
+    // the rows of the first screens are there for the first frame, a worker finds the others
+    clock_gettime(CLOCK_MONOTONIC, &E.load.start);
+    char* p = map;
+    char* end = map + st.st_size;
+    char* first = map + (st.st_size < SHIM_LOAD_FIRST ? st.st_size : SHIM_LOAD_FIRST);
+    while(p < first) {
+      // memchr scans many bytes at once with vector instructions
+      char* nl = memchr(p, '\n', end - p);
+      if(!nl) nl = end;
+      editorLoadAppend(p, nl);
+      p = nl + 1;
+    }
+    if(p < end) {
+      E.load.offset = p - map;
+      editorLoadSubmit();
+    }
+    *longest = E.load.longest;
+  }
+  editorUpdateRowOffset();
+  E.dirty = 0;
+  return 0;
+}
+
+void editorOpen(const char* filename) {
+  free(E.filename);
+  E.filename = strdup(filename); // makes a copy of the string
+
+  // a file too big to highlight isn't, the rows are checked once they're loaded
+  struct stat st;
+  if(stat(filename, &st) == 0) editorSafeCheck(st.st_size, 0);
+  editorSelectSyntaxHighlight();
+
+  int longest = 0;
+  if(editorOpenMapped(filename, &longest) == 0) {
+    editorSafeCheck(-1, longest);
+    return;
+  }
+
+  FILE* fp = fopen(filename, "r");
+  if(!fp) die("fopen");
+  
+  char* line = NULL;
+  size_t linecapacity = 0;
+  int linelen;
+  E.undo.paused = 1; // loading the file isn't a change that can be undone
+
+  // getline allocates new memory for the next line it reads
+  // it sets line to point to the memory allocated 
+  // and sets linecapacity to how much memory it allocated
+  while((linelen = getline(&line, &linecapacity, fp)) != -1) { // isn't EOF
+    E.follow.offset += linelen;
+    E.follow.open_line = (line[linelen - 1] != '\n');
+    // strip off the newline or carriage return at the end of the line
+    while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+      linelen--;
+    }
+    editorInsertRow(E.numrows, line, linelen, 0);
+    if(linelen > longest) longest = linelen;
+  }
+  editorUpdateRowOffset();
+  editorSafeCheck(-1, longest);
+  free(line); fclose(fp);
+  E.undo.paused = 0;
+  E.dirty = 0;
+}
+
+void editorFollowStop(const char* why) {
+  close(E.follow.fd);
+  close(E.follow.notify);
+  E.follow.fd = E.follow.notify = -1;
+  E.follow.pending = 0;
+  editorSetStatusMessage("Stopped following the file, %s", why);
+}
+
+void editorFollowStart() {
+  // watch the open file for lines written at its end
+  E.follow.fd = open(E.filename, O_RDONLY);
+  if(E.follow.fd == -1) {
+    editorSetStatusMessage("Can't follow the file: %s", strerror(errno));
+    return;
+  }
+  E.follow.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(E.follow.notify == -1 ||
+     inotify_add_watch(E.follow.notify, E.filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+    editorSetStatusMessage("Can't follow the file: %s", strerror(errno));
+    if(E.follow.notify != -1) close(E.follow.notify);
+    close(E.follow.fd);
+    E.follow.fd = E.follow.notify = -1;
+    return;
+  }
+  if(!E.follow.buf) {
+    E.follow.buf = malloc(SHIM_FOLLOW_READ);
+    if(!E.follow.buf) die("editorFollowStart");
+  }
+  // the file may have grown since it was loaded
+  E.follow.pending = 1;
+}
+
+void editorFollowRestart(long long offset) {
+  // a save replaced the followed file with a new one, which is followed from offset on
+  // the old watch is dropped along with the writes of the save itself
+  close(E.follow.fd);
+  close(E.follow.notify);
+  E.follow.fd = E.follow.notify = -1;
+  editorFollowStart();
+  E.follow.offset = offset;
+  E.follow.open_line = 0; // the rows are saved with a newline after each one
+}
+
+void editorFollowEvents() {
+  // read what happened to the followed file, the new bytes are read by editorFollowRead
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } events;
+  ssize_t n;
+  while((n = read(E.follow.notify, events.buf, sizeof(events.buf))) > 0) {
+    for(char* p = events.buf; p < events.buf + n; ) {
+      struct inotify_event* ev = (struct inotify_event*) p;
+      if(ev->mask & IN_MODIFY) E.follow.pending = 1;
+      if(ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+        editorFollowStop("it was moved or deleted");
+        return;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+void editorFollowAppend(E_ROW* row, const char* s, int len) {
+  // append a line read from the followed file to the row, or as a new row when row is NULL
+  // the rows that aren't on the screen are left to be rendered and highlighted when they're needed
+  if(row && row->render) {
+    editorRowAppendString(row, (char*) s, len);
+    return;
+  }
+  if(row) {
+    editorRowOwnChars(row);
+    editorRowGrowChars(row, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    rowTreeAddBytes(row, len);
+    row->chars[row->size] = '\0';
+    if(E.syntax) editorMarkRowStale(editorRowIndex(row));
+    return;
+  }
+  editorNoteEdit(E.numrows);
+  int cap;
+  char* chars = rowMemAlloc(len + 1, &cap);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  editorAppendLazyRow(chars, len)->chars_cap = cap;
+}
+
+void editorFollowRead() {
+  // append the lines written to the followed file since the last read, at most
+  // SHIM_FOLLOW_READ bytes of them, rows that are appended are drawn together by a timer
+  struct stat st;
+  if(fstat(E.follow.fd, &st) == 0 && st.st_size < E.follow.offset) {
+    // the rows can't follow a file that was cut, and the mapped ones may not be there anymore
+    editorFollowStop("it was truncated");
+    return;
+  }
+  ssize_t n = pread(E.follow.fd, E.follow.buf, SHIM_FOLLOW_READ, E.follow.offset);
+  if(n <= 0) {
+    E.follow.pending = 0;
+    return;
+  }
+  E.follow.pending = (n == SHIM_FOLLOW_READ);
+  // a carriage return at the end is read again with the newline that may come after it
+  if(E.follow.buf[n - 1] == '\r' && --n == 0) return;
+  E.follow.offset += n;
+
+  // the cursor stays at the end of the file if it's there, so the new lines are shown
+  int at_end = (E.curr_y >= E.numrows - 1);
+  int added = E.numrows;
+  int dirty = E.dirty;
+  E.undo.paused = 1; // the lines are part of the file, not changes to it
+  char* p = E.follow.buf;
+  char* end = p + n;
+  while(p < end) {
+    char* nl = memchr(p, '\n', end - p);
+    int linelen = (nl ? nl : end) - p;
+    if(nl && linelen > 0 && p[linelen - 1] == '\r') linelen--;
+    if(E.follow.open_line && E.numrows > 0) editorFollowAppend(editorRowAt(E.numrows - 1), p, linelen);
+    else editorFollowAppend(NULL, p, linelen);
+    E.follow.open_line = (nl == NULL);
+    p = nl ? nl + 1 : end;
+  }
+  E.undo.paused = 0;
+  E.dirty = dirty;
+  added = E.numrows - added;
+
+  if(at_end && added) {
+    E.curr_y += added;
+    E.curr_x = 0;
+  }
+  if(L.timers[TIMER_FOLLOW].when == 0) editorTimerSet(TIMER_FOLLOW, SHIM_FOLLOW_MS, editorScheduleRedraw);
+}
+
+// the rows of a snapshot written to a file by a worker
+typedef struct saveJob {
+  EDITOR_JOB job;
+  char* filename;
+  unsigned long edits; // E.edits when the save started
+  long long len;       // bytes written
+  double ms;           // how long the save took
+  int err;             // errno if the save failed, or 0
+} SAVE_JOB;
+
+int editorWritevAll(int fd, struct iovec* iov, int iovcnt) {
+  // write all the buffers, a write can stop in the middle of one
+  while(iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    // skip the buffers that were written, and the part of the next one that was
+    while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+int editorWriteRows(int fd, SNAPSHOT* snap, long long* len) {
+  // write the rows of a snapshot straight from where their characters are, without copying them
+  // the rows that follow each other in memory with a newline in between, like the rows of
+  // a mapped file that weren't changed, are written as a single buffer
+  static char newline = '\n';
+  struct iovec iov[SHIM_SAVE_IOV];
+  int cnt = 0;
+  SNAP_READER r = {snap, -1, NULL, 0};
+  int ret = 0;
+
+  for(int j = 0; j < snap->nrows; j++) {
+    SNAP_ROW* row = &snap->rows[j];
+    // the buffers written so far may point into the block that is uncompressed over
+    if(row->block >= 0 && row->block != r.block && cnt) {
+      if((ret = editorWritevAll(fd, iov, cnt)) == -1) break;
+      cnt = 0;
+    }
+    const char* chars = snapRowChars(&r, j);
+    struct iovec* last = cnt ? &iov[cnt - 1] : NULL;
+    if(last && (char*) last->iov_base + last->iov_len == chars) {
+      last->iov_len += row->size;
+    } else if(row->size) {
+      iov[cnt].iov_base = (char*) chars;
+      iov[cnt].iov_len = row->size;
+      last = &iov[cnt++];
+    }
+    // the character after a row can only be read when the next row starts after it
+    SNAP_ROW* next = (j + 1 < snap->nrows) ? &snap->rows[j + 1] : NULL;
+    if(last && next && row->block < 0 && next->block < 0 && next->chars == row->chars + row->size + 1 &&
+       (char*) last->iov_base + last->iov_len == row->chars + row->size && row->chars[row->size] == '\n') {
+      last->iov_len++;
+    } else {
+      iov[cnt].iov_base = &newline;
+      iov[cnt].iov_len = 1;
+      cnt++;
+    }
+    *len += row->size + 1;
+
+    if(cnt >= SHIM_SAVE_IOV - 1) { // a row may need two more buffers
+      if((ret = editorWritevAll(fd, iov, cnt)) == -1) break;
+      cnt = 0;
+    }
+  }
+  if(ret != -1) ret = editorWritevAll(fd, iov, cnt);
+  free(r.buf);
+  return ret;
+}
+
+void editorSaveJobRun(EDITOR_JOB* job) {
+  SAVE_JOB* sj = (SAVE_JOB*) job;
+  SNAPSHOT* snap = job->snap;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sj->len = 0;
+  sj->err = 0;
+
+  // a symbolic link keeps pointing to the file, the file it points to is the one replaced
+  // failures are reported by the done callback, a worker can't exit with the terminal in raw mode
+  char* path = realpath(sj->filename, NULL);
+  if(!path) path = strdup(sj->filename); // a new file
+  if(!path) {
+    sj->err = ENOMEM;
+    return;
+  }
+
+  // write a new file next to the old one and rename it over it at the end, so that the old one
+  // is left whole if the save fails half way, and because the rows of the snapshot can point
+  // into the mapping of the old one
+  size_t namelen = strlen(path);
+  char* tmpname = malloc(namelen + 16);
+  if(!tmpname) {
+    sj->err = ENOMEM;
+    free(path);
+    return;
+  }
+  snprintf(tmpname, namelen + 16, "%s.shim-XXXXXX", path);
+
+  // the new file gets the permissions and the owner of the old one
+  // 0644 gives the owner of a new file the read and write permissions,
+  // and everyone else can only read it
+  struct stat st;
+  int existed = (stat(path, &st) == 0);
+  mode_t mode = existed ? (st.st_mode & 07777) : 0644;
+
+  int fd = mkstemp(tmpname);
+  if(fd == -1) {
+    sj->err = errno;
+    free(tmpname);
+    free(path);
+    return;
+  }
+  // the owner is set first, changing it may clear the setuid and setgid bits
+  // only root can give the file to another user, the group is kept when it can be
+  if(existed && fchown(fd, st.st_uid, st.st_gid) == -1) {
+    if(fchown(fd, -1, st.st_gid) == -1) {} // the file stays with the user saving it
+  }
+  fchmod(fd, mode); // mkstemp creates the file for the owner only
+
+  int failed = (editorWriteRows(fd, snap, &sj->len) == -1);
+  // the data must be on the disk before the rename makes it the file,
+  // or a crash right after it could leave an empty file instead of either version
+  if(!failed && SHIM_SAVE_FSYNC && fsync(fd) == -1) failed = 1;
+  if(failed) sj->err = errno;
+  if(close(fd) == -1 && !failed) {
+    failed = 1;
+    sj->err = errno;
+  }
+  if(!failed && rename(tmpname, path) == -1) {
+    failed = 1;
+    sj->err = errno;
+  }
+  if(failed) unlink(tmpname);
+
+  if(!failed && SHIM_SAVE_FSYNC) {
+    // the rename itself is only durable once the directory is flushed too
+    char* slash = strrchr(path, '/');
+    if(slash) *(slash == path ? slash + 1 : slash) = '\0';
+    int dirfd = open(slash ? path : ".", O_RDONLY | O_DIRECTORY);
+    if(dirfd != -1) {
+      fsync(dirfd); // the file is saved already, some file systems can't flush directories
+      close(dirfd);
+    }
+  }
+  free(tmpname);
+  free(path);
+  sj->ms = editorElapsedMs(&start);
+}
+
+void editorSaveJobDone(EDITOR_JOB* job) {
+  SAVE_JOB* sj = (SAVE_JOB*) job;
+  E.save_jobs--;
+
+  if(sj->err) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(sj->err));
+  } else {
+    // the file is up to date, unless it was edited while it was being written
+    if(sj->edits == E.edits) {
+      E.dirty = 0;
+      // the next change starts another undo step, so that undoing it gets back to the saved file
+      editorUndoStep(UNDO_EDIT);
+      E.undo.saved = E.undo.pos;
+    }
+    if(E.follow.fd != -1 && E.filename && strcmp(E.filename, sj->filename) == 0) editorFollowRestart(sj->len);
+    double rate = sj->ms > 0 ? sj->len / (sj->ms * 1e3) : 0;
+    editorSetStatusMessage("%lld bytes written to disk in %.0f ms (%.1f MB/s)", sj->len, sj->ms, rate);
+  }
+  free(sj->filename);
+  free(sj);
+}
+
+void editorSave() {
+  if(E.filename == NULL) {
+    // prompt the user to input a filename when saving a new file
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if(!E.filename) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  if(E.save_jobs) {
+    editorSetStatusMessage("Still saving, try again when it's done");
+    return;
+  }
+
+  // the file is written by a worker, from a snapshot of the rows
+  SAVE_JOB* sj = malloc(sizeof(SAVE_JOB));
+  if(!sj) die("editorSave");
+  sj->job.run = editorSaveJobRun;
+  sj->job.done = editorSaveJobDone;
+  sj->job.snap = editorSnapshot();
+  sj->filename = strdup(E.filename);
+  if(!sj->filename) die("strdup");
+  sj->edits = E.edits;
+
+  E.save_jobs++;
+  editorJobSubmit(&sj->job);
+  editorSetStatusMessage("Saving...");
+}
+
+char* editorFindBytes(const char* s, int len, const char* query, int qlen) {
+  // returns the first occurrence of query in the len bytes at s, or NULL
+  if(qlen > len) return NULL;
+  if(qlen <= 1) return qlen ? memchr(s, query[0], len) : (char*) s;
+#ifdef __SSE2__
+  // compare the first and the last byte of the query at 16 positions at once,
+  // and check the bytes in between only where both of them match
+  const __m128i first = _mm_set1_epi8(query[0]);
+  const __m128i last = _mm_set1_epi8(query[qlen - 1]);
+  int i;
+  for(i = 0; i + qlen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (s + i + qlen - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while(mask) {
+      int bit = __builtin_ctz(mask);
+      if(!memcmp(s + i + bit + 1, query + 1, qlen - 2)) return (char*) s + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  // the tail is shorter than a vector
+  s += i;
+  len -= i;
+#endif
+  return memmem(s, len, query, qlen);
+}
+
+// the search query is a regular expression, made of literal characters, '.', [classes],
+// the escapes \d \w \s (\D \W \S for their complements), (groups), alternatives with |,
+// and the repetitions * + ?, a ^ at its start or a $ at its end anchors it to the line
+// it's compiled to an NFA which is turned into a DFA lazily, a state at a time as the text
+// needs it, so a search reads each byte a bounded number of times and never backtracks
+
+enum regexNodeType { RX_CLASS, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST };
+
+// a node of the parsed pattern
+typedef struct regexNode {
+  int type;
+  int a, b; // children, for RX_CLASS a is the index of the byte set
+} REGEX_NODE;
+
+enum regexNfaType { RN_CLASS, RN_SPLIT, RN_MATCH };
+
+// a state of the NFA, class states move on the bytes of their set, split states to both outs
+typedef struct regexNfa {
+  int type;
+  int cls; // index of the byte set
+  int out, out1;
+} REGEX_NFA;
+
+// a state of the DFA, the NFA states the text may be in, grouped by where their match
+// would start, earliest first, an NFA state is only kept in the earliest group it's in
+typedef struct regexState {
+  int* nfa;   // class and match states, sorted within each group, -1 ends a group
+  int n;
+  int inject; // if a match may still start after each byte
+  int accept; // if a group holds the match state
+  int special; // if the searches have to look at it, rather than just follow its transitions
+  int cut;    // this state without the groups after the first match and new ones, -1 if not known yet
+} REGEX_STATE;
+
+typedef struct regexDfa {
+  REGEX_NFA* nfa;
+  int nnfa, start; // start is the first NFA state
+  int* start_set; // the NFA states at the start
+  int start_n;
+  REGEX_STATE* states;
+  int nstates, cap;
+  // the state after each byte class of each state, its index times the number of classes,
+  // or -2 minus that if it's special, and -1 if it isn't known yet
+  int* trans;
+  int* slots; // hash table of the states, their index plus one
+  unsigned int mask;
+  long bytes;         // memory used by the states, they are all dropped past SHIM_REGEX_CACHE
+  unsigned long flushes; // times they were dropped
+  int start_line;     // state at the start of a line, -1 if not known yet
+  int start_mid;      // state in the middle of a line
+  int* stack;         // to follow the split states
+  int* set;           // the set being built
+  unsigned int* mark; // NFA states already in the set
+  unsigned int stamp;
+} REGEX_DFA;
+
+typedef struct regex {
+  unsigned char (*sets)[32]; // byte sets of the class nodes
+  int nsets;
+  unsigned char byteclass[256]; // bytes that no set tells apart share a class
+  int nclasses;
+  int bol, eol;      // anchored with ^ or $
+  char* literal;     // the whole pattern if it's a plain string, matched without a DFA
+  char* prefix;      // bytes every match starts with, to skip to the places a match may start
+  int literal_len, prefix_len;
+  REGEX_DFA fwd, rev; // the pattern, and the pattern reversed to find where a match starts
+} REGEX;
+
+typedef struct regexParser {
+  const char* p;
+  REGEX* re;
+  REGEX_NODE* nodes;
+  int n, cap;
+  int depth; // groups open
+  const char* error;
+} REGEX_PARSER;
+
+int regexNode(REGEX_PARSER* ps, int type, int a, int b) {
+  if(ps->n == ps->cap) {
+    ps->cap = ps->cap ? ps->cap * 2 : 64;
+    ps->nodes = realloc(ps->nodes, sizeof(REGEX_NODE) * ps->cap);
+    if(!ps->nodes) die("realloc");
+  }
+  ps->nodes[ps->n].type = type;
+  ps->nodes[ps->n].a = a;
+  ps->nodes[ps->n].b = b;
+  return ps->n++;
+}
+
+unsigned char* regexSet(REGEX_PARSER* ps, int* node) {
+  // adds an empty byte set and a class node for it
+  REGEX* re = ps->re;
+  if((re->nsets & (re->nsets - 1)) == 0) {
+    re->sets = realloc(re->sets, 32 * (re->nsets ? re->nsets * 2 : 1));
+    if(!re->sets) die("realloc");
+  }
+  memset(re->sets[re->nsets], 0, 32);
+  *node = regexNode(ps, RX_CLASS, re->nsets, 0);
+  return re->sets[re->nsets++];
+}
+
+#define RX_ADD(set, c) ((set)[(unsigned char) (c) >> 3] |= 1 << ((unsigned char) (c) & 7))
+#define RX_HAS(set, c) ((set)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+void regexAddRange(unsigned char* set, int lo, int hi) {
+  for(int c = lo; c <= hi; c++) RX_ADD(set, c);
+}
+
+int regexAddEscape(unsigned char* set, char c) {
+  // adds the bytes of the escape \c, returns 0 if c isn't a class escape
+  unsigned char tmp[32] = {0};
+  switch(tolower(c)) {
+    case 'd': regexAddRange(tmp, '0', '9'); break;
+    case 'w': regexAddRange(tmp, '0', '9'); regexAddRange(tmp, 'a', 'z');
+              regexAddRange(tmp, 'A', 'Z'); RX_ADD(tmp, '_'); break;
+    case 's': RX_ADD(tmp, ' '); RX_ADD(tmp, '\t'); RX_ADD(tmp, '\r'); RX_ADD(tmp, '\f'); RX_ADD(tmp, '\v'); break;
+    default: return 0;
+  }
+  for(int i = 0; i < 32; i++) set[i] |= isupper(c) ? ~tmp[i] : tmp[i];
+  return 1;
+}
+
+char regexEscapeChar(char c) {
+  return c == 't' ? '\t' : c == 'r' ? '\r' : c == 'f' ? '\f' : c == 'v' ? '\v' : c;
+}
+
+int regexParseClass(REGEX_PARSER* ps) {
+  // parses a [class] after its '['
+  int node;
+  unsigned char* set = regexSet(ps, &node);
+  int negate = (*ps->p == '^');
+  if(negate) ps->p++;
+  int first = 1;
+  while(*ps->p && (*ps->p != ']' || first)) {
+    first = 0;
+    int lo = (unsigned char) *ps->p++;
+    if(lo == '\\' && *ps->p) {
+      if(regexAddEscape(set, *ps->p)) {
+        ps->p++;
+        continue;
+      }
+      lo = (unsigned char) regexEscapeChar(*ps->p++);
+    }
+    int hi = lo;
+    if(ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      ps->p++;
+      hi = (unsigned char) *ps->p++;
+      if(hi == '\\' && *ps->p) hi = (unsigned char) regexEscapeChar(*ps->p++);
+      if(hi < lo) {
+        ps->error = "bad range";
+        return -1;
+      }
+    }
+    regexAddRange(set, lo, hi);
+  }
+  if(*ps->p != ']') {
+    ps->error = "unmatched [";
+    return -1;
+  }
+  ps->p++;
+  if(negate) for(int i = 0; i < 32; i++) set[i] = ~set[i];
+  return node;
+}
 
-  E.row[at].idx = at;
+int regexParseAlt(REGEX_PARSER* ps);
+
+int regexParseAtom(REGEX_PARSER* ps) {
+  int node;
+  char c = *ps->p++;
+  if(c == '(') {
+    ps->depth++;
+    node = regexParseAlt(ps);
+    ps->depth--;
+    if(node < 0) return -1;
+    if(*ps->p != ')') {
+      ps->error = "unmatched (";
+      return -1;
+    }
+    ps->p++;
+    return node;
+  }
+  if(c == '[') return regexParseClass(ps);
+  unsigned char* set = regexSet(ps, &node);
+  if(c == '.') {
+    memset(set, 0xff, 32);
+  } else if(c == '\\' && *ps->p) {
+    c = *ps->p++;
+    if(!regexAddEscape(set, c)) RX_ADD(set, regexEscapeChar(c));
+  } else {
+    RX_ADD(set, c);
+  }
+  return node;
+}
+
+int regexParseRepeat(REGEX_PARSER* ps) {
+  if(*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+    ps->error = "nothing to repeat";
+    return -1;
+  }
+  int node = regexParseAtom(ps);
+  while(node >= 0 && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+    char c = *ps->p++;
+    node = regexNode(ps, c == '*' ? RX_STAR : c == '+' ? RX_PLUS : RX_QUEST, node, 0);
+  }
+  return node;
+}
+
+int regexParseCat(REGEX_PARSER* ps) {
+  int node = -1;
+  while(*ps->p && *ps->p != '|' && *ps->p != ')') {
+    // a $ at the end of the pattern anchors it, anywhere else it's a literal
+    if(*ps->p == '$' && ps->p[1] == '\0') {
+      ps->re->eol = 1;
+      ps->p++;
+      break;
+    }
+    int next = regexParseRepeat(ps);
+    if(next < 0) return -1;
+    node = node < 0 ? next : regexNode(ps, RX_CAT, node, next);
+  }
+  if(node < 0 && !ps->error) ps->error = (ps->depth && !*ps->p) ? "unmatched (" : "matches an empty string";
+  return node;
+}
+
+int regexParseAlt(REGEX_PARSER* ps) {
+  int node = regexParseCat(ps);
+  while(node >= 0 && *ps->p == '|') {
+    ps->p++;
+    int next = regexParseCat(ps);
+    if(next < 0) return -1;
+    node = regexNode(ps, RX_ALT, node, next);
+  }
+  return node;
+}
+
+int regexNullable(REGEX_NODE* nodes, int node) {
+  // tells if the node matches an empty string
+  REGEX_NODE* nd = &nodes[node];
+  switch(nd->type) {
+    case RX_CLASS: return 0;
+    case RX_CAT: return regexNullable(nodes, nd->a) && regexNullable(nodes, nd->b);
+    case RX_ALT: return regexNullable(nodes, nd->a) || regexNullable(nodes, nd->b);
+    case RX_PLUS: return regexNullable(nodes, nd->a);
+    default: return 1;
+  }
+}
+
+int regexSingleByte(REGEX* re, int set) {
+  // returns the only byte of a set, or -1
+  int found = -1;
+  for(int c = 0; c < 256; c++) {
+    if(!RX_HAS(re->sets[set], c)) continue;
+    if(found >= 0) return -1;
+    found = c;
+  }
+  return found;
+}
+
+int regexPrefix(REGEX* re, REGEX_NODE* nodes, int node, char* buf, int* len) {
+  // appends the bytes every match of the node starts with, returns 1 if that's all of it
+  REGEX_NODE* nd = &nodes[node];
+  if(nd->type == RX_CLASS) {
+    int c = regexSingleByte(re, nd->a);
+    if(c < 0) return 0;
+    buf[(*len)++] = c;
+    return 1;
+  }
+  if(nd->type == RX_CAT) return regexPrefix(re, nodes, nd->a, buf, len) && regexPrefix(re, nodes, nd->b, buf, len);
+  if(nd->type == RX_PLUS) regexPrefix(re, nodes, nd->a, buf, len);
+  return 0;
+}
+
+int regexNfaAdd(REGEX_DFA* d, int type, int cls, int out, int out1) {
+  REGEX_NFA* s = &d->nfa[d->nnfa];
+  s->type = type;
+  s->cls = cls;
+  s->out = out;
+  s->out1 = out1;
+  return d->nnfa++;
+}
+
+int regexNfaBuild(REGEX_DFA* d, REGEX_NODE* nodes, int node, int out, int reverse) {
+  // adds the states of a node that continue to the state out, returns its first one
+  REGEX_NODE* nd = &nodes[node];
+  int s, first;
+  switch(nd->type) {
+    case RX_CLASS:
+      return regexNfaAdd(d, RN_CLASS, nd->a, out, -1);
+    case RX_CAT:
+      if(reverse) return regexNfaBuild(d, nodes, nd->b, regexNfaBuild(d, nodes, nd->a, out, reverse), reverse);
+      return regexNfaBuild(d, nodes, nd->a, regexNfaBuild(d, nodes, nd->b, out, reverse), reverse);
+    case RX_ALT:
+      first = regexNfaBuild(d, nodes, nd->a, out, reverse);
+      return regexNfaAdd(d, RN_SPLIT, 0, first, regexNfaBuild(d, nodes, nd->b, out, reverse));
+    case RX_STAR:
+      s = regexNfaAdd(d, RN_SPLIT, 0, -1, out);
+      d->nfa[s].out = regexNfaBuild(d, nodes, nd->a, s, reverse);
+      return s;
+    case RX_PLUS:
+      s = regexNfaAdd(d, RN_SPLIT, 0, -1, out);
+      first = regexNfaBuild(d, nodes, nd->a, s, reverse);
+      d->nfa[s].out = first;
+      return first;
+    default:
+      return regexNfaAdd(d, RN_SPLIT, 0, regexNfaBuild(d, nodes, nd->a, out, reverse), out);
+  }
+}
+
+void regexClosure(REGEX_DFA* d, int* n, int s) {
+  // adds the state s to the set being built, following the split states
+  int top = 0;
+  d->stack[top++] = s;
+  while(top) {
+    s = d->stack[--top];
+    if(d->mark[s] == d->stamp) continue;
+    d->mark[s] = d->stamp;
+    if(d->nfa[s].type == RN_SPLIT) {
+      d->stack[top++] = d->nfa[s].out1;
+      d->stack[top++] = d->nfa[s].out;
+    } else {
+      d->set[(*n)++] = s;
+    }
+  }
+}
+
+int regexIntCompare(const void* a, const void* b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+void regexDfaInit(REGEX_DFA* d, REGEX_NODE* nodes, int nnodes, int root, int reverse) {
+  // each node adds at most two NFA states
+  d->nfa = malloc(sizeof(REGEX_NFA) * (2 * nnodes + 1));
+  d->stack = malloc(sizeof(int) * (2 * nnodes + 1));
+  d->set = malloc(sizeof(int) * 2 * (2 * nnodes + 1)); // with the ends of the groups
+  d->mark = calloc(2 * nnodes + 1, sizeof(unsigned int));
+  if(!d->nfa || !d->stack || !d->set || !d->mark) die("regexDfaInit");
+  d->nnfa = 0;
+  int match = regexNfaAdd(d, RN_MATCH, 0, -1, -1);
+  d->start = regexNfaBuild(d, nodes, root, match, reverse);
+  d->stamp = 1;
+  d->start_n = 0;
+  regexClosure(d, &d->start_n, d->start);
+  qsort(d->set, d->start_n, sizeof(int), regexIntCompare);
+  d->start_set = malloc(sizeof(int) * d->start_n);
+  if(!d->start_set) die("regexDfaInit");
+  memcpy(d->start_set, d->set, sizeof(int) * d->start_n);
+  d->states = NULL;
+  d->trans = NULL;
+  d->nstates = d->cap = 0;
+  d->slots = NULL;
+  d->mask = 0;
+  d->bytes = 0;
+  d->start_line = d->start_mid = -1;
+  d->flushes = 0;
+}
+
+void regexDfaFlush(REGEX_DFA* d) {
+  // drops all the states of the DFA, they are built again as they are needed
+  for(int i = 0; i < d->nstates; i++) free(d->states[i].nfa);
+  d->nstates = 0;
+  if(d->slots) memset(d->slots, 0, sizeof(int) * (d->mask + 1));
+  d->bytes = 0;
+  d->start_line = d->start_mid = -1;
+  d->flushes++;
+}
+
+void regexDfaFree(REGEX_DFA* d) {
+  regexDfaFlush(d);
+  free(d->states);
+  free(d->trans);
+  free(d->start_set);
+  free(d->slots);
+  free(d->nfa);
+  free(d->stack);
+  free(d->set);
+  free(d->mark);
+}
+
+void regexGroupEnd(REGEX_DFA* d, int* n, int* begin) {
+  // ends the group of the set being built that starts at begin, if it isn't empty
+  if(*n == *begin) return;
+  qsort(d->set + *begin, *n - *begin, sizeof(int), regexIntCompare);
+  d->set[(*n)++] = -1;
+  *begin = *n;
+}
 
-  E.row[at].size = len + leading_spaces;
-  E.row[at].chars = malloc(len + leading_spaces + 1);
-  memset(E.row[at].chars, ' ', leading_spaces);
-  memcpy(E.row[at].chars + leading_spaces, s, len);
-  E.row[at].chars[len + leading_spaces] = '\0';
+int regexStateFind(REGEX* re, REGEX_DFA* d, int n, int inject) {
+  // returns the DFA state for the n entries in d->set, adding it if it isn't there
+  // the indexes of the states known until now are invalid when the states get dropped
+  if(n && d->set[n - 1] < 0) n--;
+  unsigned int h = 2166136261u ^ inject;
+  for(int i = 0; i < n; i++) h = (h ^ d->set[i]) * 16777619u;
+
+  if(d->mask) {
+    for(unsigned int k = h & d->mask; d->slots[k]; k = (k + 1) & d->mask) {
+      REGEX_STATE* st = &d->states[d->slots[k] - 1];
+      if(st->n == n && st->inject == inject && !memcmp(st->nfa, d->set, sizeof(int) * n))
+        return d->slots[k] - 1;
+    }
+  }
+
+  long size = sizeof(int) * (n + re->nclasses) + sizeof(REGEX_STATE);
+  if(d->bytes + size > SHIM_REGEX_CACHE) regexDfaFlush(d);
+  if(d->nstates == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->states = realloc(d->states, sizeof(REGEX_STATE) * d->cap);
+    d->trans = realloc(d->trans, sizeof(int) * re->nclasses * d->cap);
+    if(!d->states || !d->trans) die("realloc");
+  }
+  if((unsigned int) d->nstates * 2 >= d->mask) {
+    // grow the hash table
+    unsigned int mask = d->mask ? d->mask * 2 + 1 : 63;
+    free(d->slots);
+    d->slots = calloc(mask + 1, sizeof(int));
+    if(!d->slots) die("calloc");
+    d->mask = mask;
+    for(int i = 0; i < d->nstates; i++) {
+      REGEX_STATE* st = &d->states[i];
+      unsigned int g = 2166136261u ^ st->inject;
+      for(int j = 0; j < st->n; j++) g = (g ^ st->nfa[j]) * 16777619u;
+      unsigned int k = g & mask;
+      while(d->slots[k]) k = (k + 1) & mask;
+      d->slots[k] = i + 1;
+    }
+  }
+
+  REGEX_STATE* st = &d->states[d->nstates];
+  st->nfa = malloc(sizeof(int) * (n ? n : 1));
+  if(!st->nfa) die("regexStateFind");
+  memcpy(st->nfa, d->set, sizeof(int) * n);
+  st->n = n;
+  st->inject = inject;
+  st->accept = 0;
+  for(int i = 0; i < n; i++) if(d->set[i] >= 0 && d->nfa[d->set[i]].type == RN_MATCH) st->accept = 1;
+  st->cut = -1;
+  // the searches skip to the next prefix from the start state
+  st->special = st->accept || n == 0 || (re->prefix_len && inject && n == d->start_n &&
+    !memcmp(d->set, d->start_set, sizeof(int) * n));
+  for(int i = 0; i < re->nclasses; i++) d->trans[d->nstates * re->nclasses + i] = -1;
+  d->bytes += size;
+
+  unsigned int k = h & d->mask;
+  while(d->slots[k]) k = (k + 1) & d->mask;
+  d->slots[k] = d->nstates + 1;
+  return d->nstates++;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+int regexStart(REGEX* re, REGEX_DFA* d, int line_start, int inject) {
+  // the state before the first byte that is searched, at the start of a line or not
+  int* cached = line_start ? &d->start_line : &d->start_mid;
+  if(*cached >= 0) return *cached;
+  int n = 0, begin = 0;
+  d->stamp++;
+  if(line_start || !re->bol) regexClosure(d, &n, d->start);
+  regexGroupEnd(d, &n, &begin);
+  *cached = regexStateFind(re, d, n, inject);
+  return *cached;
+}
+
+int regexNext(REGEX* re, REGEX_DFA* d, int st, unsigned char c) {
+  // returns the state after the byte c
+  int k = re->byteclass[c];
+  int next = d->trans[st * re->nclasses + k];
+  if(next != -1) return (next < 0 ? -next - 2 : next) / re->nclasses;
+
+  REGEX_STATE* s = &d->states[st];
+  int n = 0, begin = 0, inject = s->inject;
+  d->stamp++;
+  for(int i = 0; i <= s->n; i++) {
+    if(i == s->n || s->nfa[i] < 0) {
+      regexGroupEnd(d, &n, &begin);
+      continue;
+    }
+    REGEX_NFA* q = &d->nfa[s->nfa[i]];
+    if(q->type == RN_CLASS && RX_HAS(re->sets[q->cls], c)) regexClosure(d, &n, q->out);
+  }
+  // a match may start after each byte, or only after a newline when anchored to the line start
+  if(inject && (!re->bol || c == '\n')) {
+    regexClosure(d, &n, d->start);
+    regexGroupEnd(d, &n, &begin);
+  }
+
+  unsigned long flushes = d->flushes;
+  next = regexStateFind(re, d, n, inject);
+  // the transition is only kept if the states weren't dropped meanwhile
+  if(d->flushes == flushes) {
+    int at = next * re->nclasses;
+    d->trans[st * re->nclasses + k] = d->states[next].special ? -at - 2 : at;
+  }
+  return next;
+}
 
-  E.numrows++;
-  editorUpdateRowOffset();
-  E.dirty++;
+int regexCut(REGEX* re, REGEX_DFA* d, int st) {
+  // returns the state without the groups after the first one that holds a match,
+  // as the matches that would start later can't be the leftmost one anymore
+  int cut = d->states[st].cut;
+  if(cut >= 0) return cut;
+  REGEX_STATE* s = &d->states[st];
+  int n = 0, match = 0;
+  for(int i = 0; i < s->n && !(match && s->nfa[i] < 0); i++) {
+    d->set[n++] = s->nfa[i];
+    if(s->nfa[i] >= 0 && d->nfa[s->nfa[i]].type == RN_MATCH) match = 1;
+  }
+  unsigned long flushes = d->flushes;
+  cut = regexStateFind(re, d, n, 0);
+  if(d->flushes == flushes) d->states[st].cut = cut;
+  return cut;
 }
 
-void editorFreeRow(E_ROW* row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+int regexForward(REGEX* re, const char* s, int len, int from) {
+  // returns where the leftmost match found at or after the byte from ends, or -1
+  // the longest match of the ones starting there is taken
+  REGEX_DFA* d = &re->fwd;
+  int st = regexStart(re, d, from == 0 || s[from - 1] == '\n', 1);
+  int end = -1;
+  int i = from;
+  while(1) {
+    REGEX_STATE* cur = &d->states[st];
+    if(!cur->special) {
+      // follow the transitions up to a state that needs a look, with one lookup per byte
+      int at = st * re->nclasses, next = -1;
+      while(i < len && (next = d->trans[at + re->byteclass[(unsigned char) s[i]]]) >= 0) {
+        at = next;
+        i++;
+      }
+      if(next < -1) {
+        at = -next - 2;
+        i++;
+      }
+      st = at / re->nclasses;
+      cur = &d->states[st];
+    }
+    if(cur->accept && (!re->eol || i == len || s[i] == '\n')) {
+      end = i;
+      st = regexCut(re, d, st);
+      cur = &d->states[st];
+    }
+    if(i == len || (cur->n == 0 && !cur->inject)) break;
+    if(cur->inject && cur->n == 0) {
+      // nothing may match before the start of the next line
+      const char* nl = memchr(s + i, '\n', len - i);
+      if(!nl) break;
+      i = nl - s + 1;
+      st = regexStart(re, d, 1, 1);
+      continue;
+    }
+    if(re->prefix_len && (st == d->start_line || st == d->start_mid)) {
+      // no match is going on, skip to the next place one may start
+      const char* p = editorFindBytes(s + i, len - i, re->prefix, re->prefix_len);
+      if(!p) break;
+      if(p != s + i) {
+        i = p - s;
+        st = regexStart(re, d, 0, 1);
+        continue;
+      }
+    }
+    st = regexNext(re, d, st, s[i++]);
+  }
+  return end;
 }
 
-void editorDelRow(int at) {
-  if(at < 0 || at >= E.numrows) return;
-  
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(E_ROW) * (E.numrows - at - 1));
-  for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  editorUpdateRowOffset();
-  E.dirty++;
+int regexBackward(REGEX* re, const char* s, int from, int end) {
+  // returns the first byte at or after from that a match ending at the byte end starts at
+  REGEX_DFA* d = &re->rev;
+  int st = regexStart(re, d, 1, 0);
+  int start = -1;
+  int i = end;
+  while(1) {
+    REGEX_STATE* cur = &d->states[st];
+    if(cur->accept && (!re->bol || i == 0 || s[i - 1] == '\n')) start = i;
+    if(i == from || cur->n == 0) break;
+    if(!cur->special) {
+      int at = st * re->nclasses, next = -1;
+      while(i > from && (next = d->trans[at + re->byteclass[(unsigned char) s[i - 1]]]) >= 0) {
+        at = next;
+        i--;
+      }
+      if(next < -1) {
+        at = -next - 2;
+        i--;
+      }
+      st = at / re->nclasses;
+      if(next != -1) continue;
+    }
+    st = regexNext(re, d, st, s[--i]);
+  }
+  return start;
 }
 
-void editorCheckBounds(int *row, int* col) {
-  if(*row < 0) *row = 0;
-  else if(*row >= E.numrows) *row = E.numrows - 1;
-  
-  if(*col < 0) *col = 0;
-  else if(*col >= E.row[*row].rsize) *col = E.row[*row].rsize - 1;
+int regexSearch(REGEX* re, const char* s, int len, int from, int* start, int* end) {
+  // finds the first match in the len bytes at s, at or after the byte from
+  // the bytes may span several lines, no match goes past the end of a line
+  if(from > len) return 0;
+  if(re->literal) {
+    const char* match = editorFindBytes(s + from, len - from, re->literal, re->literal_len);
+    if(!match) return 0;
+    *start = match - s;
+    *end = *start + re->literal_len;
+    return 1;
+  }
+  int e = regexForward(re, s, len, from);
+  if(e < 0) return 0;
+  *start = regexBackward(re, s, from, e);
+  *end = e;
+  return *start >= 0;
 }
 
-int editorMatchClosingCallback() {
-  
-  static int saved_hl_open_row = 0;
-  static int saved_hl_open_col = 0;
-  static int saved_hl_closing_row = 0;
-  static int saved_hl_closing_col = 0;
-  
-  static char has_saved_hl = 0;
-
-  if(has_saved_hl) {
-    int restore_open = 1, restore_closing = 1;
-    // check if the state of the buffer has changed since the last saving
-    // checking for the open bracket character
-    if(saved_hl_open_row >= E.numrows || // has deleted the line
-       saved_hl_open_col >= E.row[saved_hl_open_row].rsize || // has deleted the char
-       E.row[saved_hl_open_row].hl[saved_hl_open_col] != HL_MATCH) // other char in the place 
-      restore_open = 0;
-    
-    if(restore_open) E.row[saved_hl_open_row].hl[saved_hl_open_col] = HL_NORMAL;
-    
-    // checking for the closing bracket character
-    if(saved_hl_closing_row >= E.numrows || // has deleted the line
-       saved_hl_closing_col >= E.row[saved_hl_closing_row].rsize || // has deleted the char
-       E.row[saved_hl_closing_row].hl[saved_hl_closing_col] != HL_MATCH) // other char in the place 
-      restore_closing = 0;
-    
-    if(restore_closing) E.row[saved_hl_closing_row].hl[saved_hl_closing_col] = HL_NORMAL;
-    
-    has_saved_hl = 0;
+REGEX* regexCompile(const char* pattern, const char** error) {
+  // returns the compiled pattern, or NULL and a description of what's wrong with it
+  REGEX* re = calloc(1, sizeof(REGEX));
+  if(!re) die("regexCompile");
+  REGEX_PARSER ps = {pattern, re, NULL, 0, 0, 0, NULL};
+  if(strlen(pattern) > SHIM_REGEX_MAX) {
+    // the parse and the NFA built from it recurse once for each group and byte
+    if(error) *error = "pattern too long";
+    free(re);
+    return NULL;
+  }
+  if(*ps.p == '^') {
+    re->bol = 1;
+    ps.p++;
+  }
+  int root = regexParseAlt(&ps);
+  if(root >= 0 && *ps.p == ')') ps.error = "unmatched )";
+  else if(root >= 0 && regexNullable(ps.nodes, root)) ps.error = "matches an empty string";
+  if(ps.error) {
+    if(error) *error = ps.error;
+    free(ps.nodes);
+    free(re->sets);
+    free(re);
+    return NULL;
   }
 
-  int x = E.curr_x, y = E.curr_y;
-  editorCheckBounds(&y, &x);
-  
-  if(y < E.numrows && E.row[y].rsize == 0) return 0; // strchr fails if current = '\0'
-  
-  char current = E.row[y].render[x];
-
-  if(!is_bracket(current)) return 0;
-
-  int dir = 1; // 1 for searching forward and -1 for searching backward
-  int closing = 0;
-  int inner = -1;
-
-  if(current == '(') {
-    closing = current + 1; // ')'
-    dir = 1;
-  } else if(current == '{' || current == '[') {
-    closing = current + 2; // '}' or ']'
-    dir = 1;
-  } else if(current == ')') {
-    closing = current - 1; // '('
-    dir = -1;
-  } else if(current == '}' || current == ']') {
-    closing = current - 2; // '{' or '['
-    dir = -1;
+  // no match goes past the end of a line
+  for(int i = 0; i < re->nsets; i++) re->sets[i]['\n' >> 3] &= ~(1 << ('\n' & 7));
+
+  re->prefix = malloc(ps.n + 1);
+  if(!re->prefix) die("regexCompile");
+  int literal = regexPrefix(re, ps.nodes, root, re->prefix, &re->prefix_len);
+  if(literal && !re->bol && !re->eol) {
+    re->literal = re->prefix;
+    re->literal_len = re->prefix_len;
+  } else if(re->bol) {
+    re->prefix_len = 0; // lines are skipped to instead
   }
-  
-  int current_row = E.curr_y;
-  int i = x;
- 
-  while(1) {
-    // upper and lower limits of the file
-    if(current_row < 0 || current_row >= E.numrows - 1) break;
- 
-    E_ROW* row = &E.row[current_row];
-    // check if the closing character is in the string
-    
-    char *match = NULL;
-    //char* match = strchr(row->render, closing);
-    
-    if(current_row != E.curr_y) {
-      if(dir == -1) i = row->rsize - 1;
-      else if(dir == 1) i = 0; 
-    }
-    
-    while(i >= 0 && i < row->rsize) {
-      if(!inner && row->render[i] == closing) {
-        match = &row->render[i];
-        break;
-      }
-      if(row->render[i] == current) ++inner;
-      else if(row->render[i] == closing) --inner;
-      
-      i += dir;
-    }
-    
-    if(match && !inner) {
-  
-      has_saved_hl = 1;
-    
-      saved_hl_open_row = y;
-      saved_hl_open_col = x;
-      saved_hl_closing_row = current_row;
-      saved_hl_closing_col = match - row->render;
-      
-      E.row[y].hl[x] = HL_MATCH; // opening
-      row->hl[match - row->render] = HL_MATCH; // closing
-      
-      return 1;
+
+  // split the bytes into the classes that the sets tell apart, the newline gets its own
+  memset(re->byteclass, 0, sizeof(re->byteclass));
+  re->nclasses = 1;
+  for(int i = -1; i < re->nsets; i++) {
+    int remap[512];
+    int n = 0;
+    for(int k = 0; k < 2 * re->nclasses; k++) remap[k] = -1;
+    for(int c = 0; c < 256; c++) {
+      int in = (i < 0) ? c == '\n' : RX_HAS(re->sets[i], c) != 0;
+      int key = re->byteclass[c] * 2 + in;
+      if(remap[key] < 0) remap[key] = n++;
+      re->byteclass[c] = remap[key];
     }
-    current_row += dir;
+    re->nclasses = n;
   }
-  return 0;
+
+  regexDfaInit(&re->fwd, ps.nodes, ps.n, root, 0);
+  regexDfaInit(&re->rev, ps.nodes, ps.n, root, 1);
+  free(ps.nodes);
+  return re;
 }
 
-void editorRowInsertChar(E_ROW* row, int at, char c) {
-  if(at < 0 || at > row->size) at = row->size;
-  
-  char closing = 0;
-  if(c == '(') closing = c + 1;
-  else if(c == '{' || c == '[') closing = c + 2;
-  else if(c == '"' || c == '\'') closing = c;
-  
-  int clen = closing ? 2 : 1;
+void regexFree(REGEX* re) {
+  if(!re) return;
+  regexDfaFree(&re->fwd);
+  regexDfaFree(&re->rev);
+  free(re->sets);
+  free(re->prefix);
+  free(re);
+}
 
-  row->chars = realloc(row->chars, row->size + clen + 1);
-  if(!row->chars) die("rowInsertChar");
-  memmove(&row->chars[at + clen], &row->chars[at], row->size - at + clen);
-  row->size += clen;
-  row->chars[at] = c;
-  if(closing) row->chars[at + 1] = closing;
-  editorUpdateRow(row);
-  E.dirty++;
+int editorCountMatches(REGEX* re, const char* s, int len, int upto) {
+  // counts the matches in the len bytes at s that start before the byte upto
+  int count = 0, at = 0, start, end;
+  while(at < upto && regexSearch(re, s, len, at, &start, &end) && start < upto) {
+    count++;
+    at = end;
+  }
+  return count;
 }
 
-void editorRowAppendString(E_ROW* row, char* s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  // move len bytes from s to row->chars starting at row->size
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+int editorCountInRow(E_ROW* row, int upto) {
+  return E.search.re ? editorCountMatches(E.search.re, rowTreeChars(row), row->size, upto) : 0;
 }
 
-void editorRowDelChar(E_ROW* row, int at) {
-  if(at < 0 || at >= row->size) return;
-  
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void editorCountRun(REGEX* re, const char* s, int len, int first, void (*add)(void*, int, int), void* ctx) {
+  // counts the matches on rows that follow each other in memory, separated by newlines,
+  // with one scan over all of their bytes, first is the index of the first row
+  // add is called for each row that has matches
+  int row = first, count = 0, at = 0, start, end;
+  const char* eol = memchr(s, '\n', len); // end of the row the matches are counted for
+  while(regexSearch(re, s, len, at, &start, &end)) {
+    while(eol && s + start > eol) {
+      // the match is on a row further down
+      if(count) add(ctx, row, count);
+      count = 0;
+      row++;
+      eol = memchr(eol + 1, '\n', s + len - eol - 1);
+    }
+    count++;
+    at = end;
+  }
+  if(count) add(ctx, row, count);
 }
 
-void editorInsertChar(int c) {
-  if(E.curr_y == E.numrows) {
-    // the cursor is on the tilde line after EOF
-    editorInsertRow(E.numrows, "", 0, 0);
+int editorSearchFindRow(int at) {
+  // returns the index into the counted rows of the first one at or below the row at
+  int lo = 0, hi = E.search.nrows;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(E.search.rows[mid].row < at) lo = mid + 1;
+    else hi = mid;
   }
-  // insert char at the current cursor position
-  editorRowInsertChar(&E.row[E.curr_y], E.curr_x, c);
-  E.curr_x++;
-  
-  editorMatchClosingCallback();
+  return lo;
 }
 
-int getLeadingSpaces(int at) {
-  if(at < 0 || at >= E.numrows) return 0;
-  
-  int count = 0;
-  
-  while(count < E.row[at].rsize) {
-    if(E.row[at].render[count] != ' ') break;
-    count++;
+void editorSearchAddRow(int at, int count) {
+  if(E.search.nrows == E.search.cap) {
+    E.search.cap = E.search.cap ? E.search.cap * 2 : 256;
+    E.search.rows = realloc(E.search.rows, sizeof(SEARCH_ROW) * E.search.cap);
+    if(E.search.rows == NULL) die("realloc");
   }
-  return count;
+  SEARCH_ROW* sr = &E.search.rows[E.search.nrows++];
+  sr->row = at;
+  sr->count = count;
+  sr->before = E.search.total;
+  E.search.total += count;
 }
 
-void editorInsertNewLine() {
-  int leading_spaces = getLeadingSpaces(E.curr_y);
+void editorSearchAdd(void* ctx, int at, int count) {
+  (void) ctx;
+  editorSearchAddRow(at, count);
+}
 
-  if(E.curr_x == 0) {
-    // insert an empty line at curr_y
-    editorInsertRow(E.curr_y, "", 0, leading_spaces);
+void editorSearchSetQuery(const char* query) {
+  int qlen = strlen(query);
+  if(E.search.query && !strcmp(E.search.query, query)) return;
+
+  REGEX* old_re = E.search.re;
+  E.search.error = NULL;
+  E.search.re = qlen ? regexCompile(query, &E.search.error) : NULL;
+
+  if(old_re && old_re->literal && E.search.re && E.search.re->literal &&
+     memmem(E.search.re->literal, E.search.re->literal_len, old_re->literal, old_re->literal_len)) {
+    // every match of a string that holds the old one is on a row that matched it,
+    // so only those rows have to be counted again, the strings are compared
+    // rather than the queries since a\ and a\. don't look for the same bytes
+    SEARCH_ROW* old = E.search.rows;
+    int nold = E.search.nrows;
+    E.search.rows = NULL;
+    E.search.nrows = E.search.cap = 0;
+    E.search.total = 0;
+    for(int i = 0; i < nold; i++) {
+      int count = editorCountInRow(rowTreeRow(old[i].row), INT_MAX);
+      if(count) editorSearchAddRow(old[i].row, count);
+    }
+    free(old);
   } else {
-    // split line at curr_x
-    E_ROW* row = &E.row[E.curr_y];
-    // create a new row after the current one, with the characters to the right of the cursor
-    editorInsertRow(E.curr_y + 1, &row->chars[E.curr_x], row->size - E.curr_x, leading_spaces);
-    row = &E.row[E.curr_y];
-    row->size = E.curr_x; // truncate the current line
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    E.search.nrows = 0;
+    E.search.scanned = 0;
+    E.search.total = 0;
   }
-  E.curr_y++;
-  E.curr_x = leading_spaces;
-  
-  editorMatchClosingCallback();
+  regexFree(old_re);
+
+  free(E.search.query);
+  E.search.query = strdup(query);
+  if(E.search.query == NULL) die("strdup");
+  E.search.qlen = qlen;
+  E.search.current = 0;
+  E.search.gen++;
 }
 
-void editorDelChar() {
-  if(E.curr_y == E.numrows) return; // cursor is past the EOF, nothing to delete
-  if(E.curr_y == 0 && E.curr_x == 0) return; // cursor is at the beginning of the first line, nothing to do  
+int editorSearchPending() {
+  // tells if there are rows left to count matches on
+  return E.search.re && E.search.scanned < E.numrows;
+}
 
-  E_ROW* row = &E.row[E.curr_y];
-  if(E.curr_x > 0) { // there is a character to the left of the cursor
-    editorRowDelChar(row, E.curr_x - 1);
-    E.curr_x--;
-  } else { // beginning of a line
-    E.curr_x = E.row[E.curr_y - 1].size; // point cursor to the end of the previous line
-    editorRowAppendString(&E.row[E.curr_y - 1], row->chars, row->size);
-    editorDelRow(E.curr_y);
-    E.curr_y--;
+int editorSearchRun(int at, int limit, const char** s, int* len) {
+  // finds the rows from at on whose characters follow each other in the file mapping,
+  // up to limit rows or about SHIM_SEARCH_RUN bytes, returns how many there are
+  // compressed rows are searched without being uncompressed in the tree, one at a time
+  E_ROW* row = rowTreeRow(at);
+  int n = 1;
+  *s = rowTreeChars(row);
+  *len = row->size;
+  while(at + n < limit && *len < SHIM_SEARCH_RUN) {
+    E_ROW* next = rowTreeRow(at + n);
+    if(!(row->flags & ROW_MAPPED) || !(next->flags & ROW_MAPPED) || next->chars != row->chars + row->size + 1) break;
+    row = next;
+    *len = row->chars + row->size - *s;
+    n++;
   }
-  editorMatchClosingCallback();
+  return n;
 }
 
-char* editorRowsToString(int* buflen) {
-  int j, totlen = 0;
+void editorSearchCount(double budget_ms) {
+  // counts the matches on the rows that are left, for about budget_ms milliseconds
+  PROBE_BEGIN(PROBE_SEARCH);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // the rows that a worker is counting are left to it
+  int busy = (E.search.jobs && E.search.job_gen == E.search.gen);
+  while(!busy && editorSearchPending()) {
+    const char* s;
+    int len, at = E.search.scanned;
+    E.search.scanned += editorSearchRun(at, E.numrows, &s, &len);
+    editorCountRun(E.search.re, s, len, at, editorSearchAdd, NULL);
+    if(editorElapsedMs(&start) >= budget_ms) break;
+  }
+  editorSearchUpdateCurrent();
+  PROBE_END(PROBE_SEARCH);
+}
 
-  for(j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1; // line len + newline character
+void editorSearchUpdateCurrent() {
+  if(E.search.current == 0 && E.search.re && E.curr_y < E.search.scanned) {
+    // the cursor is on a match that has just been counted
+    int i = editorSearchFindRow(E.curr_y);
+    if(i < E.search.nrows && E.search.rows[i].row == E.curr_y)
+      E.search.current = E.search.rows[i].before + 1 + editorCountInRow(editorRowAt(E.curr_y), E.curr_x);
   }
-  *buflen = totlen;
+}
+
+void editorSearchEnd() {
+  free(E.search.query);
+  free(E.search.rows);
+  regexFree(E.search.re);
+  E.search.query = NULL;
+  E.search.qlen = 0;
+  E.search.re = NULL;
+  E.search.error = NULL;
+  E.search.rows = NULL;
+  E.search.nrows = E.search.cap = 0;
+  E.search.scanned = 0;
+  E.search.total = E.search.current = 0;
+  E.search.gen++; // jobs that are still running get ignored
+}
 
-  char* buf = malloc(totlen);
-  char* p = buf;
-  for(j = 0; j < E.numrows; j++) {
-    // copy content of the row to the end of the buffer
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size; *p = '\n'; p++;
+// matches on a chunk of rows, counted by a worker
+typedef struct searchJob {
+  EDITOR_JOB job;
+  char* query;       // compiled again by the job, as the DFA of a pattern is built while it's used
+  unsigned long gen; // E.search.gen the job was started for
+  int from, to;      // rows counted
+  SEARCH_ROW* rows;  // rows with matches, the before field isn't set
+  int nrows, cap;
+} SEARCH_JOB;
+
+void editorSearchJobAdd(void* ctx, int at, int count) {
+  SEARCH_JOB* sj = ctx;
+  if(sj->nrows == sj->cap) {
+    sj->cap = sj->cap ? sj->cap * 2 : 256;
+    sj->rows = realloc(sj->rows, sizeof(SEARCH_ROW) * sj->cap);
+    if(!sj->rows) die("editorSearchJobAdd");
   }
-  return buf;
+  sj->rows[sj->nrows].row = at;
+  sj->rows[sj->nrows].count = count;
+  sj->nrows++;
 }
 
-void editorOpen(const char* filename) {
-  free(E.filename);
-  E.filename = strdup(filename); // makes a copy of the string
+void editorSearchJobRun(EDITOR_JOB* job) {
+  SEARCH_JOB* sj = (SEARCH_JOB*) job;
+  REGEX* re = regexCompile(sj->query, NULL);
+  if(!re) return;
+  SNAP_ROW* rows = job->snap->rows;
+  SNAP_READER r = {job->snap, -1, NULL, 0};
+  for(int j = sj->from; j < sj->to;) {
+    // the rows that follow each other in the file mapping are scanned in one go
+    const char* s = snapRowChars(&r, j);
+    int n = 1, len = rows[j].size;
+    while(j + n < sj->to && len < SHIM_SEARCH_RUN) {
+      SNAP_ROW* prev = &rows[j + n - 1];
+      SNAP_ROW* next = &rows[j + n];
+      if(!prev->mapped || !next->mapped || next->chars != prev->chars + prev->size + 1) break;
+      len = next->chars + next->size - s;
+      n++;
+    }
+    editorCountRun(re, s, len, j, editorSearchJobAdd, sj);
+    j += n;
+  }
+  free(r.buf);
+  regexFree(re);
+}
 
-  editorSelectSyntaxHighlight();
+void editorSearchJobDone(EDITOR_JOB* job) {
+  SEARCH_JOB* sj = (SEARCH_JOB*) job;
+  E.search.jobs--;
 
-  FILE* fp = fopen(filename, "r");
-  if(!fp) die("fopen");
-  
-  char* line = NULL;
-  size_t linecapacity = 0;
-  int linelen;
+  if(sj->gen == E.search.gen && sj->from == E.search.scanned) {
+    for(int i = 0; i < sj->nrows; i++) editorSearchAddRow(sj->rows[i].row, sj->rows[i].count);
+    E.search.scanned = sj->to;
+    editorSearchUpdateCurrent();
+  }
+  free(sj->query);
+  free(sj->rows);
+  free(sj);
+  // count the next chunk, or start over for a new query
+  editorSearchStartJob();
+}
 
-  // getline allocates new memory for the next line it reads
-  // it sets line to point to the memory allocated 
-  // and sets linecapacity to how much memory it allocated
-  while((linelen = getline(&line, &linecapacity, fp)) != -1) { // isn't EOF
-    // strip off the newline or carriage return at the end of the line
-    while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
-    }
-    editorInsertRow(E.numrows, line, linelen, 0);
+void editorSearchStartJob() {
+  // let a worker count the matches on the next chunk of rows
+  if(E.search.jobs || !editorSearchPending()) return;
+
+  SEARCH_JOB* sj = malloc(sizeof(SEARCH_JOB));
+  if(!sj) die("editorSearchStartJob");
+  sj->job.run = editorSearchJobRun;
+  sj->job.done = editorSearchJobDone;
+  sj->job.snap = editorSnapshot();
+  sj->query = strdup(E.search.query);
+  if(!sj->query) die("strdup");
+  sj->gen = E.search.gen;
+  sj->from = E.search.scanned;
+  sj->to = sj->from + SHIM_SEARCH_CHUNK;
+  if(sj->to > sj->job.snap->nrows) sj->to = sj->job.snap->nrows;
+  sj->rows = NULL;
+  sj->nrows = sj->cap = 0;
+
+  E.search.jobs++;
+  E.search.job_gen = sj->gen;
+  editorJobSubmit(&sj->job);
+}
+
+
+int editorSearchInRow(E_ROW* row, int from, int direction, int* len) {
+  // returns the first match at or after the character from when searching forward,
+  // or the last one that starts before it when searching backward, -1 if there is none
+  // len is set to the length of the match
+  int start, end, last = -1, at = 0;
+  if(direction == 1) {
+    if(!regexSearch(E.search.re, row->chars, row->size, from, &start, &end)) return -1;
+    *len = end - start;
+    return start;
   }
-  editorUpdateRowOffset();
-  free(line); fclose(fp);
-  E.dirty = 0;
+  while(regexSearch(E.search.re, row->chars, row->size, at, &start, &end) && start < from) {
+    last = start;
+    *len = end - start;
+    at = end;
+  }
+  return last;
 }
 
-void editorSave() {
-  if(E.filename == NULL) {
-    // prompt the user to input a filename when saving a new file
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if(!E.filename) {
-      editorSetStatusMessage("Save aborted");
-      return;
+int editorSearchNext(int* y, int* x, int* len, int direction) {
+  // moves y and x to the next match in the given direction, wrapping around the file
+  // len is the length of the match at y and x, it's set to the length of the next one
+  // returns 0 if there is no match
+  E_ROW* row;
+  int match;
+
+  if(*y >= 0 && *y < E.numrows) {
+    // another match on the same row, the matches don't overlap
+    row = editorRowAt(*y);
+    if((match = editorSearchInRow(row, direction == 1 ? *x + *len : *x, direction, len)) >= 0) {
+      *x = match;
+      return 1;
     }
-    editorSelectSyntaxHighlight();
   }
-  int len;
-  char* buf = editorRowsToString(&len);
-  
-  // open the file for input/output (O_RDWR)
-  // and tell open to create a new file if it doesn't exist (O_CREAT)
-  // 0644 is the permission mode that the new file should have
-  // it gives to the owner of the file the read and write permissions
-  // everyone else can only read the file
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if(fd != -1) {
-    // truncate the file's size, to len bytes 
-    if(ftruncate(fd, len) != -1) {
-      if(write(fd, buf, len) == len) {
-        close(fd); free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+
+  int current_row = *y;
+  if(!editorSearchPending()) {
+    // all the matches have been counted, jump straight to the next row that has any
+    if(E.search.nrows == 0) return 0;
+    int i = editorSearchFindRow(direction == 1 ? current_row + 1 : current_row);
+    if(direction == 1) current_row = E.search.rows[i < E.search.nrows ? i : 0].row;
+    else current_row = E.search.rows[i > 0 ? i - 1 : E.search.nrows - 1].row;
+    row = editorRowAt(current_row);
+    *y = current_row;
+    *x = editorSearchInRow(row, direction == 1 ? 0 : row->size + 1, direction, len);
+    return 1;
+  }
+
+  int i;
+  // loop through all the rows of the file
+  for(i = 0; i < E.numrows; i++) {
+    current_row += direction;
+    // allow a search to wrap around of the file
+    if(current_row == -1) current_row = E.numrows - 1;
+    else if(current_row == E.numrows) current_row = 0;
+
+    row = editorRowAt(current_row);
+    // search the characters of the row, so that rows not rendered yet stay that way
+    if((match = editorSearchInRow(row, direction == 1 ? 0 : row->size + 1, direction, len)) >= 0) {
+      *y = current_row;
+      *x = match;
+      return 1;
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return 0;
 }
 
 void editorFindCallback(char* query, int key) {
 
   static int last_match = -1; // the index of the row that the last match was on
+  static int last_col = -1;   // the character of the row the last match starts at
+  static int last_len = 0;    // length of the last match
   static int direction = 1; // 1 for searching forward and -1 for searching backward
 
-  static int saved_hl_line;
-  static char* saved_hl = NULL;
-
-  if(saved_hl) {
-    // restore previous saved highlighted search result
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
-
   if(key == '\r' || key == '\x1b') {
     // pressed ENTER or Escape key
     // leaving search mode, reset the search states
     last_match = -1;
+    last_col = -1;
     direction = 1;
     return;
   } else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
@@ -986,41 +5894,35 @@ void editorFindCallback(char* query, int key) {
     direction = -1;
   } else {
     last_match = -1;
+    last_col = -1;
     direction = 1;
   }
 
   if(last_match == -1) direction = 1;
-  int current_row = last_match;
 
-  int i;
-  // loop through all the rows of the file 
-  for(i = 0; i < E.numrows; i++) {
-    current_row += direction;
-    // allow a search to wrap around of the file
-    if(current_row == -1) current_row = E.numrows - 1;
-    else if(current_row == E.numrows) current_row = 0;   
- 
-    E_ROW* row = &E.row[current_row];
-    // check if query is a substring of the current row
-    char* match = strstr(row->render, query);
-    if(match) {
-      last_match = current_row;
-      // move the cursor to the match
-      E.curr_y = current_row;
-      E.curr_x = editorRowRxtoCx(row, match - row->render);
-      // force editorScroll to scroll upwards at the next screen refresh
-      // the matching line will be at the very top of the screen
-      E.rowoff = E.numrows;
-    
-      saved_hl_line = current_row;
-      saved_hl = malloc(row->rsize);
-      // save current row syntax highlight status
-      memcpy(saved_hl, row->hl, row->rsize);
-      // set the highlight code of the query substring to HL_MATCH, for colorful search results
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query)); 
-      break;
-    }
+  editorSearchSetQuery(query);
+  if(E.search.re == NULL) return;
+
+  int current_row = last_match, current_col = last_col, current_len = last_len;
+  PROBE_BEGIN(PROBE_SEARCH);
+  int found = editorSearchNext(&current_row, &current_col, &current_len, direction);
+  PROBE_END(PROBE_SEARCH);
+  if(found) {
+    last_match = current_row;
+    last_col = current_col;
+    last_len = current_len;
+    // move the cursor to the match, editorDrawRows highlights the matches on the screen
+    E.curr_y = current_row;
+    E.curr_x = current_col;
+    // force editorScroll to scroll upwards at the next screen refresh
+    // the matching line will be at the very top of the screen
+    E.rowoff = E.numrows;
   }
+
+  // count the matches for a moment, the rest is counted while the user isn't typing
+  E.search.current = 0;
+  editorSearchCount(SHIM_SEARCH_KEY_MS);
+  editorSearchStartJob();
 }
 
 void editorFind() {
@@ -1030,6 +5932,7 @@ void editorFind() {
   int saved_rowoff = E.rowoff;
 
   char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  editorSearchEnd();
   
   if(query) {
     free(query);
@@ -1048,18 +5951,36 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
  
   size_t bufsize = 128; // buffer capacity
   char* buf = malloc(bufsize);
+  if(!buf) die("editorPrompt");
   buf[0] = '\0'; // initialize as an empty string
 
   size_t buflen = 0;
   
   while(1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    editorScroll(); // the callback may have moved the cursor
 
+    E.prompting = 1;
     int c = editorReadKey(STDIN_FILENO);
+    E.prompting = 0;
     if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if(buflen != 0) buf[--buflen] = '\0'; // delete last inserted character
     }
+    else if(c == PASTE_START) { // pasted text goes in the prompt, up to the first line end
+      int len;
+      char* text = editorReadPaste(STDIN_FILENO, &len);
+      for(int i = 0; i < len && text[i] != '\n'; i++) {
+        if(buflen == bufsize - 1) {
+          bufsize *= 2;
+          char* grown = realloc(buf, bufsize);
+          if(!grown) die("editorPrompt");
+          buf = grown;
+        }
+        buf[buflen++] = text[i];
+        buf[buflen] = '\0';
+      }
+      free(text);
+    }
     else if(c == '\x1b') { // pressed the Escape key
       editorSetStatusMessage(""); // exit from prompt
       if(callback) callback(buf, c);
@@ -1074,19 +5995,326 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
     } else if(!iscntrl(c) && c < 128) { // is a printable character
       if(buflen == bufsize - 1) { // buflen has reached the maximum capacity 
         bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        char* grown = realloc(buf, bufsize);
+        if(!grown) die("editorPrompt");
+        buf = grown;
       }
       buf[buflen++] = c;
       buf[buflen] = '\0';
     }
-    if(callback) callback(buf, c);
+    if(callback) callback(buf, c);
+  }
+}
+
+void editorBufferShare(struct editorConfig* to, const struct editorConfig* from) {
+  // copy what belongs to the editor rather than to a buffer
+  to->screenrows = from->screenrows;
+  to->screencols = from->screencols;
+  memcpy(to->statusmsg, from->statusmsg, sizeof(to->statusmsg));
+  to->statusmsg_time = from->statusmsg_time;
+  to->prompting = from->prompting;
+  to->syntaxes = from->syntaxes;
+  to->nsyntaxes = from->nsyntaxes;
+  to->front = from->front;
+  to->back = from->back;
+  to->gridrows = from->gridrows;
+  to->gridcols = from->gridcols;
+  to->front_valid = from->front_valid;
+  to->front_rowoff = from->front_rowoff;
+  to->front_coloff = from->front_coloff;
+  to->frame = from->frame;
+  memcpy(to->sgr, from->sgr, sizeof(to->sgr));
+  memcpy(to->sgr_len, from->sgr_len, sizeof(to->sgr_len));
+  to->orig_termios = from->orig_termios;
+}
+
+int editorBufferFind(int id) {
+  for(int i = 0; i < B.len; i++) {
+    if(i == B.current ? E.id == id : B.list[i].state.id == id) return i;
+  }
+  return -1;
+}
+
+void editorBufferEnter(int at) {
+  // make the buffer at index 'at' the one in E, nothing else changes
+  if(at == B.current) return;
+  B.list[B.current].state = E;
+  editorBufferShare(&B.list[at].state, &E);
+  E = B.list[at].state;
+  B.current = at;
+}
+
+void editorRowDropRender(E_ROW* row) {
+  // free the render and the hl of a row, they're built again when the row is needed
+  // since the comment state at the end of the row is kept
+  if(!row->render) return;
+  if(row->flags & ROW_LONG) editorLongLineDrop(row);
+  rowMemFree(editorRowTabs(row), row->render_cap);
+  row->render = NULL;
+  row->hl = NULL;
+  row->rsize = row->render_cap = row->ntabs = 0;
+}
+
+void editorBufferDropCaches() {
+  // free the render and the hl of the rows of the buffer in E
+  for(int j = 0; j < E.numrows; j++) editorRowDropRender(rowTreeRow(j));
+}
+
+int rowLeafPack(ROW_LEAF* leaf) {
+  // compress the characters of the rows of a leaf that aren't in the file mapping,
+  // returns the bytes of row memory freed
+  static char* raw = NULL, * packed = NULL;
+  static int raw_size = 0;
+
+  int freed = 0, len = 0;
+  for(int i = 0; i < leaf->node.count; i++) {
+    E_ROW* row = &leaf->rows[i];
+    freed += row->render_cap;
+    editorRowDropRender(row);
+    if(!(row->flags & ROW_MAPPED)) len += row->size;
+  }
+  if(len < 256) return freed; // not worth a block of its own
+  if(len > raw_size) {
+    raw_size = len;
+    raw = realloc(raw, raw_size);
+    packed = realloc(packed, raw_size);
+    if(!raw || !packed) die("rowLeafPack");
+  }
+  char* p = raw;
+  for(int i = 0; i < leaf->node.count; i++) {
+    E_ROW* row = &leaf->rows[i];
+    if(row->flags & ROW_MAPPED) continue;
+    memcpy(p, row->chars, row->size);
+    p += row->size;
+  }
+  // text that doesn't get at least an eighth smaller stays as it is
+  int plen = lzCompress(raw, len, packed, len - len / 8);
+  if(!plen) return freed;
+
+  leaf->packed = malloc(plen);
+  if(!leaf->packed) die("rowLeafPack");
+  memcpy(leaf->packed, packed, plen);
+  leaf->packed_len = plen;
+  leaf->packed_raw = len;
+  leaf->packed_gen = E.snap_gen;
+  C.raw_bytes += len;
+  C.packed_bytes += plen;
+  for(int i = 0; i < leaf->node.count; i++) {
+    E_ROW* row = &leaf->rows[i];
+    if(row->flags & ROW_MAPPED) continue;
+    freed += row->chars_cap;
+    if(editorRowShared(row)) editorBuryChars(row->chars, row->chars_cap);
+    else rowMemFree(row->chars, row->chars_cap);
+    row->chars = NULL;
+    row->chars_cap = 0;
+    row->flags |= ROW_PACKED;
+  }
+  return freed;
+}
+
+int editorColdPack(int from, int to, double budget_ms, struct timespec* start) {
+  // pack the leaves of the buffer in E whose rows are all in [from, to), for about budget_ms,
+  // returns the row where it stopped, to once they're done
+  if(E.hl_stale || E.load.job) return to; // they'd be uncompressed again to be highlighted
+  int at = from;
+  while(at < to && at < E.numrows) {
+    int base;
+    ROW_LEAF* leaf = rowTreeFind(at, &base);
+    if(base + leaf->node.count > to) return to;
+    if(base >= from && !leaf->packed) {
+      rowLeafPack(leaf);
+      // the cached snapshot would keep the characters that were freed, once some are
+      if(leaf->packed && E.snap) {
+        editorSnapshotRelease(E.snap);
+        E.snap = NULL;
+      }
+    }
+    at = base + leaf->node.count;
+    if(editorElapsedMs(start) >= budget_ms) break;
+  }
+  return at < to ? at : to;
+}
+
+void editorColdSweep() {
+  // compress the rows far from the screen, when the rows take too much memory
+  // the other buffers are cold as a whole, the current one only away from the screen
+  long long used = M.slab_bytes - M.free_bytes - (long long) M.slab_left + M.big_bytes;
+  if(used < SHIM_COLD_MIN) {
+    editorTimerSet(TIMER_COLD, SHIM_COLD_MS, editorColdSweep);
+    return;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int current = B.current;
+  for(int i = 0; i < B.len && editorElapsedMs(&start) < SHIM_COLD_BUDGET_MS; i++) {
+    if(i == current || B.list[i].cold) continue;
+    editorBufferEnter(i);
+    E.cold_next = editorColdPack(E.cold_next, E.numrows, SHIM_COLD_BUDGET_MS, &start);
+    int done = (E.cold_next >= E.numrows);
+    if(done) E.cold_next = 0;
+    editorBufferEnter(current);
+    B.list[i].cold = done;
+  }
+  int lo = E.rowoff - SHIM_COLD_ROWS, hi = E.rowoff + E.screenrows + SHIM_COLD_ROWS;
+  int next = E.cold_next;
+  if(next < lo) next = editorColdPack(next, lo, SHIM_COLD_BUDGET_MS, &start);
+  if(next >= lo && editorElapsedMs(&start) < SHIM_COLD_BUDGET_MS) {
+    next = editorColdPack(next > hi ? next : hi, E.numrows, SHIM_COLD_BUDGET_MS, &start);
+  }
+  E.cold_next = (next >= E.numrows) ? 0 : next;
+  // while there are rows left to compress, look again after about a frame
+  int more = (editorElapsedMs(&start) >= SHIM_COLD_BUDGET_MS);
+  editorTimerSet(TIMER_COLD, more ? SHIM_FRAME_MS : SHIM_COLD_MS, editorColdSweep);
+}
+
+void editorBufferTrim() {
+  // when the rows take too much memory, the buffers that weren't used for the longest
+  // time give up their render and hl first
+  while(M.slab_bytes - M.free_bytes - (long long) M.slab_left + M.big_bytes > SHIM_BUFFER_CACHE) {
+    int oldest = -1;
+    for(int i = 0; i < B.len; i++) {
+      if(i == B.current || !B.list[i].cached) continue;
+      if(oldest < 0 || B.list[i].last_used < B.list[oldest].last_used) oldest = i;
+    }
+    if(oldest < 0) return;
+
+    int current = B.current;
+    editorBufferEnter(oldest);
+    editorBufferDropCaches();
+    editorBufferEnter(current);
+    B.list[oldest].cached = 0;
+  }
+}
+
+void editorBufferSwitch(int at) {
+  // make another buffer the current one
+  if(at == B.current) return;
+  editorMatchRestore();
+  B.list[B.current].last_used = ++B.clock;
+  B.list[B.current].cached = 1;
+  B.list[B.current].cold = 0;
+  editorBufferEnter(at);
+  E.front_valid = 0; // the whole screen changes
+  // catch up with what was written to a followed file in the meantime
+  if(E.follow.fd != -1) E.follow.pending = 1;
+  editorBufferTrim();
+  editorSetStatusMessage("Buffer %d/%d: %s", at + 1, B.len, E.filename ? E.filename : "[No Name]");
+}
+
+void editorBufferNew() {
+  // add an empty buffer after the others and make it the current one
+  if(B.len >= B.cap) {
+    B.cap = B.cap ? B.cap * 2 : 4;
+    B.list = realloc(B.list, sizeof(E_BUFFER) * B.cap);
+    if(!B.list) die("editorBufferNew");
+  }
+  editorMatchRestore();
+  B.list[B.current].state = E;
+  B.list[B.current].last_used = ++B.clock;
+  B.list[B.current].cached = 1;
+  B.list[B.current].cold = 0;
+  B.current = B.len++;
+  B.list[B.current].cached = 1;
+  B.list[B.current].cold = 0;
+  editorBufferInit();
+  E.front_valid = 0;
+}
+
+void editorBufferOpen() {
+  // open a file in a new buffer, or switch to the buffer that has it already
+  char* filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if(!filename) return;
+
+  for(int i = 0; i < B.len; i++) {
+    const char* name = (i == B.current) ? E.filename : B.list[i].state.filename;
+    if(name && !strcmp(name, filename)) {
+      free(filename);
+      editorBufferSwitch(i);
+      return;
+    }
+  }
+  if(access(filename, F_OK) == 0 && access(filename, R_OK) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    free(filename);
+    return;
+  }
+
+  editorBufferNew();
+  if(access(filename, F_OK) == 0) {
+    editorOpen(filename);
+  } else { // a new file, created when it's saved
+    E.filename = strdup(filename);
+    if(!E.filename) die("strdup");
+    editorSelectSyntaxHighlight();
+  }
+  free(filename);
+  editorBufferTrim();
+}
+
+void editorBufferFree() {
+  // free what the buffer in E owns
+  editorMatchRestore();
+  editorLoadCancel();
+  // the jobs of the buffer need it to be there when they finish
+  while(E.hl_jobs || E.save_jobs || E.search.jobs) {
+    struct pollfd pfd = {W.pipe[0], POLLIN, 0};
+    if(poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+    editorJobsFinish();
+  }
+  editorCacheSave();
+  if(E.follow.fd != -1) {
+    close(E.follow.fd);
+    close(E.follow.notify);
+  }
+  if(E.snap) editorSnapshotRelease(E.snap); // the graveyard is emptied with the last snapshot
+  E.snap = NULL;
+  for(int j = E.numrows - 1; j >= 0; j--) {
+    editorFreeRow(rowTreeRow(j)); // compressed rows aren't uncompressed just to be freed
+    rowTreeDelete(j);
+  }
+  if(E.map) munmap(E.map, E.mapsize);
+  editorSearchEnd();
+  free(E.long_lines);
+  free(E.graveyard);
+  free(E.undo.buf);
+  free(E.follow.buf);
+  free(E.filename);
+}
+
+void editorBufferClose() {
+  // close the current buffer, the last one is replaced by an empty buffer
+  editorBufferFree();
+  if(B.len == 1) {
+    editorBufferInit();
+    E.front_valid = 0;
+    return;
+  }
+  int closed = B.current;
+  int next = (closed + 1 < B.len) ? closed + 1 : closed - 1;
+  editorBufferEnter(next);
+  // the slots after the closed one move down
+  memmove(&B.list[closed], &B.list[closed + 1], sizeof(E_BUFFER) * (B.len - closed - 1));
+  B.len--;
+  if(B.current > closed) B.current--;
+  E.front_valid = 0;
+  if(E.follow.fd != -1) E.follow.pending = 1;
+  editorSetStatusMessage("Buffer %d/%d: %s", B.current + 1, B.len, E.filename ? E.filename : "[No Name]");
+}
+
+int editorBuffersDirty() {
+  // count the buffers with unsaved changes
+  int n = 0;
+  for(int i = 0; i < B.len; i++) {
+    if(i == B.current ? E.dirty : B.list[i].state.dirty) n++;
   }
+  return n;
 }
 
 void editorMoveCursor(int key) {
   // check if the cursor is on an actual line of the source file or not
   // if it is, point row to the editor row (E_ROW structure) that the cursor is on
-  E_ROW* row = (E.curr_y >= E.numrows) ? NULL : &E.row[E.curr_y];
+  E_ROW* row = (E.curr_y >= E.numrows) ? NULL : editorRowAt(E.curr_y);
 
   switch(key) {
     case ARROW_LEFT :
@@ -1094,7 +6322,7 @@ void editorMoveCursor(int key) {
       else if(E.curr_y > 0) { // curr_x == 0 and isn't the first line
         // pressed <- (ARROW_LEFT) at the beginning of the line
         // move cursor to the end of the previous line
-        E.curr_y--; E.curr_x = E.row[E.curr_y].size;
+        E.curr_y--; E.curr_x = editorRowAt(E.curr_y)->size;
       }
       break;
     case ARROW_RIGHT :
@@ -1113,7 +6341,7 @@ void editorMoveCursor(int key) {
       if(E.curr_y < E.numrows) E.curr_y++; // move the cursor down
       break;
   }
-  row = (E.curr_y >= E.numrows) ? NULL : &E.row[E.curr_y];
+  row = (E.curr_y >= E.numrows) ? NULL : editorRowAt(E.curr_y);
   int rowlen = row ? row->size : 0;
   // set curr_x to the end of the line if it is to the right of the end of that line
   if(E.curr_x > rowlen) E.curr_x = rowlen;
@@ -1121,9 +6349,70 @@ void editorMoveCursor(int key) {
   editorMatchClosingCallback();
 }
 
+void editorMoveCursorTo(int y, int x) {
+  // put the cursor at a position of the text, with as few rows scrolled as needed
+  // a position that isn't on the screen is shown in its middle
+  if(y > E.numrows) y = E.numrows;
+  if(y < 0) y = 0;
+  E_ROW* row = editorRowAt(y);
+  int rowlen = row ? row->size : 0;
+  E.curr_y = y;
+  E.curr_x = (x < 0) ? 0 : (x > rowlen) ? rowlen : x;
+  if(y < E.rowoff || y >= E.rowoff + E.screenrows) {
+    E.rowoff = y - E.screenrows / 2;
+    if(E.rowoff < 0) E.rowoff = 0;
+  }
+  editorMatchClosingCallback();
+}
+
+void editorGoto() {
+  // jump to a line, or to a byte offset of the text with a leading @, like @0x1f3a0
+  char* input = editorPrompt("Go to line or @offset: %s (ESC to cancel)", NULL);
+  if(!input) return;
+
+  char* p = input;
+  while(*p == ' ') p++;
+  int offset = (*p == '@');
+  if(offset) p++;
+  char* end;
+  errno = 0;
+  long long n = strtoll(p, &end, 0);
+  while(*end == ' ') end++;
+  if(end == p || *end || errno || n < 0) {
+    editorSetStatusMessage("Not a %s: %s", offset ? "byte offset" : "line number", input);
+  } else if(offset) {
+    int x, y = editorRowAtOffset(n, &x);
+    if(y == E.numrows) editorSetStatusMessage(E.load.job ? "Byte %lld isn't loaded yet, %lld are" :
+      "Byte %lld is past the end, at %lld", n, editorRowOffset(E.numrows));
+    editorMoveCursorTo(y, x);
+  } else {
+    editorMoveCursorTo(n > E.numrows ? E.numrows - 1 : n - 1, 0);
+  }
+  free(input);
+}
+
 void editorProcessKeypress(int fd) {
   static int quit_times = SHIM_QUIT_TIMES;
+  static int close_times = SHIM_QUIT_TIMES; // Ctrl-W counts down on its own
   int c = editorReadKey(fd);
+  PROBE_BEGIN(PROBE_KEY);
+
+  int kind = UNDO_EDIT;
+  if(c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) kind = UNDO_ERASING;
+  else if(c == '\t' || (c < 128 && !iscntrl(c))) kind = UNDO_TYPING;
+  editorUndoStep(kind);
+
+  // a file that is still loading can be read and searched, but not changed yet
+  if(E.load.job && (kind != UNDO_EDIT || c == '\r' || c == PASTE_START ||
+     c == CTRL_KEY('s') || c == CTRL_KEY('z') || c == CTRL_KEY('y'))) {
+    if(c == PASTE_START) {
+      int len;
+      free(editorReadPaste(fd, &len));
+    }
+    editorSetStatusMessage("Still loading, the file can't be changed yet. Ctrl-W closes it");
+    PROBE_END(PROBE_KEY);
+    return;
+  }
 
   // handle a keypress
   switch(c) {
@@ -1132,10 +6421,18 @@ void editorProcessKeypress(int fd) {
       break;
 
     case CTRL_KEY('q'):
-      if(E.dirty && quit_times > 0) { // if modified since last file save or opening
-        editorSetStatusMessage("WARNING!!! File has unsaved changes."
-          "Press Ctrl-Q %d more times to quit.", quit_times);
-        quit_times--; return;
+      if(editorBuffersDirty() && quit_times > 0) { // if modified since last file save or opening
+        editorSetStatusMessage("WARNING!!! %s unsaved changes."
+          "Press Ctrl-Q %d more times to quit.", B.len > 1 ? "Buffers have" : "File has", quit_times);
+        quit_times--;
+        close_times = SHIM_QUIT_TIMES;
+        PROBE_END(PROBE_KEY);
+        return;
+      }
+      // the jobs still running only leave more rows without a known comment state
+      for(int i = 0; i < B.len; i++) {
+        editorBufferEnter(i);
+        editorCacheSave();
       }
       // clear the screen and reposition the cursor
       write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -1147,18 +6444,63 @@ void editorProcessKeypress(int fd) {
       editorSave();
       break;
 
+    case CTRL_KEY('o'):
+      editorBufferOpen();
+      break;
+
+    case CTRL_KEY('n'): // next buffer
+    case CTRL_KEY('b'): // previous buffer
+      if(B.len > 1) editorBufferSwitch((B.current + (c == CTRL_KEY('n') ? 1 : B.len - 1)) % B.len);
+      break;
+
+    case CTRL_KEY('w'):
+      if(E.dirty && close_times > 0) {
+        editorSetStatusMessage("WARNING!!! File has unsaved changes."
+          "Press Ctrl-W %d more times to close it.", close_times);
+        close_times--;
+        quit_times = SHIM_QUIT_TIMES;
+        PROBE_END(PROBE_KEY);
+        return;
+      }
+      editorBufferClose();
+      break;
+
     case HOME_KEY : 
       E.curr_x = 0;
+      editorMatchClosingCallback();
       break;
 
     case END_KEY :
-      if(E.curr_y < E.numrows) E.curr_x = E.row[E.curr_y].size;
+      if(E.curr_y < E.numrows) E.curr_x = editorRowAt(E.curr_y)->size;
+      editorMatchClosingCallback();
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
 
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
+    case CTRL_KEY('t'):
+      editorMemoryStats();
+      break;
+
+    case CTRL_KEY('e'):
+      editorSafeToggle();
+      break;
+
+#ifdef SHIM_PROBES
+    case CTRL_KEY('p'):
+      P.overlay = !P.overlay;
+      break;
+#endif
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1169,15 +6511,19 @@ void editorProcessKeypress(int fd) {
     case PAGE_UP:
     case PAGE_DOWN:
       {
-        if(c == PAGE_UP){
-          E.curr_y = E.rowoff;
-        } else if(c == PAGE_DOWN){
-          E.curr_y = E.rowoff + E.screenrows - 1;
-          if(E.curr_y > E.numrows) E.curr_y = E.numrows;
-        }
-        int times = E.screenrows;
-        while(times--) editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+        // a screen above the top row or below the bottom one, the rows scroll along with the cursor
+        int y = (c == PAGE_UP) ? E.rowoff - E.screenrows : E.rowoff + 2 * E.screenrows - 1;
+        if(y < 0) y = 0;
+        if(y > E.numrows) y = E.numrows;
+        E_ROW* row = editorRowAt(y);
+        E.curr_y = y;
+        if(E.curr_x > (row ? row->size : 0)) E.curr_x = row ? row->size : 0;
       }
+      editorMatchClosingCallback();
+      break;
+
+    case CTRL_KEY('g'):
+      editorGoto();
       break;
 
     case ARROW_UP:
@@ -1185,26 +6531,49 @@ void editorProcessKeypress(int fd) {
     case ARROW_LEFT:
     case ARROW_RIGHT:
       editorMoveCursor(c);
+      editorMatchClosingCallback(); // the cursor may be on a bracket now
+      break;
+
+    case CTRL_KEY('l') : // draw the whole screen again at the next refresh
+      E.front_valid = 0;
       break;
 
-    // ignore terminal refresh and Escape key presses
-    case CTRL_KEY('l') :
+    // ignore Escape key presses
     case '\x1b': 
       break;
+
+    case PASTE_START:
+      {
+        int len;
+        char* text = editorReadPaste(fd, &len);
+        editorInsertText(text, len);
+        free(text);
+      }
+      break;
     
     default:
-      editorInsertChar(c);
+      {
+        int len;
+        char* text = editorReadBurst(c, &len);
+        if(text) {
+          editorInsertText(text, len);
+          free(text);
+        } else {
+          editorInsertChar(c);
+        }
+      }
       break;
   }
-  // if pressed any other key than Ctrl-Q, then resets quit_times back
-  quit_times = SHIM_QUIT_TIMES;
+  // if pressed any other key than Ctrl-Q or Ctrl-W, then resets their counts back
+  quit_times = close_times = SHIM_QUIT_TIMES;
+  PROBE_END(PROBE_KEY);
 }
 
 void editorScroll() {
   
   E.render_x = 0;
   if(E.curr_y < E.numrows) {
-    E.render_x = editorRowCxtoRx(&E.row[E.curr_y], E.curr_x);  
+    E.render_x = editorRowCxtoRx(editorRowAt(E.curr_y), E.curr_x);  
   }
   // checks if the cursor is above the visible window
   if(E.curr_y < E.rowoff) {
@@ -1225,12 +6594,211 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(A_BUF* ab) {
+void editorScreenResize() {
+  // allocate the cell grids for the current terminal size, forcing a full repaint
+  int rows = E.screenrows + 2; // the status bar and the message bar
+  int cols = E.screencols;
+  if(rows == E.gridrows && cols == E.gridcols && E.front.chars) return;
+
+  SCREEN_GRID* grids[2] = {&E.front, &E.back};
+  for(int i = 0; i < 2; i++) {
+    free(grids[i]->chars);
+    free(grids[i]->styles);
+    grids[i]->chars = malloc(rows * cols);
+    grids[i]->styles = malloc(rows * cols);
+    if(!grids[i]->chars || !grids[i]->styles) die("editorScreenResize");
+  }
+  E.gridrows = rows;
+  E.gridcols = cols;
+  E.front_valid = 0;
+}
+
+void editorScreenClearRows(SCREEN_GRID* grid, int from, int to) {
+  // fill rows [from, to) with blank cells, which is what a cleared terminal shows
+  memset(&grid->chars[from * E.gridcols], ' ', (to - from) * E.gridcols);
+  memset(&grid->styles[from * E.gridcols], HL_NORMAL, (to - from) * E.gridcols);
+}
+
+void editorScreenPut(int r, int* col, const char* s, int len, int style) {
+  // write len characters into the new frame at row r, starting at *col
+  for(int i = 0; i < len && *col < E.gridcols; i++, (*col)++) {
+    E.back.chars[r * E.gridcols + *col] = s[i];
+    E.back.styles[r * E.gridcols + *col] = style;
+  }
+}
+
+void editorScreenPutStyled(int r, int* col, const char* s, const unsigned char* styles, int len) {
+  // write len characters with a style each, like the highlight of a row
+  if(len > E.gridcols - *col) len = E.gridcols - *col;
+  if(len <= 0) return;
+  memcpy(&E.back.chars[r * E.gridcols + *col], s, len);
+  memcpy(&E.back.styles[r * E.gridcols + *col], styles, len);
+  *col += len;
+}
+
+int editorStyleToSGR(int style, char* buf, int size) {
+  // escape sequence that switches the terminal to a cell style, from any previous style
+  if(style == HL_NORMAL) return snprintf(buf, size, "\x1b[0m");
+  if(style == STYLE_INVERSE) return snprintf(buf, size, "\x1b[0;7m");
+
+  int color = editorSyntaxToStyle(style);
+  if(style == HL_MATCH || style == HL_ERROR) { // change background style
+    return snprintf(buf, size, "\x1b[0;48;2;%d;%d;%d;1m", RED(color), GREEN(color), BLUE(color));
+  }
+  return snprintf(buf, size, "\x1b[0;38;2;%d;%d;%d%sm", RED(color), GREEN(color), BLUE(color),
+                  IS_BOLD(color) ? ";1" : (IS_ITALIC(color) ? ";3" : ""));
+}
+
+void editorScreenScroll(A_BUF* ab, int delta) {
+  // scroll the text area of the terminal by delta rows, delta > 0 moves the text up
+  // the rows that were already on the screen don't have to be sent again
+  int rows = E.screenrows, cols = E.gridcols;
+  int n = delta > 0 ? delta : -delta;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[0m\x1b[1;%dr", rows); // set the scroll region
+  abAppend(ab, buf, len);
+
+  if(delta > 0) {
+    // line feeds at the bottom of the scroll region move its text up
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", rows);
+    abAppend(ab, buf, len);
+    for(int i = 0; i < n; i++) abAppend(ab, "\n", 1);
+    memmove(E.front.chars, &E.front.chars[n * cols], (rows - n) * cols);
+    memmove(E.front.styles, &E.front.styles[n * cols], (rows - n) * cols);
+    editorScreenClearRows(&E.front, rows - n, rows);
+  } else {
+    // reverse line feeds at the top of the scroll region move its text down
+    abAppend(ab, "\x1b[1;1H", 6);
+    for(int i = 0; i < n; i++) abAppend(ab, "\x1bM", 2);
+    memmove(&E.front.chars[n * cols], E.front.chars, (rows - n) * cols);
+    memmove(&E.front.styles[n * cols], E.front.styles, (rows - n) * cols);
+    editorScreenClearRows(&E.front, 0, n);
+  }
+  abAppend(ab, "\x1b[r", 3); // reset the scroll region
+}
+
+int editorScreenHasMultibyte(const char* s, int len) {
+  for(int i = 0; i < len; i++) {
+    if(s[i] & 0x80) return 1;
+  }
+  return 0;
+}
+
+void editorScreenFlush(A_BUF* ab) {
+  // emit only the cells of the new frame that differ from the last one
+  int cols = E.gridcols;
+  int style = -1; // current style of the terminal, unknown at the beginning
+  int cr = -1, cc = -1; // current position of the terminal cursor
+
+  for(int r = 0; r < E.gridrows; r++) {
+    char* fc = &E.front.chars[r * cols];
+    unsigned char* fs = &E.front.styles[r * cols];
+    char* bc = &E.back.chars[r * cols];
+    unsigned char* bs = &E.back.styles[r * cols];
+
+    if(!memcmp(fc, bc, cols) && !memcmp(fs, bs, cols)) continue; // row didn't change
+
+    // multi-byte characters take less columns than cells, so rows with them are drawn whole
+    int whole = editorScreenHasMultibyte(fc, cols) || editorScreenHasMultibyte(bc, cols);
+    int first = 0, last = cols - 1;
+    if(!whole) {
+      while(fc[first] == bc[first] && fs[first] == bs[first]) first++;
+      while(fc[last] == bc[last] && fs[last] == bs[last]) last--;
+    }
+    // blank cells at the end of the row are cleared with a single escape sequence
+    int blank = cols;
+    while(blank > first && bc[blank - 1] == ' ' && bs[blank - 1] == HL_NORMAL) blank--;
+    int end = (whole || last + 1 > blank) ? blank : last + 1;
+
+    int c = first;
+    while(c < end) {
+      if(!whole && fc[c] == bc[c] && fs[c] == bs[c]) {
+        // jump over unchanged cells, unless moving the cursor takes more bytes than drawing them
+        int gap = c;
+        while(gap < end && fc[gap] == bc[gap] && fs[gap] == bs[gap]) gap++;
+        if(gap - c >= SHIM_SCREEN_GAP || gap == end) {
+          c = gap;
+          continue;
+        }
+      }
+      // find where the span of cells to draw ends, at the next gap worth jumping over
+      int e = c + 1;
+      while(e < end) {
+        if(whole || fc[e] != bc[e] || fs[e] != bs[e]) {
+          e++; continue;
+        }
+        int gap = e;
+        while(gap < end && fc[gap] == bc[gap] && fs[gap] == bs[gap]) gap++;
+        if(gap - e >= SHIM_SCREEN_GAP || gap == end) break;
+        e = gap;
+      }
+      if(cr != r || cc != c) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, c + 1);
+        abAppend(ab, buf, len);
+        cr = r;
+      }
+      // copy each run of cells with the same style at once
+      while(c < e) {
+        int run = c + 1;
+        while(run < e && bs[run] == bs[c]) run++;
+        if(bs[c] != style) {
+          style = bs[c];
+          abAppend(ab, E.sgr[style], E.sgr_len[style]);
+        }
+        abAppend(ab, &bc[c], run - c);
+        c = run;
+      }
+      cc = c;
+    }
+    if(blank < cols && (whole || last >= blank)) {
+      if(cr != r || cc != blank) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, blank + 1);
+        abAppend(ab, buf, len);
+        cr = r; cc = blank;
+      }
+      if(style != HL_NORMAL) {
+        style = HL_NORMAL;
+        abAppend(ab, E.sgr[style], E.sgr_len[style]);
+      }
+      abAppend(ab, "\x1b[K", 3); // clear the rest of the line
+    }
+  }
+  if(style != HL_NORMAL && style != -1) abAppend(ab, "\x1b[0m", 4);
+}
+
+void editorDrawMatches(int r, int col, E_ROW* row, int len) {
+  // paints the matches of the search over the len columns of the row drawn from col on
+  // only the characters around the ones on the screen are searched, so that long rows
+  // cost no more than short ones, a pattern anchored to the line end sees the rest of it
+  REGEX* re = E.search.re;
+  int first = editorRowRxtoCx(row, E.coloff), last = editorRowRxtoCx(row, E.coloff + len);
+  int at = first > SHIM_LINE_CHUNK ? first - SHIM_LINE_CHUNK : 0;
+  int limit = (re->eol || row->size - last <= SHIM_LINE_CHUNK) ? row->size : last + SHIM_LINE_CHUNK;
+  int start, end;
+  while(regexSearch(re, row->chars, limit, at, &start, &end)) {
+    int from = editorRowCxtoRx(row, start) - E.coloff;
+    int to = editorRowCxtoRx(row, end) - E.coloff;
+    if(from >= len) break;
+    if(from < 0) from = 0;
+    if(to > len) to = len;
+    if(to > from) memset(&E.back.styles[r * E.gridcols + col + from], HL_MATCH, to - from);
+    at = end;
+  }
+}
+
+void editorDrawRows() {
   int r;
+  PROBE_BEGIN(PROBE_DRAW);
+
+  // the rows on the screen must be highlighted with their current comment state
+  editorHighlightPending(E.rowoff + E.screenrows, 0);
 
   for(r = 0; r < E.screenrows; r++){
     int filerow = r + E.rowoff; // absolute position in the file
-    
+    int col = 0;
+
     if(filerow >= E.numrows) {
       if(E.numrows == 0 && r == E.screenrows / 3) {
 
@@ -1239,144 +6807,151 @@ void editorDrawRows(A_BUF* ab) {
         if(msg_len > E.screencols) msg_len = E.screencols;
         int padding = (E.screencols - msg_len) / 2;
         if(padding != 0) {
-          abAppend(ab, "~", 1);
+          editorScreenPut(r, &col, "~", 1, HL_NORMAL);
           padding--;
         }
-        while(padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, msg_len);
+        col += padding;
+        editorScreenPut(r, &col, welcome, msg_len, HL_NORMAL);
       }
       else {
-        abAppend(ab, "~", 1);
+        editorScreenPut(r, &col, "~", 1, HL_NORMAL);
       }
     } else {
       // drawing a row that is part of the text buffer
       char linenum[32];
       int lnlen = snprintf(linenum, sizeof(linenum), "%*d ", E.row_num_offset, filerow + 1);
-      abAppend(ab, linenum, lnlen);
+      editorScreenPut(r, &col, linenum, lnlen, HL_NORMAL);
       
       // subtract the number of characters that are to the left of the offset
-      int j, len = E.row[filerow].rsize - E.coloff;
+      E_ROW* row = editorRenderRow(filerow); // rows are rendered when they enter the screen
+      int j, len = row->rsize - E.coloff;
       if(len < 0) len = 0; // scrolled horizontally past the end of the line
       if(len > E.screencols - (E.row_num_offset + 1)) len = E.screencols - E.row_num_offset - 2; // truncate the line
 
-      char* c = &E.row[filerow].render[E.coloff]; // get the render array
-      unsigned char* hl = &E.row[filerow].hl[E.coloff]; // get the highlight array
-      int curr_fgcolor = -1; // current foreground color
-      int curr_bgcolor = -1; // current background color
+      char* c; // the render array
+      unsigned char* hl; // the highlight array
+      editorRowView(row, E.coloff, len, &c, &hl); // a long row is only rendered around the screen
+      int text_col = col;
 
       for(j = 0; j < len; j++){
-
-        if(iscntrl(c[j])) {
+        // the characters up to the next control character are copied with their highlight at once
+        int run = scanControl(&c[j], len - j);
+        editorScreenPutStyled(r, &col, &c[j], &hl[j], run);
+        j += run;
+        if(j < len) {
+          // show control characters as inverted symbols
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4); // invert colors
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3); // turn off inverted colors
-          if(curr_fgcolor != -1) {
-            char buf[32];
-            int colorlen = snprintf(buf, sizeof(buf), "\x1b[38;2;%d;%d;%dm", 
-                                    RED(curr_fgcolor), GREEN(curr_fgcolor), BLUE(curr_fgcolor));
-            abAppend(ab, buf, colorlen);
-          }
-          continue;
-
-        } else if(hl[j] == HL_NORMAL) {			
-          if(curr_fgcolor != -1 || curr_bgcolor != -1) {
-            abAppend(ab, "\x1b[0;39m", 7); // reset the text color to default
-            curr_bgcolor = curr_fgcolor = -1;
-          }
-        } else if(hl[j] == HL_MATCH || hl[j] == HL_ERROR) {
-
-          int bgcolor = editorSyntaxToStyle(hl[j]);
-
-          if(bgcolor != curr_bgcolor) {
-				    curr_fgcolor = -1; // reset foreground color
-            curr_bgcolor = bgcolor;
-				    abAppend(ab, "\x1b[0;39m", 7);            
-
-            char buf[32]; // for color scape sequence string
-            int colorlen = snprintf(buf, sizeof(buf), "\x1b[48;2;%d;%d;%d;1m", 
-                                         RED(bgcolor), GREEN(bgcolor), BLUE(bgcolor));
-            abAppend(ab, buf, colorlen); // set the text background color
-          }
-        } else {
-          int fgcolor = editorSyntaxToStyle(hl[j]);
-          
-          if(fgcolor != curr_fgcolor) {
-				    abAppend(ab, "\x1b[0;39m", 7);
-            curr_fgcolor = fgcolor;
-            curr_bgcolor = -1;
-
-            char buf[32]; // for color scape sequence string
-            
-            int colorlen = snprintf(buf, sizeof(buf), "\x1b[38;2;%d;%d;%d%sm", 
-                                    RED(fgcolor), GREEN(fgcolor), BLUE(fgcolor),
-                                    IS_BOLD(fgcolor) ? ";1" : (IS_ITALIC(fgcolor) ? ";3" : ""));
-                                    
-            abAppend(ab, buf, colorlen); // set the text foreground color
-          }
+          editorScreenPut(r, &col, &sym, 1, STYLE_INVERSE);
         }
-        abAppend(ab, &c[j], 1);
       }
-      abAppend(ab, "\x1b[0;39m", 7); // reset the text color
+      editorDrawBracketMatch(r, text_col, filerow, len);
+      if(E.search.re) editorDrawMatches(r, text_col, row, len);
     }
-    // escape sequence to clear one line(K) at a time
-    abAppend(ab, "\x1b[0K", 4);
-    abAppend(ab, "\r\n", 2);
   }
+  PROBE_END(PROBE_DRAW);
 }
 
-void editorDrawStatusBar(A_BUF* ab){
+void editorDrawStatusBar(){
+  int r = E.screenrows, col = 0;
+  char status[96], row_status[80];
 
-  abAppend(ab, "\x1b[7m", 4); // reverse terminal colors to black text on a white background
-  
-  char status[80], row_status[80];
+  // reverse terminal colors to black text on a white background
+  memset(&E.back.styles[r * E.gridcols], STYLE_INVERSE, E.gridcols);
  
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-    E.filename ? E.filename : "[No Name]", E.numrows, 
-    E.dirty ? "(modified)" : "");
+  char buffer[32] = "";
+  if(B.len > 1) snprintf(buffer, sizeof(buffer), "[%d/%d] ", B.current + 1, B.len);
+  char loading[24] = "";
+  if(E.load.job) snprintf(loading, sizeof(loading), "(loading %d%%) ", (int) (E.load.offset * 100 / E.mapsize));
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s%s%s", buffer,
+    E.filename ? E.filename : "[No Name]", E.numrows, loading, E.safe ? "(safe mode) " : "",
+    E.follow.fd != -1 ? "(following) " : "", E.dirty ? "(modified)" : "");
     
   if(len > E.screencols) len = E.screencols;
 
-  abAppend(ab, status, len);  
-
-  int rlen = snprintf(row_status, sizeof(row_status), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.curr_y + 1, E.numrows);
+  editorScreenPut(r, &col, status, len, STYLE_INVERSE);
+
+  int rlen;
+  if(E.search.error) {
+    rlen = snprintf(row_status, sizeof(row_status), "%s | %d/%d", E.search.error, E.curr_y + 1, E.numrows);
+  } else if(E.search.qlen) {
+    // while searching show which match the cursor is on, and how many there are
+    char current[24];
+    if(E.search.current) snprintf(current, sizeof(current), "%lld", E.search.current);
+    else strcpy(current, "?");
+    rlen = snprintf(row_status, sizeof(row_status), "%s/%lld%s | %d/%d", current, E.search.total,
+      editorSearchPending() ? "+" : "", E.curr_y + 1, E.numrows);
+  } else {
+    long long at = editorRowOffset(E.curr_y) + (E.curr_y < E.numrows ? E.curr_x : 0);
+    rlen = snprintf(row_status, sizeof(row_status), "%s | %d/%d | byte %lld of %lld",
+      E.syntax ? E.syntax->filetype : "no ft", E.curr_y + 1, E.numrows, at, editorRowOffset(E.numrows));
+    if(E.screencols - len < rlen) rlen = strstr(row_status, " | byte") - row_status; // no room for the offset
+  }
 
-  while(len < E.screencols) {
-    if(E.screencols - len == rlen) {
-      abAppend(ab, row_status, rlen); break;
-    }
-    else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+  if(E.screencols - len >= rlen) { // align the row status to the right
+    col = E.screencols - rlen;
+    editorScreenPut(r, &col, row_status, rlen, STYLE_INVERSE);
   }
-  abAppend(ab, "\x1b[0m", 4); // switch back to normal formatting
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(A_BUF* ab){
-  abAppend(ab, "\x1b[K", 3); // clear the line
+void editorDrawMessageBar(){
+  int r = E.screenrows + 1, col = 0;
   
   int msglen = strlen(E.statusmsg);
   if(msglen > E.screencols) msglen = E.screencols;
-  if(msglen && time(NULL) - E.statusmsg_time < 5) 
-    abAppend(ab, E.statusmsg, msglen);
+#ifdef SHIM_PROBES
+  if(P.overlay && !E.prompting) {
+    char probes[256];
+    // the cold rows are the compressed ones, a hit is a leaf that was looked up without uncompressing it
+    double hits = C.lookups ? 100.0 * (C.lookups - C.unpacks) / C.lookups : 100;
+    msglen = snprintf(probes, sizeof(probes),
+      "frame %.2f ms | key %.2f | highlight %.2f, %ld rows | draw %.2f | write %.2f, %ld bytes | search %.2f"
+      " | cold %lld KB in %lld KB, %.1f%% hits",
+      P.last_ms[PROBE_FRAME], P.last_ms[PROBE_KEY], P.last_ms[PROBE_HIGHLIGHT], P.last_rows,
+      P.last_ms[PROBE_DRAW], P.last_ms[PROBE_WRITE], P.last_bytes, P.last_ms[PROBE_SEARCH],
+      C.raw_bytes >> 10, C.packed_bytes >> 10, hits);
+    if(msglen > E.screencols) msglen = E.screencols;
+    editorScreenPut(r, &col, probes, msglen, HL_NORMAL);
+    return;
+  }
+#endif
+  if(msglen && (E.prompting || time(NULL) - E.statusmsg_time < SHIM_STATUS_MS / 1000)) 
+    editorScreenPut(r, &col, E.statusmsg, msglen, HL_NORMAL);
 }
 
 void editorRefreshScreen() {
+  PROBE_BEGIN(PROBE_FRAME);
   editorScroll();
+  editorScreenResize();
+
+  // draw the new frame into the back grid
+  editorScreenClearRows(&E.back, 0, E.gridrows);
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
  
-  A_BUF ab = A_BUF_INIT;
+  A_BUF* ab = &E.frame;
+  ab->len = 0;
 
   // escape sequence to hide/reset(l) the cursor before refreshing the screen 
-  abAppend(&ab, "\x1b[?25l", 6);
-  // escape sequence to reposition(H) the cursor at top-left corner(1,1)
-  abAppend(&ab, "\x1b[1;1H", 6);
-  
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  abAppend(ab, "\x1b[?25l", 6);
+
+  if(!E.front_valid) {
+    // nothing is known about the terminal, clear it and draw everything
+    abAppend(ab, "\x1b[0m\x1b[2J", 8);
+    editorScreenClearRows(&E.front, 0, E.gridrows);
+  } else if(E.rowoff != E.front_rowoff && E.coloff == E.front_coloff &&
+            abs(E.rowoff - E.front_rowoff) < E.screenrows) {
+    editorScreenScroll(ab, E.rowoff - E.front_rowoff);
+  }
+  editorScreenFlush(ab);
+
+  // the new frame is now what the terminal shows
+  SCREEN_GRID tmp = E.front;
+  E.front = E.back;
+  E.back = tmp;
+  E.front_valid = 1;
+  E.front_rowoff = E.rowoff;
+  E.front_coloff = E.coloff;
 
   // escape sequence to reposition the cursor
   char buffer[32];
@@ -1384,13 +6959,22 @@ void editorRefreshScreen() {
   // update the cursor position
   snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (E.curr_y - E.rowoff) + 1, 
                                                   (E.render_x - E.coloff + E.row_num_offset + 1) + 1);
-  abAppend(&ab, buffer, strlen(buffer));  
+  abAppend(ab, buffer, strlen(buffer));  
 
   // escape sequence to show/set(h) the cursor after refreshing the screen 
-  abAppend(&ab, "\x1b[?25h", 6);  
-
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  abAppend(ab, "\x1b[?25h", 6);  
+
+  PROBE_BEGIN(PROBE_WRITE);
+  write(STDOUT_FILENO, ab->b, ab->len);
+  PROBE_END(PROBE_WRITE);
+  L.redraw = L.urgent = 0;
+  L.last_frame = editorNowMs();
+  PROBE_BYTES(ab->len);
+#ifdef SHIM_BENCH
+  bench_frames++;
+  bench_bytes += ab->len;
+#endif
+  PROBE_END(PROBE_FRAME);
 }
 
 void editorSetStatusMessage(const char* fmt, ...){
@@ -1399,6 +6983,8 @@ void editorSetStatusMessage(const char* fmt, ...){
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
   E.statusmsg_time = time(NULL);
+  // draw the screen again without the message once it expires
+  editorTimerSet(TIMER_STATUS, SHIM_STATUS_MS, editorScheduleRedraw);
 }
 
 void updateWindowSize() {
@@ -1406,45 +6992,695 @@ void updateWindowSize() {
   E.screenrows -= 2; // reserve the two last lines for the status bar and the message bar
 }
 
-void handleSigWinCh(int sig) {
+void editorHandleResize() {
   updateWindowSize();
   if(E.curr_y > E.screenrows + E.rowoff - 1) E.curr_y = E.screenrows + E.rowoff - 1;
   if(E.curr_x > (E.screencols + E.coloff - (E.row_num_offset + 1) - 1)) 
     E.curr_x = E.screencols + E.coloff - (E.row_num_offset + 1) - 1;
-  editorRefreshScreen();
+  editorScheduleFrame(1);
 }
 
-void initEditor() {
+void handleSigWinCh(int sig) {
+  // the screen grids can't be touched from a signal handler,
+  // wake up the event loop to handle the resize
+  (void)sig;
+  int saved_errno = errno;
+  if(write(L.wake[1], "", 1) == -1) {} // a full pipe already wakes it up
+  errno = saved_errno;
+}
+
+void editorBufferInit() {
+  // an empty buffer in E, the fields shared by the buffers are left as they are
+  E.id = B.next_id++;
   E.curr_x = E.curr_y = 0;
   E.rowoff = E.coloff = 0;
   E.render_x = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.rowtree = NULL;
+  E.rowcache = NULL;
+  E.rowcache_base = 0;
+  E.map = NULL;
+  E.mapsize = 0;
+  E.map_mtime.tv_sec = E.map_mtime.tv_nsec = 0;
+  E.safe = 0;
+  E.hl_stale = 0;
+  E.hl_stale_from = 0;
+  E.match_pending = 0;
+  E.edits = 0;
+  E.edit_low = INT_MAX;
+  E.snap = NULL;
+  E.snapshots = 0;
+  E.snap_gen = 1;
+  E.shared_gen = 0;
+  E.graveyard = NULL;
+  E.graveyard_len = E.graveyard_cap = 0;
+  E.long_lines = NULL;
+  E.nlong_lines = E.long_lines_cap = 0;
+  E.hl_jobs = E.save_jobs = 0;
+  E.undo.buf = NULL;
+  E.undo.len = E.undo.cap = E.undo.pos = 0;
+  E.undo.last = E.undo.head = -1;
+  E.undo.saved = 0;
+  E.undo.kind = UNDO_EDIT;
+  E.undo.paused = E.undo.lost = 0;
+  E.follow.fd = E.follow.notify = -1;
+  E.follow.offset = 0;
+  E.follow.open_line = E.follow.pending = 0;
+  E.follow.buf = NULL;
+  E.load.offset = 0;
+  E.load.longest = 0;
+  E.load.job = NULL;
+  E.cold_next = 0;
+  memset(&E.search, 0, sizeof(E.search));
   E.dirty = 0;
   E.filename = NULL;
-  E.statusmsg[0] = '\0';
-  E.statusmsg_time = 0;
   E.syntax = NULL;
   E.row_num_offset = 0;
+}
+
+void initEditor() {
+  B.list = NULL;
+  B.len = 1; // the buffer in E
+  B.cap = B.current = 0;
+  B.next_id = 0;
+  B.clock = 0;
+  editorBufferInit();
+
+  E.syntaxes = NULL;
+  E.nsyntaxes = 0;
+  E.statusmsg[0] = '\0';
+  E.statusmsg_time = 0;
+  E.prompting = 0;
+  E.front.chars = E.back.chars = NULL;
+  E.front.styles = E.back.styles = NULL;
+  E.gridrows = E.gridcols = 0;
+  E.front_valid = 0;
+  E.front_rowoff = E.front_coloff = 0;
+  E.frame.b = NULL;
+  E.frame.len = E.frame.cap = 0;
+  for(int style = 0; style < STYLE_COUNT; style++) {
+    E.sgr_len[style] = editorStyleToSGR(style, E.sgr[style], sizeof(E.sgr[style]));
+  }
   
-  updateWindowSize();
+  editorLoopInit();
+  editorTimerSet(TIMER_COLD, SHIM_COLD_MS, editorColdSweep);
+  editorSafeInit();
+  rowMemInit();
+#ifdef SHIM_PROBES
+  probeInit();
+#endif
   signal(SIGWINCH, handleSigWinCh);
+  editorJobsInit();
+}
+
+#ifdef SHIM_BENCH
+// headless benchmark, built by make bench
+// a script of keys is replayed through editorProcessKeypress on generated files,
+// with the frames written to /dev/null, and the latency of each kind of key is reported
+
+#define SHIM_BENCH_ROWS 50
+#define SHIM_BENCH_COLS 160
+#define SHIM_BENCH_PASTE 4096 // bytes of each paste
+#define SHIM_BENCH_SCAN (64 << 20) // bytes of text the scans of --bench-scan go over
+
+// one kind of key in the script, replayed a number of times in a row
+typedef struct benchStep {
+  const char* name;
+  const char* keys; // NULL for a bracketed paste of generated text
+  int times;
+} BENCH_STEP;
+
+static const BENCH_STEP bench_script[] = {
+  {"down", "\x1b[B", 400},
+  {"end", "\x1b[F", 50},
+  {"home", "\x1b[H", 50},
+  {"type", "x", 1000},
+  {"backspace", "\x7f", 500},
+  {"newline", "\r", 200},
+  {"comment", "/*\x7f\x7f", 100}, // opens a comment over the rows below, then closes it again
+  {"page-down", "\x1b[6~", 300},
+  {"page-up", "\x1b[5~", 100},
+  {"paste", NULL, 20},
+  {"undo", "\x1a", 200},
+  {"redo", "\x19", 200},
+  {"find", "\x06return\r", 20},
+};
+
+#define BENCH_STEPS (sizeof(bench_script) / sizeof(bench_script[0]))
+
+// what the keys of a step cost, gathered over all its repetitions
+typedef struct benchStat {
+  double* ms;
+  int n;
+  unsigned long allocs;
+  unsigned long frames;
+  unsigned long long bytes;
+} BENCH_STAT;
+
+int benchCompare(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+double benchPercentile(BENCH_STAT* stat, double p) {
+  // ms must be sorted
+  int i = (int) (p * (stat->n - 1) + 0.5);
+  return stat->ms[i];
+}
+
+double benchHighlightRate() {
+  // megabytes per second that the lexer highlights, over all the rows as the file was opened,
+  // the comment state going from row to row as it does in the background
+  if(!E.syntax) return 0;
+  unsigned char* scratch = NULL;
+  int cap = 0;
+  long long bytes = 0;
+  int in_comment = 0;
+  double start = editorNowMs();
+  for(int j = 0; j < E.numrows; j++) {
+    E_ROW* row = editorRowAt(j);
+    if(row->size > cap) {
+      cap = row->size;
+      scratch = realloc(scratch, cap);
+      if(!scratch) die("benchHighlightRate");
+    }
+    in_comment = editorHighlightLine(E.syntax, row->chars, row->size, scratch, in_comment);
+    bytes += row->size;
+  }
+  double ms = editorNowMs() - start;
+  free(scratch);
+  return ms > 0 ? bytes / ms / 1e3 : 0;
+}
+
+void benchGenerateC(FILE* fp) {
+  // a large C file, lots of short functions
+  for(int i = 0; i < 25000; i++) {
+    fprintf(fp, "/* function %d, returns a number */\n", i);
+    fprintf(fp, "static int func%d(int a, const char* s) {\n", i);
+    fprintf(fp, "  for(int i = 0; i < a; i++) {\n");
+    fprintf(fp, "    if(s[i] == '\"') return 0x%x; // a quote\n", i);
+    fprintf(fp, "  }\n");
+    fprintf(fp, "  return \"str\\\"ing\"[a %% 6] + 1.5e3 * %d;\n", i);
+    fprintf(fp, "}\n\n");
+  }
+}
+
+void benchGenerateLongLines(FILE* fp) {
+  // a few rows of a megabyte each, like minified JSON
+  for(int i = 0; i < 16; i++) {
+    for(int j = 0; j < 25000; j++) fprintf(fp, "{\"key\": %5d, \"v\": [1.5, true, \"str\"]}, ", j);
+    fputc('\n', fp);
+  }
+}
+
+void benchGenerateComments(FILE* fp) {
+  // comments that are opened and closed all along, with their ends in strings and in other comments
+  for(int i = 0; i < 20000; i++) {
+    fprintf(fp, "/* block %d /* still the same comment\n", i);
+    fprintf(fp, "   \"a string in a comment */\n");
+    fprintf(fp, "int in_code%d = '*' / 2; // /* not a comment start\n", i);
+    fprintf(fp, "char* s%d = \"/* not a comment */\"; /* one */ /* two\n", i);
+    fprintf(fp, "   three */ return %d;\n", i);
+  }
+}
+
+void benchRun(const char* name, const char* filename, int report) {
+  // replay the script on a file, in a process of its own so every file starts from scratch
+  int keys[2];
+  if(pipe(keys) == -1) die("pipe");
+  int null = open("/dev/null", O_WRONLY);
+  if(null == -1) die("open");
+  // keys come from the pipe and frames go nowhere, like a terminal that is never slow
+  dup2(keys[0], STDIN_FILENO);
+  dup2(null, STDOUT_FILENO);
+  fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+
+  initEditor();
+  E.screenrows = SHIM_BENCH_ROWS - 2;
+  E.screencols = SHIM_BENCH_COLS;
+
+  double start = editorNowMs();
+  editorOpen(filename);
+  editorRefreshScreen();
+  double open_ms = editorNowMs() - start;
+  editorLoadWait(); // the keys edit the whole file
+  double load_ms = editorNowMs() - start;
+  double hl_rate = benchHighlightRate();
+
+  char paste[SHIM_BENCH_PASTE + 16];
+  int plen = sprintf(paste, "\x1b[200~");
+  while(plen < SHIM_BENCH_PASTE) plen += sprintf(&paste[plen], "int pasted = %d;\n", plen);
+  plen += sprintf(&paste[plen], "\x1b[201~");
+
+  BENCH_STAT stats[BENCH_STEPS];
+  for(unsigned int s = 0; s < BENCH_STEPS; s++) {
+    const BENCH_STEP* step = &bench_script[s];
+    BENCH_STAT* stat = &stats[s];
+    stat->ms = malloc(step->times * sizeof(double));
+    if(!stat->ms) die("benchRun");
+    stat->n = step->times;
+    stat->allocs = stat->frames = stat->bytes = 0;
+    const char* k = step->keys ? step->keys : paste;
+    int klen = step->keys ? (int) strlen(step->keys) : plen;
+
+    for(int i = 0; i < step->times; i++) {
+      // what the workers finished is collected between keys, as the event loop would
+      if(W.running) editorJobsFinish();
+      if(write(keys[1], k, klen) != klen) die("write");
+
+      unsigned long allocs = bench_allocs, frames = bench_frames;
+      unsigned long long bytes = bench_bytes;
+      double t = editorNowMs();
+      while(editorInputPending(STDIN_FILENO)) {
+        editorProcessKeypress(STDIN_FILENO);
+        editorRefreshScreen();
+      }
+      stat->ms[i] = editorNowMs() - t;
+      stat->allocs += bench_allocs - allocs;
+      stat->frames += bench_frames - frames;
+      stat->bytes += bench_bytes - bytes;
+    }
+  }
+
+  FILE* out = fdopen(report, "w");
+  if(!out) die("fdopen");
+  fprintf(out, "%s: %d lines, opened and drawn in %.1f ms, loaded in %.1f ms, highlighted at %.0f MB/s\n",
+    name, E.numrows, open_ms, load_ms, hl_rate);
+  fprintf(out, "  %-10s %6s %9s %9s %9s %9s %10s %12s\n",
+    "keys", "n", "p50 ms", "p90 ms", "p99 ms", "max ms", "allocs", "bytes/frame");
+  for(unsigned int s = 0; s < BENCH_STEPS; s++) {
+    BENCH_STAT* stat = &stats[s];
+    qsort(stat->ms, stat->n, sizeof(double), benchCompare);
+    fprintf(out, "  %-10s %6d %9.3f %9.3f %9.3f %9.3f %10.1f %12.0f\n", bench_script[s].name, stat->n,
+      benchPercentile(stat, 0.5), benchPercentile(stat, 0.9), benchPercentile(stat, 0.99),
+      stat->ms[stat->n - 1], (double) stat->allocs / stat->n,
+      stat->frames ? (double) stat->bytes / stat->frames : 0.0);
+  }
+  fprintf(out, "\n");
+  fclose(out);
+}
+
+int editorBench(int argc, char* argv[]) {
+  // with a file, the script runs on it, otherwise on each generated file
+  static const struct {
+    const char* name;
+    void (*generate)(FILE* fp);
+  } corpora[] = {
+    {"large C file", benchGenerateC},
+    {"long lines", benchGenerateLongLines},
+    {"nested comments", benchGenerateComments},
+  };
+  int ncorpora = argc > 0 ? argc : (int) (sizeof(corpora) / sizeof(corpora[0]));
+
+  for(int c = 0; c < ncorpora; c++) {
+    char filename[64];
+    const char* name;
+    if(argc > 0) {
+      name = argv[c];
+    } else {
+      // the .c suffix turns on the highlight for C
+      name = corpora[c].name;
+      strcpy(filename, "/tmp/shim-bench-XXXXXX.c");
+      int fd = mkstemps(filename, 2);
+      if(fd == -1) die("mkstemps");
+      FILE* fp = fdopen(fd, "w");
+      corpora[c].generate(fp);
+      fclose(fp);
+    }
+
+    pid_t pid = fork();
+    if(pid == -1) die("fork");
+    if(pid == 0) {
+      benchRun(name, argc > 0 ? argv[c] : filename, dup(STDOUT_FILENO));
+      exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if(argc == 0) unlink(filename);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) return 1;
+  }
+  return 0;
+}
+
+int benchExpandTabsBytes(const char* s, int len, char* out, int* tab_cx, int* tab_end) {
+  // editorExpandTabs a byte at a time, to compare it with
+  int idx = 0, k = 0;
+  for(int j = 0; j < len; j++) {
+    if(s[j] == '\t') {
+      out[idx++] = ' ';
+      while(idx % SHIM_TAB_STOP != 0) out[idx++] = ' ';
+      tab_cx[k] = j;
+      tab_end[k++] = idx;
+    } else {
+      out[idx++] = s[j];
+    }
+  }
+  return idx;
+}
+
+// the rows of the text of --bench-scan, where each one starts and its length
+typedef struct benchText {
+  char* buf;
+  int len;
+  int* start;
+  int* size;
+  int nrows;
+} BENCH_TEXT;
+
+long long benchScanTabs(BENCH_TEXT* t, int scalar) {
+  long long n = 0;
+  for(int j = 0; j < t->nrows; j++) {
+    const char* s = t->buf + t->start[j];
+    n += scalar ? scanCountByteScalar(s, t->size[j], '\t') : scanCountByte(s, t->size[j], '\t');
+  }
+  return n;
+}
+
+long long benchScanControl(BENCH_TEXT* t, int scalar) {
+  long long n = 0;
+  for(int j = 0; j < t->nrows; j++) {
+    const char* s = t->buf + t->start[j];
+    n += scalar ? scanControlScalar(s, t->size[j]) : scanControl(s, t->size[j]);
+  }
+  return n;
+}
+
+long long benchScanNewlines(BENCH_TEXT* t, int scalar) {
+  long long n = 0;
+  const char* p = t->buf;
+  const char* end = t->buf + t->len;
+  if(scalar) {
+    for(; p < end; p++) n += (*p == '\n');
+    return n;
+  }
+  while((p = memchr(p, '\n', end - p)) != NULL) {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+long long benchScanExpand(BENCH_TEXT* t, int scalar) {
+  static char out[1 << 16];
+  static int tab_cx[1 << 12], tab_end[1 << 12];
+  long long n = 0;
+  for(int j = 0; j < t->nrows; j++) {
+    const char* s = t->buf + t->start[j];
+    n += scalar ? benchExpandTabsBytes(s, t->size[j], out, tab_cx, tab_end) :
+                  editorExpandTabs(s, t->size[j], out, tab_cx, tab_end);
+  }
+  return n;
+}
+
+int editorBenchScan() {
+  // compare the vector scans with the byte at a time ones, on rows of source code
+  // indented with tabs, the same rows are gone over by each scan
+  BENCH_TEXT t;
+  t.buf = malloc(SHIM_BENCH_SCAN + 256);
+  if(!t.buf) die("editorBenchScan");
+  t.len = t.nrows = 0;
+  for(int i = 0; t.len < SHIM_BENCH_SCAN; i++) {
+    static const char* lines[] = {
+      "\tfor(int i = 0; i < n; i++) {\n",
+      "\t\tif(s[i] == '\\t') total += width(s, i); // a tab\n",
+      "\t\treturn \"a string that is a little longer than the others\";\n",
+      "\t}\n",
+      "\n",
+      "static int helper(const char* s, int len) { return len > 0 ? s[0] : -1; }\n",
+    };
+    t.len += sprintf(t.buf + t.len, "%s", lines[i % 6]);
+    t.nrows++;
+  }
+  t.start = malloc(t.nrows * sizeof(int));
+  t.size = malloc(t.nrows * sizeof(int));
+  if(!t.start || !t.size) die("editorBenchScan");
+  int pos = 0;
+  for(int j = 0; j < t.nrows; j++) {
+    const char* nl = memchr(t.buf + pos, '\n', t.len - pos);
+    t.start[j] = pos;
+    t.size[j] = nl - (t.buf + pos);
+    pos += t.size[j] + 1;
+  }
+
+  static const struct {
+    const char* name;
+    long long (*run)(BENCH_TEXT* t, int scalar);
+  } scans[] = {
+    {"tabs", benchScanTabs}, // counted in each row
+    {"expand", benchScanExpand}, // tabs expanded in each row
+    {"control", benchScanControl}, // control characters looked for in each row
+    {"newlines", benchScanNewlines}, // counted in the whole text, with memchr
+  };
+  printf("%d MB of text, %d rows\n", t.len >> 20, t.nrows);
+  printf("  %-10s %12s %12s %8s\n", "scan", "bytes MB/s", "vector MB/s", "speedup");
+  for(unsigned int k = 0; k < sizeof(scans) / sizeof(scans[0]); k++) {
+    double ms[2];
+    long long result[2];
+    for(int scalar = 1; scalar >= 0; scalar--) {
+      // the best of a few runs, the first one also brings the text into the cache
+      ms[scalar] = 1e30;
+      for(int run = 0; run < 3; run++) {
+        double start = editorNowMs();
+        result[scalar] = scans[k].run(&t, scalar);
+        double took = editorNowMs() - start;
+        if(took < ms[scalar]) ms[scalar] = took;
+      }
+    }
+    if(result[0] != result[1]) {
+      printf("%s: the vector scan found %lld instead of %lld\n", scans[k].name, result[0], result[1]);
+      return 1;
+    }
+    printf("  %-10s %12.0f %12.0f %7.1fx\n", scans[k].name,
+      t.len / ms[1] / 1e3, t.len / ms[0] / 1e3, ms[1] / ms[0]);
+  }
+  free(t.buf);
+  free(t.start);
+  free(t.size);
+  return 0;
+}
+
+// checks of behaviours that broke before, run by make check
+
+int checkSearchTotal(const char* query) {
+  // the matches of the query counted on every row, -1 if it doesn't compile
+  editorSearchSetQuery(query);
+  while(editorSearchPending()) editorSearchCount(1e9);
+  return E.search.re ? E.search.total : -1;
+}
+
+int checkSearch() {
+  // each query is typed after the ones before it, like in the prompt, and must count
+  // what the same query counts from scratch
+  static const char* rows[] = {
+    "x = a.b + a.c;",
+    "path = \"a\\\\.d\";",
+    "ab ba [ab] [ba]",
+  };
+  static const struct {
+    const char* queries[4];
+    int total; // of the last query
+  } cases[] = {
+    {{"a", "a\\", "a\\."}, 2},
+    {{"a", "ab"}, 2},
+    {{"[ab", "[ab]"}, 13},
+    {{"a.", "a\\.", "a\\.b"}, 1},
+  };
+  for(unsigned int i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+    editorInsertRow(E.numrows, (char*) rows[i], strlen(rows[i]), 0);
+
+  int failed = 0;
+  for(unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    for(int q = 0; q < 4 && cases[c].queries[q]; q++) {
+      const char* query = cases[c].queries[q];
+      int typed = checkSearchTotal(query);
+      editorSearchEnd();
+      int fresh = checkSearchTotal(query);
+      int last = (q == 3 || !cases[c].queries[q + 1]);
+      if(typed != fresh || (last && fresh != cases[c].total)) {
+        printf("search %s: %d matches after the queries before it, %d from scratch\n", query, typed, fresh);
+        failed = 1;
+      }
+    }
+    editorSearchEnd();
+  }
+
+  char pattern[SHIM_REGEX_MAX + 2];
+  memset(pattern, '(', sizeof(pattern) - 1);
+  pattern[sizeof(pattern) - 1] = '\0';
+  const char* error = NULL;
+  if(regexCompile(pattern, &error) || !error) {
+    printf("search: a pattern of %d bytes was compiled\n", (int) strlen(pattern));
+    failed = 1;
+  }
+  return failed;
+}
+
+void checkJobsWait() {
+  while(W.running) {
+    struct pollfd pfd = {W.pipe[0], POLLIN, 0};
+    if(poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+    editorJobsFinish();
+  }
+}
+
+char* checkPackRows(int nrows, int* len) {
+  // appends nrows rows that compress well and packs all of them,
+  // returns their text as it would be saved
+  char* text = malloc(nrows * 32);
+  if(!text) die("checkPackRows");
+  *len = 0;
+  for(int j = 0; j < nrows; j++) {
+    int n = sprintf(text + *len, "int value_%d = %d;", j, j % 7);
+    editorInsertRow(E.numrows, text + *len, n, 0);
+    *len += n;
+    text[(*len)++] = '\n';
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  editorColdPack(0, E.numrows, 1e9, &start);
+  return text;
+}
+
+int checkCold() {
+  // a save and a search, on the main thread and on a worker, read the compressed rows
+  // without uncompressing them in the tree
+  char filename[] = "/tmp/shim-check-XXXXXX";
+  int fd = mkstemp(filename);
+  if(fd == -1) die("mkstemp");
+  close(fd);
+  E.filename = strdup(filename);
+  if(!E.filename) die("strdup");
+  int nrows = 64 * SHIM_ROW_LEAF_MAX, len;
+  char* text = checkPackRows(nrows, &len);
+  long long raw = C.raw_bytes;
+  unsigned long unpacks = C.unpacks;
+
+  int failed = 0;
+  editorSave();
+  checkJobsWait();
+  FILE* fp = fopen(filename, "r");
+  char* saved = malloc(len + 1);
+  if(!fp || !saved) die("checkCold");
+  if(fread(saved, 1, len + 1, fp) != (size_t) len || memcmp(saved, text, len)) {
+    printf("cold: the compressed rows weren't saved as they are\n");
+    failed = 1;
+  }
+  fclose(fp);
+  unlink(filename);
+
+  int expect = nrows / 7 + (nrows % 7 > 3);
+  int total = checkSearchTotal("= 3;");
+  editorSearchEnd();
+  editorSearchSetQuery("= 3;");
+  editorSearchStartJob();
+  checkJobsWait();
+  if(total != expect || E.search.total != expect || E.search.scanned != E.numrows) {
+    printf("cold: %d and %lld matches instead of %d\n", total, E.search.total, expect);
+    failed = 1;
+  }
+  if(raw == 0 || C.raw_bytes != raw || C.unpacks != unpacks) {
+    printf("cold: %lld bytes compressed, %lld after the save and the search, %lu leaves uncompressed\n",
+      raw, C.raw_bytes, C.unpacks - unpacks);
+    failed = 1;
+  }
+  free(saved);
+  free(text);
+  return failed;
+}
+
+int checkColdSyntax() {
+  // selecting a syntax marks the compressed rows stale, and a worker finds their comment
+  // states, without uncompressing them
+  int len;
+  free(checkPackRows(SHIM_JOB_MIN_ROWS, &len));
+  unsigned long unpacks = C.unpacks;
+  long long raw = C.raw_bytes;
+
+  int failed = 0;
+  E.filename = strdup("check.c");
+  if(!E.filename) die("strdup");
+  editorSelectSyntaxHighlight();
+  if(!E.syntax || E.hl_stale != E.numrows) {
+    printf("cold syntax: %d rows of %d are stale\n", E.hl_stale, E.numrows);
+    failed = 1;
+  }
+  if(!editorHighlightStartJob()) {
+    printf("cold syntax: the rows weren't highlighted by a worker\n");
+    failed = 1;
+  }
+  checkJobsWait();
+  if(E.hl_stale) {
+    printf("cold syntax: %d rows are still stale after the worker\n", E.hl_stale);
+    failed = 1;
+  }
+  if(raw == 0 || C.raw_bytes != raw || C.unpacks != unpacks) {
+    printf("cold syntax: %lld bytes compressed, %lld after highlighting, %lu leaves uncompressed\n",
+      raw, C.raw_bytes, C.unpacks - unpacks);
+    failed = 1;
+  }
+  return failed;
+}
+
+int editorCheck() {
+  static const struct {
+    const char* name;
+    int (*run)();
+  } checks[] = {
+    {"search", checkSearch},
+    {"cold", checkCold}, // compressed rows
+    {"cold hl", checkColdSyntax},
+  };
+  initEditor();
+  int failed = 0;
+  for(unsigned int k = 0; k < sizeof(checks) / sizeof(checks[0]); k++) {
+    // each check starts from an empty buffer
+    int bad = checks[k].run();
+    editorBufferClose();
+    printf("  %-10s %s\n", checks[k].name, bad ? "FAILED" : "ok");
+    failed |= bad;
+  }
+  return failed;
 }
+#endif
 
 int main(int argc, char* argv[]) {
+#ifdef SHIM_BENCH
+  if(argc >= 2 && strcmp(argv[1], "--bench") == 0) return editorBench(argc - 2, argv + 2);
+  if(argc >= 2 && strcmp(argv[1], "--bench-scan") == 0) return editorBenchScan();
+  if(argc >= 2 && strcmp(argv[1], "--check") == 0) return editorCheck();
+#endif
   enableRawMode();
   initEditor();
-
-  if(argc >= 2) {
-    editorOpen(argv[1]);
+  updateWindowSize();
+  editorLoadSyntaxes();
+
+  // with -f, lines written to the file while it's open are appended, like tail -f does
+  int follow = (argc >= 3 && (strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "--follow") == 0));
+  if(argc >= 2 + follow) {
+    editorOpen(argv[1 + follow]);
+    if(follow) {
+      editorFollowStart();
+      E.curr_y = E.numrows > 0 ? E.numrows - 1 : 0;
+    }
     updateWindowSize();
   }
+  // the other files go in buffers of their own, the first one stays the current one
+  for(int i = 2 + follow; i < argc; i++) {
+    editorBufferNew();
+    editorOpen(argv[i]);
+  }
+  if(B.len > 1) editorBufferEnter(0);
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  // a message about a syntax file that can't be used is shown instead of the help
+  if(E.statusmsg[0] == '\0') {
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo | Ctrl-O = open");
+  }
 
+  // the frames are drawn by the event loop while it waits for keys
+  editorScheduleFrame(1);
   while(1) {
-    editorRefreshScreen();
     editorProcessKeypress(STDIN_FILENO);
+    editorScroll(); // keys like PAGE_DOWN start from the rows on the screen
   }
 
   return 0;